@@ -0,0 +1,357 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Throughput benchmark for the whole acquisition path, without hardware.
+
+	Usage: nidaq-acquisition-benchmark [numChannels] [sampleRate] [scansPerRead] [numReads] [replayFile] [decimation]
+
+	Reads blocks from an unpaced MockBackend (synthesized, or replayed from
+	a file of interleaved 16-bit codes) and times each stage NIDAQmx::readBlock
+	goes through: the backend read, the deinterleave/scale conversion, the
+	digital edge and event code extraction, the FIR decimation (for a
+	factor above 1) and the push into a ring buffer laid out like DataBuffer.
+	Reports ns/sample and samples/s for each stage and how many times faster
+	than real time the whole path runs at sampleRate. Pass "-" as replayFile
+	to decimate synthesized data. With decimation, first checks that a step
+	on AI and a DI edge at the same scan land on the same output sample.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../Source/NIDAQBackend.h"
+#include "../Source/NIDAQKernels.h"
+
+/* Stand-in for DataBuffer (which lives in the GUI executable): channel-major
+   float rows plus per-scan sample numbers, timestamps and event codes */
+class RingBuffer
+{
+public:
+	RingBuffer(int numChannels_, int size_)
+		: numChannels(numChannels_), size(size_), writeIndex(0),
+		data(size_t(numChannels_) * size_), sampleNumbers(size_), timestamps(size_), eventCodes(size_) {}
+
+	int addToBuffer(const float* in, const int64_t* sampleNumbers_, const double* timestamps_, const uint64_t* eventCodes_, int numItems)
+	{
+		numItems = std::min(numItems, size);
+
+		int first = std::min(numItems, size - writeIndex);
+		int second = numItems - first;
+
+		for (int ch = 0; ch < numChannels; ch++)
+		{
+			const float* row = in + size_t(ch) * numItems;
+			float* dest = data.data() + size_t(ch) * size;
+			std::copy_n(row, first, dest + writeIndex);
+			std::copy_n(row + first, second, dest);
+		}
+
+		std::copy_n(sampleNumbers_, first, sampleNumbers.data() + writeIndex);
+		std::copy_n(sampleNumbers_ + first, second, sampleNumbers.data());
+		std::copy_n(timestamps_, first, timestamps.data() + writeIndex);
+		std::copy_n(timestamps_ + first, second, timestamps.data());
+		std::copy_n(eventCodes_, first, eventCodes.data() + writeIndex);
+		std::copy_n(eventCodes_ + first, second, eventCodes.data());
+
+		writeIndex = (writeIndex + numItems) % size;
+
+		return numItems;
+	}
+
+private:
+	int numChannels;
+	int size;
+	int writeIndex;
+	std::vector<float> data;
+	std::vector<int64_t> sampleNumbers;
+	std::vector<double> timestamps;
+	std::vector<uint64_t> eventCodes;
+};
+
+enum STAGE {
+	STAGE_READ = 0,
+	STAGE_CONVERT,
+	STAGE_EVENTS,
+	STAGE_DECIMATE,
+	STAGE_PUSH,
+	NUM_STAGES
+};
+
+static double nanosecondsSince(std::chrono::steady_clock::time_point& start)
+{
+	auto now = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(now - start).count();
+	start = now;
+	return ns;
+}
+
+/* Event codes of the last getDelay() scans, and the line states not yet handed to a decimated output */
+struct DecimatedEvents
+{
+	std::vector<uint64_t> delayedCodes;
+	std::vector<uint64_t> decimatedCodes;
+	int64_t nextCodeSample;
+	uint64_t linesSeen;
+
+	DecimatedEvents(const FIRDecimator& decimator, int maxScans)
+		: delayedCodes(decimator.getDelay()), decimatedCodes(decimator.getMaxOutputs(maxScans)), nextCodeSample(0), linesSeen(0) {}
+};
+
+/* Decimates a block the way NIDAQmx::convertBlock does: each output is numbered with the scan it is centered on, which for the
+   first outputs is one of the last getDelay() scans of the previous block, and ORs the line states since the previous output */
+static int decimateBlock(FIRDecimator& decimator, const float* in, int numScans, int64_t firstSample, float* out, int* outputScans,
+	int64_t* sampleNumbers, uint64_t* eventCodes, DecimatedEvents& events)
+{
+	std::vector<uint64_t>& delayedCodes = events.delayedCodes;
+	std::vector<uint64_t>& decimatedCodes = events.decimatedCodes;
+	const int delay = decimator.getDelay();
+	const int numOutputs = decimator.process(in, numScans, firstSample, out, outputScans);
+
+	for (int j = 0; j < numOutputs; j++)
+		sampleNumbers[j] = (firstSample + outputScans[j]) / decimator.getFactor();
+
+	int j = 0;
+	for (int k = int(std::max(events.nextCodeSample - firstSample, int64_t(-delay))); k < numScans - delay; k++)
+	{
+		events.linesSeen |= k < 0 ? delayedCodes[delay + k] : eventCodes[k];
+		if (j < numOutputs && k == outputScans[j])
+		{
+			decimatedCodes[j++] = events.linesSeen;
+			events.linesSeen = 0;
+		}
+	}
+	events.nextCodeSample = std::max(events.nextCodeSample, firstSample + numScans - delay);
+
+	const int kept = std::min(numScans, delay);
+	std::copy(delayedCodes.begin() + kept, delayedCodes.end(), delayedCodes.begin());
+	std::copy_n(eventCodes + numScans - kept, kept, delayedCodes.end() - kept);
+	std::copy_n(decimatedCodes.begin(), numOutputs, eventCodes);
+
+	return numOutputs;
+}
+
+/* A step on one AI channel and a rising DI line at the same scan, after a few blocks, must come out at the same output sample;
+   a one scan pulse on another line must still show */
+static bool checkAlignment(int decimation, int scansPerRead)
+{
+	FIRDecimator decimator;
+	decimator.configure(1, decimation, scansPerRead);
+
+	const int64_t stepSample = (3 * int64_t(scansPerRead) + decimation - 1) / decimation * decimation;
+	const int64_t pulseSample = stepSample + decimation / 2 + 1;
+	const int64_t lastSample = pulseSample + decimation + decimator.getDelay() + 2 * int64_t(scansPerRead);
+
+	std::vector<float> in(scansPerRead);
+	std::vector<float> out(decimator.getMaxOutputs(scansPerRead));
+	std::vector<int> outputScans(decimator.getMaxOutputs(scansPerRead));
+	std::vector<int64_t> sampleNumbers(scansPerRead);
+	std::vector<uint64_t> eventCodes(scansPerRead);
+	DecimatedEvents events(decimator, scansPerRead);
+
+	int64_t aiOutput = -1, diOutput = -1, pulseOutput = -1;
+
+	for (int64_t firstSample = 0; firstSample < lastSample; firstSample += scansPerRead)
+	{
+		for (int i = 0; i < scansPerRead; i++)
+		{
+			const bool high = firstSample + i >= stepSample;
+			in[i] = high ? 1.0f : 0.0f;
+			eventCodes[i] = (high ? 1 : 0) | (firstSample + i == pulseSample ? 2 : 0);
+		}
+
+		int numOutputs = decimateBlock(decimator, in.data(), scansPerRead, firstSample, out.data(), outputScans.data(),
+			sampleNumbers.data(), eventCodes.data(), events);
+
+		for (int j = 0; j < numOutputs; j++)
+		{
+			if (aiOutput < 0 && out[j] >= 0.5f)
+				aiOutput = sampleNumbers[j];
+			if (diOutput < 0 && (eventCodes[j] & 1))
+				diOutput = sampleNumbers[j];
+			if (pulseOutput < 0 && (eventCodes[j] & 2))
+				pulseOutput = sampleNumbers[j];
+		}
+	}
+
+	const int64_t expectedPulse = (pulseSample + decimation - 1) / decimation;
+
+	printf("Step at output sample %lld: AI crosses half at %lld, DI rises at %lld; one scan pulse at %lld (expected %lld)\n\n",
+		(long long)(stepSample / decimation), (long long)aiOutput, (long long)diOutput, (long long)pulseOutput, (long long)expectedPulse);
+
+	return aiOutput == stepSample / decimation && diOutput == aiOutput && pulseOutput == expectedPulse;
+}
+
+int main(int argc, char** argv)
+{
+
+	const int numChannels = argc > 1 ? std::max(1, atoi(argv[1])) : 32;
+	const double sampleRate = argc > 2 ? atof(argv[2]) : 30000.0;
+	const int scansPerRead = argc > 3 ? std::max(1, atoi(argv[3])) : 300;
+	const int numReads = argc > 4 ? std::max(1, atoi(argv[4])) : 2000;
+	const std::string replayFile = argc > 5 && std::string(argv[5]) != "-" ? argv[5] : "";
+	const int decimation = argc > 6 ? std::max(1, atoi(argv[6])) : 1;
+
+	MockBackend backend;
+	backend.setPaced(false);
+
+	if (!replayFile.empty() && !backend.loadReplayFile(replayFile, numChannels))
+	{
+		fprintf(stderr, "Can't replay %s as %d channels\n", replayFile.c_str(), numChannels);
+		return 1;
+	}
+
+	BackendTaskConfig config;
+	for (int ch = 0; ch < numChannels; ch++)
+		config.channels.push_back(ch);
+	config.sampleRate = sampleRate;
+	config.bufferSize = scansPerRead * 10;
+	config.voltsPerCode = 20.0 / 65536.0;
+
+	backend.configure(config);
+
+	const int numSamples = numChannels * scansPerRead;
+
+	std::vector<int16_t> raw(numSamples);
+	std::vector<double> scaled(numSamples);
+	std::vector<uint32_t> di(scansPerRead);
+	std::vector<float> block(numSamples);
+	std::vector<int64_t> sampleNumbers(scansPerRead);
+	std::vector<double> timestamps(scansPerRead);
+	std::vector<uint64_t> eventCodes(scansPerRead);
+	std::vector<int> edges(scansPerRead);
+	std::vector<uint32_t> edgeStates(scansPerRead);
+
+	FIRDecimator decimator;
+	decimator.configure(numChannels, decimation, scansPerRead);
+	std::vector<float> decimated(size_t(numChannels) * decimator.getMaxOutputs(scansPerRead));
+	std::vector<int> decimatedScans(decimator.getMaxOutputs(scansPerRead));
+	DecimatedEvents events(decimator, scansPerRead);
+
+	std::vector<double> coeffs;
+	std::vector<uint8_t> mask(numChannels, 1);
+	std::vector<int> rows;
+	for (int ch = 0; ch < numChannels; ch++)
+	{
+		coeffs.insert(coeffs.end(), { 0.0, config.voltsPerCode, 0.0, 0.0 });
+		rows.push_back(ch);
+	}
+
+	/* One second of DataBuffer, the headroom NIDAQThread allocates by default */
+	RingBuffer buffer(numChannels, std::max(4 * scansPerRead, int(sampleRate)));
+
+	printf("%d channels at %.0f Hz, %d scans x %d reads, %s kernels, %s data, decimation %d (%d taps)\n\n",
+		numChannels, sampleRate, scansPerRead, numReads,
+		getKernelISAName(getKernelISA()), replayFile.empty() ? "synthesized" : "replayed",
+		decimation, decimator.getNumTaps());
+
+	if (decimation > 1 && !checkAlignment(decimation, scansPerRead))
+	{
+		fprintf(stderr, "Decimated AI and DI are misaligned\n");
+		return 1;
+	}
+
+	const char* modes[2] = { "I16", "F64" };
+	const char* stages[NUM_STAGES] = { "read", "convert", "events", "decimate", "push" };
+
+	for (int mode = 0; mode < 2; mode++)
+	{
+		double total[NUM_STAGES] = { 0 };
+		int64_t sampleNumber = 0;
+		int64_t scans = 0;
+		uint64_t eventCode = 0;
+
+		backend.start();
+		decimator.reset();
+		events.nextCodeSample = sampleNumber + 1;
+		events.linesSeen = 0;
+
+		for (int r = 0; r < numReads; r++)
+		{
+			NIDAQ::int32 read = 0, diRead = 0;
+			auto t = std::chrono::steady_clock::now();
+
+			if (mode == 0)
+				backend.readAnalogI16(scansPerRead, 1.0, raw.data(), numSamples, &read);
+			else
+				backend.readAnalogF64(scansPerRead, 1.0, scaled.data(), numSamples, &read);
+			backend.readDigitalU32(scansPerRead, 1.0, di.data(), scansPerRead, &diRead);
+			total[STAGE_READ] += nanosecondsSince(t);
+
+			if (mode == 0)
+				deinterleaveI16(raw.data(), block.data(), read, numChannels, coeffs.data(), mask.data(), rows.data());
+			else
+				deinterleaveF64(scaled.data(), block.data(), read, numChannels, mask.data(), rows.data());
+			total[STAGE_CONVERT] += nanosecondsSince(t);
+
+			for (int i = 0; i < read; i++)
+			{
+				sampleNumbers[i] = ++sampleNumber;
+				timestamps[i] = -1.0;
+			}
+
+			const uint32_t lines = (1u << NUM_SIMULATED_DI_LINES) - 1;
+			int numEdges = findDigitalEdges(di.data(), std::min(read, diRead), lines, uint32_t(eventCode), edges.data());
+			for (int e = 0; e < numEdges; e++)
+				edgeStates[e] = di[edges[e]];
+			eventCode = expandEventCodes(edges.data(), edgeStates.data(), numEdges, read, uint64_t(lines), eventCode, eventCodes.data());
+			total[STAGE_EVENTS] += nanosecondsSince(t);
+
+			const float* output = block.data();
+			int numOutputs = read;
+			if (decimation > 1)
+			{
+				numOutputs = decimateBlock(decimator, block.data(), read, sampleNumbers[0], decimated.data(), decimatedScans.data(),
+					sampleNumbers.data(), eventCodes.data(), events);
+				output = decimated.data();
+			}
+			total[STAGE_DECIMATE] += nanosecondsSince(t);
+
+			buffer.addToBuffer(output, sampleNumbers.data(), timestamps.data(), eventCodes.data(), numOutputs);
+			total[STAGE_PUSH] += nanosecondsSince(t);
+
+			scans += read;
+		}
+
+		backend.stop();
+
+		const double samples = double(scans) * numChannels;
+		double sum = 0;
+
+		for (int s = 0; s < NUM_STAGES; s++)
+		{
+			sum += total[s];
+			printf("%s %-8s %8.3f ns/sample %9.1f MS/s\n", modes[mode], stages[s], total[s] / samples, samples / total[s] * 1e3);
+		}
+
+		printf("%s %-8s %8.3f ns/sample %9.1f MS/s  x%.1f real time\n\n", modes[mode], "total", sum / samples, samples / sum * 1e3,
+			(scans / sampleRate) * 1e9 / sum);
+	}
+
+	return 0;
+
+}
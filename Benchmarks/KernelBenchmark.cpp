@@ -0,0 +1,157 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Micro-benchmark for the deinterleave/scale kernels.
+
+	Usage: nidaq-kernel-benchmark [numChannels] [numScans] [iterations]
+
+	Runs every kernel supported by this CPU on the same block, checks it
+	against the scalar output and reports ns/sample and the speedup.
+*/
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../Source/NIDAQKernels.h"
+
+static double timeKernel(int iterations, void (*kernel)(void*), void* ctx)
+{
+	kernel(ctx); //warm up
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++)
+		kernel(ctx);
+	auto stop = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(stop - start).count() / iterations;
+}
+
+struct Block
+{
+	int numChannels;
+	int numScans;
+	std::vector<double> f64;
+	std::vector<int16_t> i16;
+	std::vector<double> coeffs;
+	std::vector<uint8_t> mask;
+	std::vector<int> rows;
+	std::vector<float> out;
+};
+
+static void runF64(void* ctx)
+{
+	Block* b = (Block*)ctx;
+	deinterleaveF64(b->f64.data(), b->out.data(), b->numScans, b->numChannels, b->mask.data(), b->rows.data());
+}
+
+static void runI16(void* ctx)
+{
+	Block* b = (Block*)ctx;
+	deinterleaveI16(b->i16.data(), b->out.data(), b->numScans, b->numChannels, b->coeffs.data(), b->mask.data(), b->rows.data());
+}
+
+static float maxError(const std::vector<float>& a, const std::vector<float>& b)
+{
+	float err = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		err = std::fmax(err, std::fabs(a[i] - b[i]));
+	return err;
+}
+
+int main(int argc, char** argv)
+{
+
+	Block b;
+	b.numChannels = argc > 1 ? atoi(argv[1]) : 32;
+	b.numScans = argc > 2 ? atoi(argv[2]) : 500;
+	int iterations = argc > 3 ? atoi(argv[3]) : 2000;
+
+	const int numSamples = b.numChannels * b.numScans;
+
+	std::mt19937 rng(1234);
+	std::uniform_int_distribution<int> codes(-32768, 32767);
+
+	b.f64.resize(numSamples);
+	b.i16.resize(numSamples);
+	b.out.resize(numSamples);
+	b.mask.assign(b.numChannels, 1);
+	for (int ch = 0; ch < b.numChannels; ch++)
+		b.rows.push_back(ch);
+
+	/* Typical +/-10 V calibration polynomial */
+	for (int ch = 0; ch < b.numChannels; ch++)
+	{
+		b.coeffs.push_back(1.2e-3);
+		b.coeffs.push_back(3.05e-4 * (1.0 + 1e-4 * ch));
+		b.coeffs.push_back(2.0e-13);
+		b.coeffs.push_back(-1.5e-18);
+	}
+
+	for (int i = 0; i < numSamples; i++)
+	{
+		b.i16[i] = (int16_t)codes(rng);
+		b.f64[i] = b.i16[i] * 3.05e-4;
+	}
+
+	printf("%d channels x %d scans, %d iterations\n", b.numChannels, b.numScans, iterations);
+	printf("Best supported kernels: %s\n\n", getKernelISAName(detectKernelISA()));
+
+	const char* names[2] = { "F64", "I16" };
+	void (*kernels[2])(void*) = { runF64, runI16 };
+
+	for (int k = 0; k < 2; k++)
+	{
+		selectKernelISA(KERNEL_SCALAR);
+		kernels[k](&b);
+		std::vector<float> reference = b.out;
+
+		double scalarTime = 0;
+
+		for (int isa = KERNEL_SCALAR; isa <= detectKernelISA(); isa++)
+		{
+			selectKernelISA((KERNEL_ISA)isa);
+
+			double t = timeKernel(iterations, kernels[k], &b);
+			if (isa == KERNEL_SCALAR)
+				scalarTime = t;
+
+			printf("%s %-7s %8.3f ns/sample %9.1f MS/s  x%.2f  max err %g\n",
+				names[k],
+				getKernelISAName((KERNEL_ISA)isa),
+				t / numSamples,
+				numSamples / t * 1e3,
+				scalarTime / t,
+				maxError(reference, b.out));
+		}
+
+		printf("\n");
+	}
+
+	return 0;
+
+}
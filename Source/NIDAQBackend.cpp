@@ -0,0 +1,112 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NIDAQBackend.h"
+
+DAQmxBackend::DAQmxBackend() : aiTask(0), diTask(0) {}
+
+NIDAQ::int32 DAQmxBackend::getDeviceNames(std::vector<std::string>& names)
+{
+
+	char data[2048] = { 0 };
+	NIDAQ::int32 error = NIDAQ::DAQmxGetSysDevNames(data, sizeof(data));
+
+	names.clear();
+
+	/* Comma separated, e.g. "Dev1, PXI1Slot2" */
+	std::string list(data);
+	size_t begin = 0;
+	while (begin < list.size())
+	{
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos)
+			end = list.size();
+
+		std::string name = list.substr(begin, end - begin);
+		name.erase(0, name.find_first_not_of(' '));
+		name.erase(name.find_last_not_of(' ') + 1);
+
+		if (!name.empty())
+			names.push_back(name);
+
+		begin = end + 1;
+	}
+
+	return error;
+
+}
+
+NIDAQ::int32 DAQmxBackend::configure(const BackendTaskConfig& config)
+{
+	aiTask = config.aiTask;
+	diTask = config.diTask;
+	return 0;
+}
+
+NIDAQ::int32 DAQmxBackend::start()
+{
+
+	NIDAQ::int32 error = NIDAQ::DAQmxStartTask(diTask);
+
+	if (!DAQmxFailed(error))
+		error = NIDAQ::DAQmxStartTask(aiTask);
+
+	return error;
+
+}
+
+void DAQmxBackend::stop()
+{
+
+	if (aiTask != 0)
+		NIDAQ::DAQmxStopTask(aiTask);
+
+	if (diTask != 0)
+		NIDAQ::DAQmxStopTask(diTask);
+
+}
+
+NIDAQ::int32 DAQmxBackend::readAnalogI16(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::int16* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead)
+{
+	return NIDAQ::DAQmxReadBinaryI16(aiTask, numScans, timeout, DAQmx_Val_GroupByScanNumber, data, arraySize, scansRead, NULL);
+}
+
+NIDAQ::int32 DAQmxBackend::readAnalogF64(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::float64* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead)
+{
+	return NIDAQ::DAQmxReadAnalogF64(aiTask, numScans, timeout, DAQmx_Val_GroupByScanNumber, data, arraySize, scansRead, NULL);
+}
+
+NIDAQ::int32 DAQmxBackend::readDigitalU32(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::uInt32* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead)
+{
+	return NIDAQ::DAQmxReadDigitalU32(diTask, numScans, timeout, DAQmx_Val_GroupByScanNumber, data, arraySize, scansRead, NULL);
+}
+
+NIDAQ::int32 DAQmxBackend::getBacklog(NIDAQ::uInt32* scans)
+{
+	return NIDAQ::DAQmxGetReadAvailSampPerChan(aiTask, scans);
+}
+
+NIDAQ::int32 DAQmxBackend::getTotalAcquired(NIDAQ::uInt64* scans)
+{
+	return NIDAQ::DAQmxGetReadTotalSampPerChanAcquired(aiTask, scans);
+}
@@ -0,0 +1,200 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __NIDAQBACKEND_H__
+#define __NIDAQBACKEND_H__
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "nidaq-api/NIDAQmx.h"
+
+#define SIMULATED_DEVICE_NAME "SimulatedDevice"
+#define NUM_SIMULATED_DI_LINES 8
+#define SIM_WAVETABLE_BITS 12
+#define SIM_SPIN_WAIT_MS 2 //the last part of the wait for a simulated block is spent yielding, not sleeping
+
+enum SIM_WAVEFORM {
+	SIM_SINE = 0,
+	SIM_SQUARE,
+	SIM_SAWTOOTH,
+	SIM_NOISE
+};
+
+/* Signals produced by the SimulatedDevice */
+struct SimulationSettings
+{
+	SIM_WAVEFORM	waveform = SIM_SINE;
+	float			frequency = 10.0f; //Hz on AI0; channel k runs at (k + 1) times this
+	float			amplitude = 0.5f; //fraction of the voltage range
+	float			ttlPeriodMs = 100.0f; //DI line k toggles every 2^k periods
+};
+
+/* Layout and timing of the tasks behind a backend, filled in by NIDAQmx::createTasks */
+struct BackendTaskConfig
+{
+	NIDAQ::TaskHandle	aiTask = 0; //committed DAQmx tasks, unused by the mock
+	NIDAQ::TaskHandle	diTask = 0;
+	std::vector<int>	channels; //device AI index of each task channel
+	NIDAQ::float64		sampleRate = 0;
+	NIDAQ::int32		bufferSize = 0; //input buffer, in scans per channel
+	NIDAQ::float64		voltsPerCode = 0; //size of one ADC code over the selected range
+};
+
+/**
+
+	Source of the raw blocks NIDAQmx converts and pushes: the NI-DAQmx
+	driver, or a mock that synthesizes or replays them.
+
+	Kept free of JUCE types so the mock can be built into the
+	benchmarks. Reads follow the DAQmx conventions: blocks are
+	interleaved by scan (DAQmx_Val_GroupByScanNumber), calls block
+	until numScans scans are available or the timeout expires, and
+	negative return values are DAQmx error codes.
+
+*/
+class AcquisitionBackend
+{
+public:
+	virtual ~AcquisitionBackend() {}
+
+	/** Device query: names of the devices this backend can acquire from */
+	virtual NIDAQ::int32 getDeviceNames(std::vector<std::string>& names) = 0;
+
+	/** Task config: takes over the tasks (or layout) for the next runs */
+	virtual NIDAQ::int32 configure(const BackendTaskConfig& config) = 0;
+
+	virtual NIDAQ::int32 start() = 0;
+	virtual void stop() = 0;
+
+	/** Block read */
+	virtual NIDAQ::int32 readAnalogI16(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::int16* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) = 0;
+	virtual NIDAQ::int32 readAnalogF64(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::float64* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) = 0;
+	virtual NIDAQ::int32 readDigitalU32(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::uInt32* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) = 0;
+
+	/** Scans per channel available to read without blocking */
+	virtual NIDAQ::int32 getBacklog(NIDAQ::uInt32* scans) = 0;
+
+	/** Scans per channel acquired since start() */
+	virtual NIDAQ::int32 getTotalAcquired(NIDAQ::uInt64* scans) = 0;
+};
+
+/* Forwards to the NI-DAQmx driver */
+class DAQmxBackend : public AcquisitionBackend
+{
+public:
+	DAQmxBackend();
+
+	NIDAQ::int32 getDeviceNames(std::vector<std::string>& names) override;
+
+	NIDAQ::int32 configure(const BackendTaskConfig& config) override;
+
+	/* DI ahead of AI, so both start on the first AI sample clock */
+	NIDAQ::int32 start() override;
+	void stop() override;
+
+	NIDAQ::int32 readAnalogI16(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::int16* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) override;
+	NIDAQ::int32 readAnalogF64(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::float64* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) override;
+	NIDAQ::int32 readDigitalU32(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::uInt32* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) override;
+
+	NIDAQ::int32 getBacklog(NIDAQ::uInt32* scans) override;
+	NIDAQ::int32 getTotalAcquired(NIDAQ::uInt64* scans) override;
+
+private:
+	NIDAQ::TaskHandle aiTask;
+	NIDAQ::TaskHandle diTask;
+};
+
+/**
+
+	Synthesizes the SimulatedDevice signals, or replays recorded scans,
+	paced by a steady clock like the hardware would deliver them.
+
+	Pacing can be turned off so the benchmarks measure how fast the
+	rest of the acquisition path can go. Falling a whole input buffer
+	behind the clock fails the read with DAQmxErrorSamplesNoLongerAvailable.
+
+*/
+class MockBackend : public AcquisitionBackend
+{
+public:
+	MockBackend();
+
+	void setSimulation(const SimulationSettings& settings);
+
+	/** Replays interleaved scans of numChannels raw codes in a loop instead of synthesizing; applied on configure */
+	void setReplayData(const std::vector<NIDAQ::int16>& scans, int numChannels);
+
+	/** Loads a file of interleaved little-endian 16-bit codes for setReplayData; returns false if it can't be read */
+	bool loadReplayFile(const std::string& path, int numChannels);
+
+	/** When off, reads return right away as if the data had already been acquired */
+	void setPaced(bool paced);
+
+	NIDAQ::int32 getDeviceNames(std::vector<std::string>& names) override;
+
+	NIDAQ::int32 configure(const BackendTaskConfig& config) override;
+
+	NIDAQ::int32 start() override;
+	void stop() override;
+
+	NIDAQ::int32 readAnalogI16(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::int16* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) override;
+	NIDAQ::int32 readAnalogF64(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::float64* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) override;
+
+	/* Returns the DI words generated with the last AI block */
+	NIDAQ::int32 readDigitalU32(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::uInt32* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead) override;
+
+	NIDAQ::int32 getBacklog(NIDAQ::uInt32* scans) override;
+	NIDAQ::int32 getTotalAcquired(NIDAQ::uInt64* scans) override;
+
+private:
+	/* Waits until numScans more scans are due, or the timeout expires */
+	NIDAQ::int32 waitForScans(NIDAQ::int32 numScans, NIDAQ::float64 timeout);
+
+	/* Writes numScans (at most di.size()) interleaved scans to data and their DI words to di */
+	void generate(NIDAQ::int32 numScans, NIDAQ::int16* data);
+
+	BackendTaskConfig			config;
+	SimulationSettings			simulation;
+	bool						paced;
+	bool						running;
+
+	std::chrono::steady_clock::time_point startTime; //time of scan 0
+	int64_t						generated; //scans generated since startTime
+
+	std::vector<NIDAQ::uInt32>	phase; //phase accumulator of each task channel
+	std::vector<NIDAQ::uInt32>	phaseStep;
+	NIDAQ::uInt32				noiseState;
+	std::vector<NIDAQ::int16>	wavetable; //one period of the waveform, in ADC codes
+
+	std::vector<NIDAQ::int16>	replay;
+	int							replayChannels;
+
+	std::vector<NIDAQ::int16>	scratch; //codes of the last block, for F64 reads; sized by configure
+	std::vector<NIDAQ::uInt32>	di; //DI words of the last block; sized by configure
+	NIDAQ::int32				diScans;
+};
+
+#endif  // __NIDAQBACKEND_H__
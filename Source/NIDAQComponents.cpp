@@ -21,8 +21,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <math.h>
+#include <vector>
 
 #include "NIDAQComponents.h"
 
@@ -59,43 +62,143 @@ void NIDAQAPI::getInfo()
 	//TODO
 }
 
-NIDAQmxDeviceManager::NIDAQmxDeviceManager() {}
+NIDAQmxDeviceManager::NIDAQmxDeviceManager() : selectedDeviceIndex(0), numSimulatedChannels(DEFAULT_SIMULATED_CHANNELS) {}
 
 NIDAQmxDeviceManager::~NIDAQmxDeviceManager() {}
 
-void NIDAQmxDeviceManager::scanForDevices()
+/* Each probe creates and clears a task per AI channel, so each board is probed on its own thread */
+class CapabilityProbe : public Thread
 {
+public:
+	CapabilityProbe(const String& deviceName_, DeviceCapabilities& capabilities_)
+		: Thread("NIDAQ probe " + deviceName_), deviceName(deviceName_), capabilities(capabilities_) {}
 
-	char data[2048] = { 0 };
-	NIDAQ::DAQmxGetSysDevNames(data, sizeof(data));
+	void run() override { NIDAQmx::probeCapabilities(deviceName, capabilities); }
+
+private:
+	String deviceName;
+	DeviceCapabilities& capabilities;
+};
+
+bool NIDAQmxDeviceManager::scanForDevices()
+{
+
+	std::vector<std::string> names;
+	DAQmxBackend().getDeviceNames(names);
+
+	/* The message thread reads devices and capabilities while the scan runs, so they are only replaced at the end, under the lock */
+	StringArray found;
+
+	for (const std::string& name : names)
+		found.add(name.c_str());
+
+	/* Saved entries stand in for the probe of the same board */
+	{
+		const ScopedLock lock(snapshotLock);
+
+		while (snapshot.size() > 0)
+		{
+			DeviceCapabilities* entry = snapshot.removeAndReturn(0);
+
+			bool known = false;
+			for (auto existing : capabilities)
+				known |= existing->deviceName == entry->deviceName && existing->serialNum == entry->serialNum;
+
+			if (known)
+				delete entry;
+			else
+				capabilities.add(entry);
+		}
+	}
+
+	if (!found.size())
+		found.add(SIMULATED_DEVICE_NAME);
+
+	/* The serial number tells a board swapped in under the same name apart; only new boards are probed */
+	OwnedArray<DeviceCapabilities> scanned;
+	Array<int> cachedEntries; //entry of capabilities each device keeps, -1 for a new one
+	OwnedArray<CapabilityProbe> probes;
+	bool changed = found.size() != capabilities.size();
+
+	for (int i = 0; i < found.size(); i++)
+	{
+		NIDAQ::uInt32 serialNum = 0;
+		bool simulated = found[i] == SIMULATED_DEVICE_NAME;
+		if (!simulated)
+			NIDAQ::DAQmxGetDevSerialNum(STR2CHR(found[i]), &serialNum);
+
+		/* The SimulatedDevice is rebuilt when its channel count changes */
+		int cached = -1;
+		for (int j = 0; j < capabilities.size(); j++)
+		{
+			if (capabilities[j]->deviceName == found[i] && capabilities[j]->serialNum == serialNum
+				&& (!simulated || capabilities[j]->aiChannels.size() == numSimulatedChannels))
+				cached = j;
+		}
+
+		cachedEntries.add(cached);
+
+		if (cached >= 0)
+		{
+			changed |= cached != i;
+			scanned.add(nullptr);
+		}
+		else if (simulated)
+		{
+			NIDAQmx::getSimulatedCapabilities(numSimulatedChannels, *scanned.add(new DeviceCapabilities()));
+			changed = true;
+		}
+		else
+		{
+			LOGD("Probing ", found[i]);
+			probes.add(new CapabilityProbe(found[i], *scanned.add(new DeviceCapabilities())))->startThread();
+			changed = true;
+		}
+	}
+
+	for (auto probe : probes)
+		probe->waitForThreadToExit(-1);
+
+	{
+		const ScopedLock lock(snapshotLock);
 
-	StringArray deviceList; 
-	deviceList.addTokens(&data[0], ", ", "\"");
+		/* Cached entries move over; the ones of boards that are gone are deleted with scanned */
+		for (int i = 0; i < cachedEntries.size(); i++)
+		{
+			if (cachedEntries[i] >= 0)
+			{
+				scanned.set(i, capabilities[cachedEntries[i]], false);
+				capabilities.set(cachedEntries[i], nullptr, false);
+			}
+		}
 
-	StringArray deviceNames;
-	StringArray productList;
+		capabilities.swapWith(scanned);
+		devices.swapWith(found);
+	}
 
-	for (int i = 0; i < deviceList.size(); i++)
-		if (deviceList[i].length() > 0)
-			devices.add(deviceList[i].toUTF8());
+	return changed;
 
-	if (!devices.size())
-		devices.add("SimulatedDevice"); 
+}
 
+const DeviceCapabilities* NIDAQmxDeviceManager::getCapabilities(int index)
+{
+	const ScopedLock lock(snapshotLock);
+	return capabilities[index];
 }
 
 String NIDAQmxDeviceManager::getDeviceFromIndex(int index)
 {
+	const ScopedLock lock(snapshotLock);
 	return devices[index];
 }
 
 String NIDAQmxDeviceManager::getDeviceFromProductName(String productName)
 {
-	for (auto device : devices)
+	const ScopedLock lock(snapshotLock);
+	for (auto entry : capabilities)
 	{
-		ScopedPointer<NIDAQmx> n = new NIDAQmx(STR2CHR(device));
-		if (n->getProductName() == productName)
-			return device;
+		if (entry->productName == productName)
+			return entry->deviceName;
 	}
 	return "";
 
@@ -103,45 +206,389 @@ String NIDAQmxDeviceManager::getDeviceFromProductName(String productName)
 
 int NIDAQmxDeviceManager::getNumAvailableDevices()
 {
+	const ScopedLock lock(snapshotLock);
 	return devices.size();
 }
 
-NIDAQmx::NIDAQmx() : Thread("NIDAQmx_Thread") {};
+void NIDAQmxDeviceManager::setNumSimulatedChannels(int numChannels)
+{
+	numSimulatedChannels = jlimit(1, MAX_SIMULATED_CHANNELS, numChannels);
+}
+
+int NIDAQmxDeviceManager::getNumSimulatedChannels()
+{
+	return numSimulatedChannels;
+}
+
+static String joinValues(const Array<float>& values)
+{
+	StringArray list;
+	for (float value : values)
+		list.add(String(value));
+	return list.joinIntoString(",");
+}
+
+static Array<float> splitValues(const String& text)
+{
+	StringArray list;
+	list.addTokens(text, ",", "");
+	list.removeEmptyStrings();
+
+	Array<float> values;
+	for (const String& value : list)
+		values.add(value.getFloatValue());
+	return values;
+}
+
+static StringArray splitNames(const String& text)
+{
+	StringArray list;
+	list.addTokens(text, ",", "");
+	list.removeEmptyStrings();
+	return list;
+}
+
+void NIDAQmxDeviceManager::saveCapabilities(XmlElement* xml)
+{
+
+	XmlElement* snapshotXml = xml->createNewChildElement("CAPABILITIES");
+	snapshotXml->setAttribute("version", CAPABILITIES_XML_VERSION);
+
+	const ScopedLock lock(snapshotLock);
+
+	for (auto entry : capabilities)
+	{
+		/* The SimulatedDevice costs nothing to rebuild */
+		if (entry->deviceName == SIMULATED_DEVICE_NAME)
+			continue;
+
+		XmlElement* device = snapshotXml->createNewChildElement("DEVICE");
+		device->setAttribute("name", entry->deviceName);
+		device->setAttribute("serial", String((int64)entry->serialNum));
+		device->setAttribute("productName", entry->productName);
+		device->setAttribute("category", (int)entry->deviceCategory);
+		device->setAttribute("productNum", String((int64)entry->productNum));
+		device->setAttribute("usb", entry->isUSBDevice);
+		device->setAttribute("simultaneous", entry->simAISamplingSupported);
+		device->setAttribute("adcResolution", entry->adcResolution);
+		device->setAttribute("rateMin", entry->sampleRateRange.smin);
+		device->setAttribute("rateMaxSingle", entry->sampleRateRange.smaxs);
+		device->setAttribute("rateMaxMulti", entry->sampleRateRange.smaxm);
+		device->setAttribute("timebase", entry->timebaseRate);
+
+		StringArray ranges;
+		for (const VRange& range : entry->aiVRanges)
+			ranges.add(String(range.vmin) + ":" + String(range.vmax));
+		device->setAttribute("voltageRanges", ranges.joinIntoString(","));
+
+		StringArray terminalConfigs;
+		for (NIDAQ::int32 config : entry->terminalConfigs)
+			terminalConfigs.add(String(config));
+		device->setAttribute("terminalConfigs", terminalConfigs.joinIntoString(","));
+
+		device->setAttribute("aiChannels", entry->aiChannels.joinIntoString(","));
+		device->setAttribute("diLines", entry->diLines.joinIntoString(","));
+		device->setAttribute("ciChannels", entry->ciChannels.joinIntoString(","));
+
+		for (const auto& rates : entry->verifiedSampleRates)
+		{
+			XmlElement* list = device->createNewChildElement("SAMPLE_RATES");
+			list->setAttribute("channels", rates.first);
+			list->setAttribute("rates", joinValues(rates.second));
+		}
+	}
+
+}
+
+void NIDAQmxDeviceManager::loadCapabilities(const XmlElement* xml)
+{
+
+	const XmlElement* snapshotXml = xml->getChildByName("CAPABILITIES");
+	if (snapshotXml == nullptr || snapshotXml->getIntAttribute("version") != CAPABILITIES_XML_VERSION)
+		return;
+
+	OwnedArray<DeviceCapabilities> loaded;
+
+	for (auto* device : snapshotXml->getChildWithTagNameIterator("DEVICE"))
+	{
+		DeviceCapabilities* entry = loaded.add(new DeviceCapabilities());
+
+		entry->deviceName = device->getStringAttribute("name");
+		entry->serialNum = (NIDAQ::uInt32)device->getStringAttribute("serial").getLargeIntValue();
+		entry->productName = device->getStringAttribute("productName");
+		entry->deviceCategory = device->getIntAttribute("category");
+		entry->productNum = (NIDAQ::uInt32)device->getStringAttribute("productNum").getLargeIntValue();
+		entry->isUSBDevice = device->getBoolAttribute("usb");
+		entry->simAISamplingSupported = device->getBoolAttribute("simultaneous");
+		entry->adcResolution = device->getDoubleAttribute("adcResolution");
+		entry->sampleRateRange = SRange(device->getDoubleAttribute("rateMin"), device->getDoubleAttribute("rateMaxSingle"), device->getDoubleAttribute("rateMaxMulti"));
+		entry->timebaseRate = device->getDoubleAttribute("timebase", DEFAULT_TIMEBASE_RATE);
+
+		for (const String& range : splitNames(device->getStringAttribute("voltageRanges")))
+			entry->aiVRanges.add(VRange(range.upToFirstOccurrenceOf(":", false, false).getDoubleValue(),
+				range.fromFirstOccurrenceOf(":", false, false).getDoubleValue()));
+
+		for (const String& config : splitNames(device->getStringAttribute("terminalConfigs")))
+			entry->terminalConfigs.add(config.getIntValue());
+
+		entry->aiChannels = splitNames(device->getStringAttribute("aiChannels"));
+		entry->diLines = splitNames(device->getStringAttribute("diLines"));
+		entry->ciChannels = splitNames(device->getStringAttribute("ciChannels"));
+
+		for (auto* list : device->getChildWithTagNameIterator("SAMPLE_RATES"))
+			entry->verifiedSampleRates[list->getIntAttribute("channels")] = splitValues(list->getStringAttribute("rates"));
+
+		/* A snapshot that doesn't describe a usable device is probed again instead */
+		if (entry->deviceName.isEmpty() || entry->aiVRanges.size() == 0 || entry->terminalConfigs.size() != entry->aiChannels.size())
+			loaded.removeObject(entry);
+	}
+
+	const ScopedLock lock(snapshotLock);
+	while (loaded.size() > 0)
+		snapshot.add(loaded.removeAndReturn(0));
+
+}
+
+FifoCounters::FifoCounters()
+{
+	inputBufferSize = 0;
+	bufferSize = 0;
+	reset();
+}
+
+void FifoCounters::reset()
+{
+	backlog = 0;
+	bufferedSamples = 0;
+	samplesRead = 0;
+	numReads = 0;
+	minReadTime = 0;
+	maxReadTime = 0;
+	totalReadTime = 0;
+}
+
+float FifoCounters::getBacklogFill() const
+{
+	NIDAQ::uInt32 size = inputBufferSize.load(std::memory_order_relaxed);
+	return size > 0 ? jmin(1.0f, float(backlog.load(std::memory_order_relaxed)) / float(size)) : 0.0f;
+}
+
+float FifoCounters::getBufferFill() const
+{
+	int size = bufferSize.load(std::memory_order_relaxed);
+	return size > 0 ? jmin(1.0f, float(bufferedSamples.load(std::memory_order_relaxed)) / float(size)) : 0.0f;
+}
+
+int64 FifoCounters::getAverageReadTime() const
+{
+	uint64 reads = numReads.load(std::memory_order_relaxed);
+	return reads > 0 ? totalReadTime.load(std::memory_order_relaxed) / int64(reads) : 0;
+}
+
+LogHistogram::LogHistogram()
+{
+	reset();
+}
+
+void LogHistogram::add(int64 ns)
+{
+	int bin = 0;
+	for (uint64 v = uint64(jmax(int64(1), ns)) >> 1; v > 0 && bin < NUM_HISTOGRAM_BINS - 1; v >>= 1)
+		bin++;
+
+	bins[bin].store(bins[bin].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	if (ns > maxValue.load(std::memory_order_relaxed))
+		maxValue.store(ns, std::memory_order_relaxed);
+}
+
+void LogHistogram::reset()
+{
+	for (int i = 0; i < NUM_HISTOGRAM_BINS; i++)
+		bins[i].store(0, std::memory_order_relaxed);
+	maxValue.store(0, std::memory_order_relaxed);
+}
+
+uint64 LogHistogram::getCount() const
+{
+	uint64 count = 0;
+	for (int i = 0; i < NUM_HISTOGRAM_BINS; i++)
+		count += bins[i].load(std::memory_order_relaxed);
+	return count;
+}
+
+int64 LogHistogram::getMax() const
+{
+	return maxValue.load(std::memory_order_relaxed);
+}
+
+int64 LogHistogram::getPercentile(float fraction) const
+{
+	uint64 count = getCount();
+	if (count == 0)
+		return 0;
+
+	uint64 target = jmax(uint64(1), uint64(std::ceil(double(fraction) * double(count))));
+	uint64 seen = 0;
+
+	for (int i = 0; i < NUM_HISTOGRAM_BINS; i++)
+	{
+		seen += bins[i].load(std::memory_order_relaxed);
+		if (seen >= target)
+			return int64(1) << (i + 1);
+	}
+
+	return getMax();
+}
+
+String LogHistogram::toString() const
+{
+	String line = "n=" + String((int64)getCount())
+		+ " p50=" + String(getPercentile(0.5f) / 1000.0, 1) + "us"
+		+ " p99=" + String(getPercentile(0.99f) / 1000.0, 1) + "us"
+		+ " p99.9=" + String(getPercentile(0.999f) / 1000.0, 1) + "us"
+		+ " max=" + String(getMax() / 1000.0, 1) + "us"
+		+ " bins=";
+
+	for (int i = 0; i < NUM_HISTOGRAM_BINS; i++)
+	{
+		uint32 n = bins[i].load(std::memory_order_relaxed);
+		if (n > 0)
+			line += String((double(int64(1) << (i + 1))) / 1000.0, 3) + ":" + String(n) + " ";
+	}
+
+	return line.trimEnd();
+}
+
+void AcquisitionStats::reset()
+{
+	resetReadStats();
+	resetConvertStats();
+}
+
+void AcquisitionStats::resetReadStats()
+{
+	readJitter.reset();
+	recoveries.store(0, std::memory_order_relaxed);
+	lostSamples.store(0, std::memory_order_relaxed);
+	missedSamples.store(0, std::memory_order_relaxed);
+}
+
+void AcquisitionStats::resetConvertStats()
+{
+	readToPush.reset();
+	kernelTime.reset();
+	droppedSamples.store(0, std::memory_order_relaxed);
+}
+
+bool AcquisitionStats::takeResetRequest(uint32& seen) const
+{
+	uint32 requests = resetRequests.load(std::memory_order_relaxed);
+	if (requests == seen)
+		return false;
+	seen = requests;
+	return true;
+}
+
+/* Elapsed time for the telemetry, in ns */
+static int64 nanosecondsBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
+
+#ifdef _WIN32
+/* avrt.dll is loaded on demand so the plugin doesn't have to link against it */
+typedef void* (__stdcall *AvSetMmThreadCharacteristicsFn)(const wchar_t* taskName, unsigned long* taskIndex);
+typedef int (__stdcall *AvSetMmThreadPriorityFn)(void* handle, int priority);
+typedef int (__stdcall *AvRevertMmThreadCharacteristicsFn)(void* handle);
+
+#define AVRT_PRIORITY_HIGH 1
+
+static DynamicLibrary& getAvrtLibrary()
+{
+	static DynamicLibrary avrt("avrt.dll");
+	return avrt;
+}
+#endif
+
+NIDAQmx::NIDAQmx() : Thread("NIDAQmx_Thread"), pipelineFifo(NUM_PIPELINE_BLOCKS) {};
 
 NIDAQmx::NIDAQmx(const char* deviceName) 
 	: Thread("NIDAQmx_Thread"),
-	deviceName(deviceName)
+	deviceName(deviceName),
+	pipelineFifo(NUM_PIPELINE_BLOCKS)
 {
 
-	adcResolution = 0; //bits
+	resetState();
 
 	connect();
 
-	float sample_rates[NUM_SAMPLE_RATES] = {
-		1000.0f, 1250.0f, 1500.0f,
-		2000.0f, 2500.0f,
-		3000.0f, 3330.0f,
-		4000.0f,
-		5000.0f,
-		6250.0f,
-		8000.0f,
-		10000.0f,
-		12500.0f,
-		15000.0f,
-		20000.0f,
-		25000.0f,
-		30000.0f
-	};
+	setDefaultSettings();
 
-	int idx = 0;
-	while (sample_rates[idx] <= sampleRateRange.smaxm && idx < NUM_SAMPLE_RATES)
-		sampleRates.add(sample_rates[idx++]); 
+}
 
-	// Default to highest sample rate
-	samplerate = sampleRates[sampleRates.size() - 1];
+NIDAQmx::NIDAQmx(const DeviceCapabilities& capabilities)
+	: Thread("NIDAQmx_Thread"),
+	deviceName(capabilities.deviceName),
+	pipelineFifo(NUM_PIPELINE_BLOCKS)
+{
 
-	// Default to largest voltage range
-	voltageRange = aiVRanges[aiVRanges.size() - 1];
+	resetState();
+
+	setCapabilities(capabilities);
+
+	setDefaultSettings();
+
+}
+
+void NIDAQmx::resetState()
+{
+
+	adcResolution = 0; //bits
+	timebaseRate = DEFAULT_TIMEBASE_RATE;
+	samplerate = 0;
+	outputRate = 0;
+
+	acquisitionMode = ACQ_BLOCKING_READ;
+	samplesPerRead = 0;
+	targetLatencyMs = DEFAULT_LATENCY_MS;
+	numSampsPerChan = 0;
+	maxSampsPerChan = 0;
+	lowBacklogReads = 0;
+	inputBufferMs = 0;
+	dataBufferMs = DEFAULT_DATA_BUFFER_MS;
+	xferMech = XFER_MECH_DEFAULT;
+	xferReqCond = XFER_REQ_DEFAULT;
+	taskHandleAI = 0;
+	taskHandleDI = 0;
+	taskHandleCI = 0;
+	taskHandleCtr = 0;
+	deviceEnabled = false;
+	startError = 0;
+	diTimingMode = DI_SAMPLE_CLOCK;
+	changeDetectionActive = false;
+	callbackError = 0;
+	digitalLineMask = 0;
+	aiBuffer = nullptr;
+	aiBufferSize = 0;
+	hasLastReadTime = false;
+	overrunRecovery = true;
+	driverLogging = false;
+	hostClockOffset = 0;
+	runStartSample = 0;
+	lastFitSample = 0;
+	readResetsSeen = 0;
+	convertResetsSeen = 0;
+	gapPending = false;
+	mmcssHandle = nullptr;
+	gapMarkerPending = false;
+	nextCodeSample = 0;
+	linesSeen = 0;
+
+}
+
+void NIDAQmx::setDefaultSettings()
+{
 
 	// Enable all channels by default
 	for (int i = 0; i < aiChannelEnabled.size(); i++)
@@ -149,503 +596,2217 @@ NIDAQmx::NIDAQmx(const char* deviceName)
 
 	for (int i = 0; i < diChannelEnabled.size(); i++)
 		diChannelEnabled.set(i, true);
+	updateDigitalLineMask();
+
+	updateSampleRates();
+
+	// Default to highest sample rate
+	samplerate = sampleRates[sampleRates.size() - 1];
+
+	// Default to largest voltage range
+	voltageRange = aiVRanges[aiVRanges.size() - 1];
+
+	// Default to raw 16-bit reads when the ADC codes fit
+	readMode = supportsRawRead() ? READ_RAW_I16 : READ_SCALED_F64;
 
 }
 
 NIDAQmx::~NIDAQmx() {
+	clearTasks();
 }
 
-String NIDAQmx::getProductName()
+void NIDAQmx::probeCapabilities(const String& deviceName, DeviceCapabilities& capabilities)
 {
-	return productName;
+	NIDAQmx probe(STR2CHR(deviceName));
+	probe.getCapabilities(capabilities);
 }
 
-String NIDAQmx::getSerialNumber()
+void NIDAQmx::getSimulatedCapabilities(int numChannels, DeviceCapabilities& capabilities)
 {
-	return String(serialNum);
+
+	capabilities.deviceName = SIMULATED_DEVICE_NAME;
+	capabilities.serialNum = 0;
+	capabilities.productName = SIMULATED_DEVICE_NAME;
+	capabilities.deviceCategory = 0;
+	capabilities.productNum = 0;
+	capabilities.isUSBDevice = false;
+	capabilities.simAISamplingSupported = true;
+	capabilities.adcResolution = 16;
+	capabilities.sampleRateRange = SRange(1000.0f, 500000.0f, 500000.0f);
+	capabilities.timebaseRate = DEFAULT_TIMEBASE_RATE;
+	capabilities.verifiedSampleRates.clear();
+
+	capabilities.aiVRanges.clear();
+	capabilities.aiVRanges.add(VRange(-5.0f, 5.0f));
+	capabilities.aiVRanges.add(VRange(-10.0f, 10.0f));
+
+	capabilities.aiChannels.clear();
+	capabilities.terminalConfigs.clear();
+	for (int i = 0; i < numChannels; i++)
+	{
+		capabilities.aiChannels.add(String(SIMULATED_DEVICE_NAME) + "/ai" + String(i));
+		capabilities.terminalConfigs.add(DAQmx_Val_Bit_TermCfg_RSE | DAQmx_Val_Bit_TermCfg_Diff);
+	}
+
+	capabilities.diLines.clear();
+	for (int i = 0; i < NUM_SIMULATED_DI_LINES; i++)
+		capabilities.diLines.add(String(SIMULATED_DEVICE_NAME) + "/port0/line" + String(i));
+
+	capabilities.ciChannels.clear();
+
 }
 
-void NIDAQmx::connect()
+bool NIDAQmx::isSimulated() const
 {
+	return deviceName == SIMULATED_DEVICE_NAME;
+}
 
-	if (deviceName == "SimulatedDevice")
-	{
-		isUSBDevice = false;
-		sampleRateRange = SRange(1000.0f, 30000.0f, 30000.0f);
-		aiVRanges.add(VRange(-10.0f, 10.0f));
-		productName = String("No Device Detected");
+void NIDAQmx::getCapabilities(DeviceCapabilities& capabilities)
+{
 
-	}
-	else
-	{
-		//LOGC("NIDAQmx");
-		/* Get category type */
-		NIDAQ::DAQmxGetDevProductCategory(STR2CHR(deviceName), &deviceCategory);
-		//LOGC("Device Category: ", (int) deviceCategory);
+	capabilities.deviceName = deviceName;
+	capabilities.serialNum = serialNum;
+	capabilities.productName = productName;
+	capabilities.deviceCategory = deviceCategory;
+	capabilities.productNum = productNum;
+	capabilities.isUSBDevice = isUSBDevice;
+	capabilities.simAISamplingSupported = simAISamplingSupported;
+	capabilities.adcResolution = adcResolution;
+	capabilities.sampleRateRange = sampleRateRange;
+	capabilities.timebaseRate = timebaseRate;
+	capabilities.verifiedSampleRates = verifiedSampleRates;
+	capabilities.aiVRanges = aiVRanges;
+	capabilities.terminalConfigs = terminalConfig;
+
+	capabilities.aiChannels.clear();
+	for (int i = 0; i < ai.size(); i++)
+		capabilities.aiChannels.add(ai[i].id);
 
-		/* Get product name */
-		char pname[2048] = { 0 };
-		NIDAQ::DAQmxGetDevProductType(STR2CHR(deviceName), &pname[0], sizeof(pname));
-		productName = String(&pname[0]);
-		//LOGC("Product Name: ", productName);
+	capabilities.diLines.clear();
+	for (int i = 0; i < di.size(); i++)
+		capabilities.diLines.add(di[i].id);
 
-		isUSBDevice = false;
-		if (productName.contains("USB"))
-			isUSBDevice = true;
+	capabilities.ciChannels.clear();
+	for (int i = 0; i < ci.size(); i++)
+		capabilities.ciChannels.add(ci[i].id);
 
-		NIDAQ::DAQmxGetDevProductNum(STR2CHR(deviceName), &productNum);
-		//LOGC("Product Num: ", productNum);
+}
 
-		NIDAQ::DAQmxGetDevSerialNum(STR2CHR(deviceName), &serialNum);
-		//LOGC("Serial Num: ", serialNum);
+void NIDAQmx::setCapabilities(const DeviceCapabilities& capabilities)
+{
 
-		/* Get simultaneous sampling supported */
-		NIDAQ::bool32 supported = false;
-		NIDAQ::DAQmxGetDevAISimultaneousSamplingSupported(STR2CHR(deviceName), &supported);
-		simAISamplingSupported = (supported == 1);
-		//printf("Simultaneous sampling %ssupported\n", simAISamplingSupported ? "" : "NOT ");
+	serialNum = capabilities.serialNum;
+	productName = capabilities.productName;
+	deviceCategory = capabilities.deviceCategory;
+	productNum = capabilities.productNum;
+	isUSBDevice = capabilities.isUSBDevice;
+	simAISamplingSupported = capabilities.simAISamplingSupported;
+	adcResolution = capabilities.adcResolution;
+	sampleRateRange = capabilities.sampleRateRange;
+	timebaseRate = capabilities.timebaseRate;
+	verifiedSampleRates = capabilities.verifiedSampleRates;
+	aiVRanges = capabilities.aiVRanges;
+
+	for (int i = 0; i < capabilities.aiChannels.size(); i++)
+	{
+		ai.add(AnalogIn(capabilities.aiChannels[i].toUTF8(), &fifoCounters));
+		terminalConfig.add(capabilities.terminalConfigs[i]);
+		st.add(getDefaultSourceType(capabilities.terminalConfigs[i]));
+		aiChannelEnabled.add(true);
+	}
 
-		/* Get device sample rates */
-		NIDAQ::float64 smin;
-		NIDAQ::DAQmxGetDevAIMinRate(STR2CHR(deviceName), &smin);
+	for (int i = 0; i < capabilities.diLines.size(); i++)
+	{
+		di.add(DigitalIn(capabilities.diLines[i].toUTF8(), &fifoCounters));
+		diChannelEnabled.add(false);
+	}
 
-		NIDAQ::float64 smaxs;
-		NIDAQ::DAQmxGetDevAIMaxSingleChanRate(STR2CHR(deviceName), &smaxs);
+	for (int i = 0; i < capabilities.ciChannels.size(); i++)
+	{
+		ci.add(Counter(capabilities.ciChannels[i].toUTF8(), &fifoCounters));
+		ciMode.add(CI_OFF);
+	}
 
-		NIDAQ::float64 smaxm;
-		NIDAQ::DAQmxGetDevAIMaxMultiChanRate(STR2CHR(deviceName), &smaxm);
+}
 
-		getAIVoltageRanges();
-		getAIChannels();
-		getDIChannels();
+SOURCE_TYPE NIDAQmx::getDefaultSourceType(NIDAQ::int32 termCfgs)
+{
+	if (termCfgs & DAQmx_Val_Bit_TermCfg_RSE)
+		return SOURCE_TYPE::RSE;
+	else if (termCfgs & DAQmx_Val_Bit_TermCfg_NRSE)
+		return SOURCE_TYPE::NRSE;
+	else if (termCfgs & DAQmx_Val_Bit_TermCfg_Diff)
+		return SOURCE_TYPE::DIFF;
+	else
+		return SOURCE_TYPE::PSEUDO_DIFF;
+}
+
+int NIDAQmx::getNumEnabledAnalogInputs()
+{
+	int count = 0;
+	for (int i = 0; i < aiChannelEnabled.size(); i++)
+		if (aiChannelEnabled[i])
+			count++;
+	return count;
+}
 
-		if (!simAISamplingSupported)
-			smaxm = smaxs / ai.size();
+int NIDAQmx::getNumCounterChannels()
+{
+	int count = 0;
+	for (int i = 0; i < ciMode.size(); i++)
+		if (ciMode[i] != CI_OFF)
+			count++;
+	return count;
+}
 
-		sampleRateRange = SRange(smin, smaxs, smaxm);
+int NIDAQmx::getCounterRow(int index)
+{
+	if (ciMode[index] == CI_OFF)
+		return -1;
+
+	int row = ai.size();
+	for (int i = 0; i < index; i++)
+		if (ciMode[i] != CI_OFF)
+			row++;
+	return row;
+}
+
+int NIDAQmx::getNumDataChannels()
+{
+	return ai.size() + getNumCounterChannels();
+}
 
+const char* NIDAQmx::getCounterModeName(COUNTER_MODE mode)
+{
+	switch (mode) {
+	case CI_EDGE_COUNT:
+		return "Edge count";
+	case CI_FREQUENCY:
+		return "Frequency";
+	case CI_ENCODER:
+		return "Encoder";
+	default:
+		return "Off";
 	}
+}
 
-	//LOGC("Min sample rate: ", sampleRateRange.smin);
-	//LOGC("Max single channel sample rate: ", sampleRateRange.smaxs);
-	//LOGC("Max multi channel sample rate: ", sampleRateRange.smaxm);
+NIDAQ::float64 NIDAQmx::getMaxSampleRate()
+{
+	if (simAISamplingSupported)
+		return sampleRateRange.smaxm;
 
+	/* Multiplexed devices share one ADC between all channels in the task */
+	NIDAQ::float64 aggregate = sampleRateRange.smaxm / jmax(1, getNumEnabledAnalogInputs());
+	return jmin(sampleRateRange.smaxs, aggregate);
 }
 
-void NIDAQmx::getAIVoltageRanges()
+void NIDAQmx::updateSampleRates()
 {
 
-	NIDAQ::float64 data[512];
-	NIDAQ::DAQmxGetDevAIVoltageRngs(STR2CHR(deviceName), &data[0], sizeof(data));
+	const int numChannels = jmax(1, getNumEnabledAnalogInputs());
 
-	//printf("Detected voltage ranges:\n");
-	for (int i = 0; i < 512; i += 2)
+	/* Verifying a list takes a driver round trip per rate, so it is done once for each channel count */
+	auto cached = verifiedSampleRates.find(numChannels);
+	if (cached == verifiedSampleRates.end())
+	{
+		Array<float> rates = getCandidateSampleRates();
+
+		if (!isSimulated() && ai.size() > 0)
+			verifySampleRates(numChannels, rates);
+
+		cached = verifiedSampleRates.emplace(numChannels, rates).first;
+	}
+
+	sampleRates = cached->second;
+
+	if (sampleRates.size() == 0)
+		sampleRates.add(float(sampleRateRange.smin));
+
+	// Keep the current rate if it is still allowed, otherwise use the highest one
+	if (!sampleRates.contains(samplerate))
+		samplerate = sampleRates[sampleRates.size() - 1];
+
+}
+
+Array<float> NIDAQmx::getCandidateSampleRates()
+{
+
+	static const double mantissas[] = { 1.0, 1.25, 1.5, 2.0, 2.5, 3.0, 4.0, 5.0, 6.25, 8.0 };
+
+	const NIDAQ::float64 maxRate = getMaxSampleRate();
+	const NIDAQ::float64 minRate = jmax(NIDAQ::float64(MIN_LISTED_SAMPLE_RATE), sampleRateRange.smin);
+
+	Array<float> rates;
+
+	for (double decade = MIN_LISTED_SAMPLE_RATE; decade <= maxRate; decade *= 10.0)
+	{
+		for (double mantissa : mantissas)
+		{
+			double rate = decade * mantissa;
+
+			/* Rates the timebase doesn't divide (30 kS/s on 100 MHz) are kept; verifySampleRates lists what the driver coerces them to */
+			if (rate >= minRate && rate <= maxRate)
+				rates.add(float(rate));
+		}
+	}
+
+	/* The smallest divisor that doesn't exceed the maximum gives the real top rate */
+	if (maxRate > 0)
+	{
+		float top = float(timebaseRate / std::ceil(timebaseRate / maxRate - 1e-6));
+		if (top >= minRate)
+			rates.addIfNotAlreadyThere(top);
+	}
+
+	rates.sort();
+
+	return rates;
+
+}
+
+void NIDAQmx::verifySampleRates(int numChannels, Array<float>& rates)
+{
+
+	NIDAQ::int32	error = 0;
+	char			errBuff[ERR_BUFF_SIZE] = { '\0' };
+
+	NIDAQ::TaskHandle rateQuery = 0;
+	Array<float> coerced;
+
+	VRange vRange = aiVRanges.size() > 0 ? aiVRanges[aiVRanges.size() - 1] : VRange(-10.0f, 10.0f);
+
+	DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("SampleRateQuery_" + deviceName), &rateQuery));
+
+	for (int i = 0; i < jmin(numChannels, ai.size()); i++)
+	{
+		DAQmxErrChk(NIDAQ::DAQmxCreateAIVoltageChan(
+			rateQuery,
+			STR2CHR(ai[i].id),
+			"",
+			DAQmx_Val_Cfg_Default,
+			vRange.vmin,
+			vRange.vmax,
+			DAQmx_Val_Volts,
+			NULL));
+	}
+
+	for (int i = 0; i < rates.size(); i++)
+	{
+		NIDAQ::float64 actual = 0;
+
+		/* Verify applies the rate limits and coerces the rate onto the timebase */
+		if (DAQmxFailed(NIDAQ::DAQmxCfgSampClkTiming(rateQuery, "", rates[i], DAQmx_Val_Rising, DAQmx_Val_ContSamps, 1000))
+			|| DAQmxFailed(NIDAQ::DAQmxTaskControl(rateQuery, DAQmx_Val_Task_Verify))
+			|| DAQmxFailed(NIDAQ::DAQmxGetSampClkRate(rateQuery, &actual)))
+			continue;
+
+		coerced.addIfNotAlreadyThere(float(actual));
+	}
+
+	coerced.sort();
+
+	/* Keep the computed list if the driver couldn't confirm any of it */
+	if (coerced.size() > 0)
+		rates = coerced;
+
+Error:
+
+	if (DAQmxFailed(error))
+	{
+		NIDAQ::DAQmxGetExtendedErrorInfo(errBuff, ERR_BUFF_SIZE);
+		LOGD("Couldn't verify sample rates for ", deviceName, ": ", errBuff);
+	}
+
+	if (rateQuery != 0)
+		NIDAQ::DAQmxClearTask(rateQuery);
+
+}
+
+String NIDAQmx::getProductName()
+{
+	return productName;
+}
+
+String NIDAQmx::getSerialNumber()
+{
+	return String(serialNum);
+}
+
+void NIDAQmx::connect()
+{
+
+	if (isSimulated())
+	{
+		DeviceCapabilities simulated;
+		getSimulatedCapabilities(DEFAULT_SIMULATED_CHANNELS, simulated);
+		setCapabilities(simulated);
+		return;
+	}
+	else
+	{
+		//LOGC("NIDAQmx");
+		/* Get category type */
+		NIDAQ::DAQmxGetDevProductCategory(STR2CHR(deviceName), &deviceCategory);
+		//LOGC("Device Category: ", (int) deviceCategory);
+
+		/* Get product name */
+		char pname[2048] = { 0 };
+		NIDAQ::DAQmxGetDevProductType(STR2CHR(deviceName), &pname[0], sizeof(pname));
+		productName = String(&pname[0]);
+		//LOGC("Product Name: ", productName);
+
+		isUSBDevice = false;
+		if (productName.contains("USB"))
+			isUSBDevice = true;
+
+		NIDAQ::DAQmxGetDevProductNum(STR2CHR(deviceName), &productNum);
+		//LOGC("Product Num: ", productNum);
+
+		NIDAQ::DAQmxGetDevSerialNum(STR2CHR(deviceName), &serialNum);
+		//LOGC("Serial Num: ", serialNum);
+
+		/* Get simultaneous sampling supported */
+		NIDAQ::bool32 supported = false;
+		NIDAQ::DAQmxGetDevAISimultaneousSamplingSupported(STR2CHR(deviceName), &supported);
+		simAISamplingSupported = (supported == 1);
+		//printf("Simultaneous sampling %ssupported\n", simAISamplingSupported ? "" : "NOT ");
+
+		/* Get device sample rates */
+		NIDAQ::float64 smin;
+		NIDAQ::DAQmxGetDevAIMinRate(STR2CHR(deviceName), &smin);
+
+		NIDAQ::float64 smaxs;
+		NIDAQ::DAQmxGetDevAIMaxSingleChanRate(STR2CHR(deviceName), &smaxs);
+
+		NIDAQ::float64 smaxm;
+		NIDAQ::DAQmxGetDevAIMaxMultiChanRate(STR2CHR(deviceName), &smaxm);
+
+		getAIVoltageRanges();
+		getAIChannels();
+		getDIChannels();
+		getCIChannels();
+
+		/* For multiplexed devices smaxm is the aggregate rate, see getMaxSampleRate */
+		sampleRateRange = SRange(smin, smaxs, smaxm);
+
+		getTimebaseRate();
+
+	}
+
+	//LOGC("Min sample rate: ", sampleRateRange.smin);
+	//LOGC("Max single channel sample rate: ", sampleRateRange.smaxs);
+	//LOGC("Max multi channel sample rate: ", sampleRateRange.smaxm);
+
+}
+
+void NIDAQmx::getAIVoltageRanges()
+{
+
+	NIDAQ::float64 data[512];
+	NIDAQ::DAQmxGetDevAIVoltageRngs(STR2CHR(deviceName), &data[0], sizeof(data));
+
+	//printf("Detected voltage ranges:\n");
+	for (int i = 0; i < 512; i += 2)
+	{
+		NIDAQ::float64 vmin = data[i];
+		NIDAQ::float64 vmax = data[i + 1];
+		if (vmin == vmax || vmax < 1e-2)
+			break;
+		//printf("Vmin: %f Vmax: %f \n", vmin, vmax);
+		aiVRanges.add(VRange(vmin, vmax));
+	}
+
+	fflush(stdout);
+
+}
+
+void NIDAQmx::getAIChannels()
+{
+
+	NIDAQ::int32	error = 0;
+	char			errBuff[ERR_BUFF_SIZE] = { '\0' };
+
+	NIDAQ::TaskHandle adcResolutionQuery;
+	NIDAQ::DAQmxCreateTask(STR2CHR("ADCResolutionQuery_" + deviceName), &adcResolutionQuery); //devices may be probed in parallel
+
+	char data[2048];
+	NIDAQ::DAQmxGetDevAIPhysicalChans(STR2CHR(deviceName), &data[0], sizeof(data));
+
+	StringArray channel_list;
+	channel_list.addTokens(&data[0], ", ", "\"");
+
+	int aiCount = 0;
+
+	VRange vRange = aiVRanges[aiVRanges.size() - 1];
+
+	for (int i = 0; i < channel_list.size(); i++)
+	{
+		if (channel_list[i].length() > 0)
+		{
+
+			/* Get channel termination */
+			NIDAQ::int32 termCfgs;
+			NIDAQ::DAQmxGetPhysicalChanAITermCfgs(channel_list[i].toUTF8(), &termCfgs);
+
+			LOGD(channel_list[i].toRawUTF8(), " Terminal Config: ", termCfgs);
+
+			ai.add(AnalogIn(channel_list[i].toUTF8(), &fifoCounters));
+
+			terminalConfig.add(termCfgs);
+
+			st.add(getDefaultSourceType(termCfgs));
+
+			/* Get channel ADC resolution */
+			aiCount++;
+
+			DAQmxErrChk(NIDAQ::DAQmxCreateAIVoltageChan(
+				adcResolutionQuery,			//task handle
+				STR2CHR(ai[aiCount-1].id),	//NIDAQ physical channel name (e.g. dev1/ai1)
+				"",							//user-defined channel name (optional)
+				DAQmx_Val_Cfg_Default,		//input terminal configuration
+				vRange.vmin,				//min input voltage
+				vRange.vmax,				//max input voltage
+				DAQmx_Val_Volts,			//voltage units
+				NULL));
+
+			DAQmxErrChk(NIDAQ::DAQmxGetAIResolution(adcResolutionQuery, channel_list[i].toUTF8(), &adcResolution));
+			aiChannelEnabled.add(true);
+
+		}
+	}
+
+	fflush(stdout);
+	NIDAQ::DAQmxStopTask(adcResolutionQuery);
+	NIDAQ::DAQmxClearTask(adcResolutionQuery);
+
+Error:
+
+	if (DAQmxFailed(error))
+		NIDAQ::DAQmxGetExtendedErrorInfo(errBuff, ERR_BUFF_SIZE);
+
+	if (adcResolutionQuery != 0) {
+		// DAQmx Stop Code
+		NIDAQ::DAQmxStopTask(adcResolutionQuery);
+		NIDAQ::DAQmxClearTask(adcResolutionQuery);
+	}
+
+	if (DAQmxFailed(error))
+		//LOGE("DAQmx Error: ", errBuff);
+	fflush(stdout);
+
+	return;
+
+}
+
+void NIDAQmx::getTimebaseRate()
+{
+
+	NIDAQ::TaskHandle timebaseQuery = 0;
+	NIDAQ::float64 rate = 0;
+
+	timebaseRate = DEFAULT_TIMEBASE_RATE;
+
+	if (ai.size() == 0 || aiVRanges.size() == 0)
+		return;
+
+	VRange vRange = aiVRanges[aiVRanges.size() - 1];
+
+	/* The timebase is a property of the sample clock, so it needs a timed task to read */
+	if (!DAQmxFailed(NIDAQ::DAQmxCreateTask(STR2CHR("TimebaseQuery_" + deviceName), &timebaseQuery))
+		&& !DAQmxFailed(NIDAQ::DAQmxCreateAIVoltageChan(timebaseQuery, STR2CHR(ai[0].id), "", DAQmx_Val_Cfg_Default,
+			vRange.vmin, vRange.vmax, DAQmx_Val_Volts, NULL))
+		&& !DAQmxFailed(NIDAQ::DAQmxCfgSampClkTiming(timebaseQuery, "", sampleRateRange.smin, DAQmx_Val_Rising, DAQmx_Val_ContSamps, 1000))
+		&& !DAQmxFailed(NIDAQ::DAQmxGetSampClkTimebaseRate(timebaseQuery, &rate))
+		&& rate > 0)
+		timebaseRate = rate;
+
+	if (timebaseQuery != 0)
+		NIDAQ::DAQmxClearTask(timebaseQuery);
+
+	LOGD(deviceName, " sample clock timebase: ", timebaseRate, " Hz");
+
+}
+
+void NIDAQmx::getDIChannels()
+{
+
+	char data[2048];
+	//NIDAQ::DAQmxGetDevTerminals(STR2CHR(deviceName), &data[0], sizeof(data)); //gets all terminals
+	//NIDAQ::DAQmxGetDevDIPorts(STR2CHR(deviceName), &data[0], sizeof(data));	//gets line name
+	NIDAQ::DAQmxGetDevDILines(STR2CHR(deviceName), &data[0], sizeof(data));	//gets ports on line
+	LOGD("Found digital inputs: ");
+
+	StringArray channel_list;
+	channel_list.addTokens(&data[0], ", ", "\"");
+
+	StringArray timedPorts, staticPorts;
+
+	for (int i = 0; i < channel_list.size(); i++)
+	{
+		if (channel_list[i].length() > 0)
+		{
+			/* The DI task is timed by the AI sample clock, so only lines on ports that support it can be read (port0 on X Series) */
+			String port = channel_list[i].upToLastOccurrenceOf("/", false, false);
+
+			if (!isUSBDevice && !timedPorts.contains(port) && !staticPorts.contains(port))
+			{
+				NIDAQ::bool32 supported = 1;
+				NIDAQ::DAQmxGetPhysicalChanDISampClkSupported(STR2CHR(port), &supported);
+				(supported ? timedPorts : staticPorts).add(port);
+			}
+
+			if (staticPorts.contains(port))
+				continue;
+
+			if (di.size() == MAX_DIGITAL_LINES)
+			{
+				LOGC(deviceName, " has more than ", MAX_DIGITAL_LINES, " digital inputs, only the first ones are used");
+				break;
+			}
+
+			LOGD(channel_list[i].toRawUTF8());
+			di.add(DigitalIn(channel_list[i].toUTF8(), &fifoCounters));
+			diChannelEnabled.add(false);
+		}
+	}
+
+	fflush(stdout);
+
+}
+
+void NIDAQmx::selectDigitalPorts(const String& onlyPort)
+{
+
+	Array<int> linePorts, lineBits;
+
+	diTaskPorts.clear();
+
+	for (int i = 0; i < di.size(); i++)
+	{
+		String port = di[i].id.upToLastOccurrenceOf("/", false, false);
+
+		if (onlyPort.isNotEmpty() && port != onlyPort)
+		{
+			linePorts.add(-1);
+			lineBits.add(0);
+			continue;
+		}
+
+		diTaskPorts.addIfNotAlreadyThere(port);
+		linePorts.add(diTaskPorts.indexOf(port));
+		lineBits.add(di[i].id.fromLastOccurrenceOf("line", false, false).getIntValue());
+	}
+
+	/* A task needs a channel even with no lines to read */
+	if (diTaskPorts.size() == 0 && onlyPort.isNotEmpty())
+		diTaskPorts.add(onlyPort);
+
+	diRemap.configure(linePorts.getRawDataPointer(), lineBits.getRawDataPointer(), di.size(), diTaskPorts.size());
+
+}
+
+void NIDAQmx::getCIChannels()
+{
+
+	char data[2048] = { 0 };
+	NIDAQ::DAQmxGetDevCIPhysicalChans(STR2CHR(deviceName), &data[0], sizeof(data));
+
+	StringArray channel_list;
+	channel_list.addTokens(&data[0], ", ", "\"");
+	channel_list.removeEmptyStrings();
+
+	for (int i = 0; i < channel_list.size(); i++)
+	{
+		LOGD(channel_list[i].toRawUTF8());
+		ci.add(Counter(channel_list[i].toUTF8(), &fifoCounters));
+		ciMode.add(CI_OFF);
+	}
+
+}
+
+uint64 NIDAQmx::getActiveDigitalLines()
+{
+	return digitalLineMask.load(std::memory_order_relaxed);
+}
+
+void NIDAQmx::updateDigitalLineMask()
+{
+	uint64 linesEnabled = 0;
+	for (int i = 0; i < diChannelEnabled.size(); i++)
+	{
+		if (diChannelEnabled[i])
+			linesEnabled |= uint64(1) << i;
+	}
+	digitalLineMask.store(linesEnabled, std::memory_order_relaxed);
+}
+
+void NIDAQmx::allocateBuffers(int numSampsPerChan)
+{
+	const int numChannels = getNumDataChannels();
+
+	auto allocateBlock = [&](AcquisitionBlock& block)
+	{
+		block.ai_data.allocate(numChannels * numSampsPerChan);
+		block.ai_data_i16.allocate(numChannels * numSampsPerChan);
+		block.ai_mask.allocate(numChannels);
+		block.di_data.allocate(numSampsPerChan * jmax(1, diTaskPorts.size()));
+		block.ctr_data.allocate(ciTaskChannels.size() * numSampsPerChan);
+		block.di_edges.allocate(numSampsPerChan);
+		block.di_edge_states.allocate(numSampsPerChan);
+	};
+
+	/* Everything the two pipeline stages touch is allocated here, before the run starts */
+	for (auto& block : pipeline)
+		allocateBlock(block);
+	allocateBlock(singlePoint);
+
+	ai_block.allocate(numChannels * numSampsPerChan);
+
+	decimator.configure(numChannels, getDecimationFactor(), numSampsPerChan);
+	ai_decimated.allocate(numChannels * decimator.getMaxOutputs(numSampsPerChan));
+	decimatedScans.allocate(decimator.getMaxOutputs(numSampsPerChan));
+	decimatedTimes.allocate(decimator.getMaxOutputs(numSampsPerChan));
+	decimatedCodes.allocate(decimator.getMaxOutputs(numSampsPerChan));
+	delayedTimes.allocate(decimator.getDelay());
+	delayedCodes.allocate(decimator.getDelay());
+
+	ai_timestamps.allocate(numSampsPerChan);
+	timestamps.allocate(numSampsPerChan);
+	eventCodes.allocate(numSampsPerChan);
+
+	di_data_32.allocate(numSampsPerChan);
+	di_packed.allocate(numSampsPerChan);
+	di_edges.allocate(numSampsPerChan);
+	di_edge_states.allocate(numSampsPerChan);
+	ci_data.allocate(numSampsPerChan);
+
+	ci_mask.allocate(ciTaskChannels.size());
+	for (int k = 0; k < ciTaskChannels.size(); k++)
+		ci_mask[k] = 1;
+}
+
+bool NIDAQmx::supportsRawRead()
+{
+	return adcResolution > 0 && adcResolution <= 16;
+}
+
+int NIDAQmx::getDecimationFactor() const
+{
+	if (outputRate <= 0 || outputRate >= samplerate)
+		return 1;
+
+	return jmax(1, roundToInt(samplerate / outputRate));
+}
+
+float NIDAQmx::getOutputSampleRate() const
+{
+	return samplerate / getDecimationFactor();
+}
+
+float NIDAQmx::getBitVolts(int index)
+{
+	/* Raw reads: the linear term of the driver polynomial is the size of one ADC code */
+	if (readMode == READ_RAW_I16)
+	{
+		int k = aiTaskChannels.indexOf(index);
+		if (k >= 0 && aiScalingCoeffs.size() >= (k + 1) * NUM_SCALING_COEFFS)
+			return float(aiScalingCoeffs[k * NUM_SCALING_COEFFS + 1]);
+
+		return float((voltageRange.vmax - voltageRange.vmin) / pow(2, adcResolution));
+	}
+
+	return voltageRange.vmax / float(0x7fff);
+}
+
+void NIDAQmx::toggleSourceType(int index)
+{
+
+	SOURCE_TYPE current = st[index];
+	int next = (static_cast<int>(current)+1) % NUM_SOURCE_TYPES;
+	SOURCE_TYPE source = static_cast<SOURCE_TYPE>(next);
+	while (!((1 << next) & terminalConfig[index]))
+		source = static_cast<SOURCE_TYPE>(++next % NUM_SOURCE_TYPES);
+	st.set(index,source);
+
+}
+
+static NIDAQ::int32 CVICALLBACK EveryNSamplesCallback(NIDAQ::TaskHandle taskHandle, NIDAQ::int32 everyNsamplesEventType, NIDAQ::uInt32 nSamples, void* callbackData)
+{
+	return ((NIDAQmx*)callbackData)->handleEveryNSamples();
+}
+
+NIDAQ::int32 NIDAQmx::getInputBufferSize()
+{
+	NIDAQ::int32 minimum = HOST_BUFFER_BLOCKS * CHANNEL_BUFFER_SIZE;
+
+	if (inputBufferMs > 0)
+		return jmax(minimum, roundToInt(samplerate * inputBufferMs / 1000.0f));
+
+	/* Enough to ride out a stall of the acquisition thread, without letting high channel counts blow up host memory */
+	int numChannels = jmax(1, getNumEnabledAnalogInputs());
+	NIDAQ::int64 samples = (NIDAQ::int64)(samplerate * DEFAULT_INPUT_BUFFER_MS / 1000.0f);
+	NIDAQ::int64 limit = MAX_INPUT_BUFFER_BYTES / ((NIDAQ::int64)numChannels * sizeof(NIDAQ::float64));
+
+	return (NIDAQ::int32)jmax((NIDAQ::int64)minimum, jmin(samples, limit));
+}
+
+int NIDAQmx::getDataBufferSize()
+{
+	const int decimation = getDecimationFactor();
+	NIDAQ::int64 outputsPerRead = (getSamplesPerRead() + decimation - 1) / decimation;
+	NIDAQ::int64 minimum = MIN_DATA_BUFFER_READS * jmax((NIDAQ::int64)1, outputsPerRead);
+
+	/* Each scan takes a float per channel plus its sample number, timestamp and event code */
+	NIDAQ::int64 bytesPerScan = (NIDAQ::int64)jmax(1, getNumDataChannels()) * sizeof(float) + sizeof(int64) + sizeof(double) + sizeof(uint64);
+	NIDAQ::int64 samples = (NIDAQ::int64)std::ceil(getOutputSampleRate() * jmax(0.0f, dataBufferMs) / 1000.0f);
+	NIDAQ::int64 limit = MAX_DATA_BUFFER_BYTES / bytesPerScan;
+
+	return (int)jmin(limit, jmax(minimum, samples));
+}
+
+NIDAQ::int32 NIDAQmx::configureDataTransfer()
+{
+	NIDAQ::int32 error = 0;
+
+	/* Sets the buffer explicitly: DAQmx only treats sampsPerChanToAcquire as a minimum in continuous mode */
+	DAQmxErrChk(NIDAQ::DAQmxCfgInputBuffer(taskHandleAI, getInputBufferSize()));
+
+	switch (xferMech) {
+	case XFER_MECH_DMA:
+		DAQmxErrChk(NIDAQ::DAQmxSetAIDataXferMech(taskHandleAI, "", DAQmx_Val_DMA)); break;
+	case XFER_MECH_INTERRUPTS:
+		DAQmxErrChk(NIDAQ::DAQmxSetAIDataXferMech(taskHandleAI, "", DAQmx_Val_Interrupts)); break;
+	default:
+		break;
+	}
+
+	switch (xferReqCond) {
+	case XFER_REQ_NOT_EMPTY:
+		DAQmxErrChk(NIDAQ::DAQmxSetAIDataXferReqCond(taskHandleAI, "", DAQmx_Val_OnBrdMemNotEmpty)); break;
+	case XFER_REQ_HALF_FULL:
+		DAQmxErrChk(NIDAQ::DAQmxSetAIDataXferReqCond(taskHandleAI, "", DAQmx_Val_OnBrdMemMoreThanHalfFull)); break;
+	default:
+		break;
+	}
+
+Error:
+	return error;
+}
+
+NIDAQ::int32 NIDAQmx::getMaxSamplesPerRead()
+{
+	/* Leave room in the DAQmx buffer for the next block while one is being read */
+	return jmax(1, getInputBufferSize() / 2);
+}
+
+NIDAQ::int32 NIDAQmx::getMinSamplesPerRead()
+{
+	return jlimit(1, getMaxSamplesPerRead(), roundToInt(samplerate * MIN_LATENCY_MS / 1000.0f));
+}
+
+bool NIDAQmx::isAdaptiveBlockSize()
+{
+	return samplesPerRead == 0 && targetLatencyMs <= 0;
+}
+
+NIDAQ::int32 NIDAQmx::getSamplesPerRead()
+{
+	NIDAQ::int32 samples;
+
+	if (acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT)
+		return 1;
+
+	if (samplesPerRead > 0)
+		samples = samplesPerRead;
+	else if (targetLatencyMs > 0)
+		samples = roundToInt(samplerate * targetLatencyMs / 1000.0f);
+	else if (isUSBDevice) //auto mode starts from the device default
+		samples = 100;
+	else
+		samples = CHANNEL_BUFFER_SIZE;
+
+	return jlimit(1, getMaxSamplesPerRead(), samples);
+}
+
+NIDAQ::int32 NIDAQmx::getSampleMode() const
+{
+	return acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT ? DAQmx_Val_HWTimedSinglePoint : DAQmx_Val_ContSamps;
+}
+
+const FifoCounters& NIDAQmx::getFifoCounters() const
+{
+	return fifoCounters;
+}
+
+const AcquisitionStats& NIDAQmx::getStats() const
+{
+	return stats;
+}
+
+void NIDAQmx::resetStats()
+{
+	/* The reader and the converter clear their own stats, so the reset doesn't race their updates */
+	if (isThreadRunning())
+	{
+		stats.resetRequests.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	stats.reset();
+	readResetsSeen = convertResetsSeen = stats.resetRequests.load(std::memory_order_relaxed);
+}
+
+void NIDAQmx::adaptSamplesPerRead(NIDAQ::uInt32 available)
+{
+
+	if (available > (NIDAQ::uInt32)numSampsPerChan)
+	{
+		/* Falling behind: fewer, larger reads */
+		numSampsPerChan = jmin(maxSampsPerChan, numSampsPerChan * 2);
+		lowBacklogReads = 0;
+	}
+	else if (available < (NIDAQ::uInt32)numSampsPerChan / 4)
+	{
+		/* Keeping up: shrink the block (and the latency) once the backlog has stayed low for a while */
+		if (++lowBacklogReads >= ADAPTIVE_SHRINK_READS)
+		{
+			numSampsPerChan = jmax(getMinSamplesPerRead(), numSampsPerChan / 2);
+			lowBacklogReads = 0;
+		}
+	}
+	else
+	{
+		lowBacklogReads = 0;
+	}
+
+}
+
+NIDAQ::int32 NIDAQmx::createTasks()
+{
+	/* Derived from NIDAQmx: ANSI C Example program: ContAI-ReadDigChan.c */
+
+	NIDAQ::int32	error = 0;
+
+	if (isSimulated())
+		return createSimulatedTasks();
+
+	/**************************************/
+	/********CONFIG ANALOG CHANNELS********/
+	/**************************************/
+
+	String usePort; //change detection watches the lines of the first port only
+
+	/* Create an analog input task */
+	if (isUSBDevice)
+		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("AITask_USB" + getSerialNumber()), &taskHandleAI));
+	else
+		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("AITask_PXI" + getSerialNumber()), &taskHandleAI));
+
+	selectTaskChannels();
+
+	/* Create a voltage channel for each enabled analog input */
+	for (int k = 0; k < aiTaskChannels.size(); k++)
+	{
+		int i = aiTaskChannels[k];
+		NIDAQ::int32 termConfig;
+
+		switch (st[i]) {
+		case SOURCE_TYPE::RSE:
+			termConfig = DAQmx_Val_RSE; break;
+		case SOURCE_TYPE::NRSE:
+			termConfig = DAQmx_Val_NRSE; break;
+		case SOURCE_TYPE::DIFF:
+			termConfig = DAQmx_Val_Diff; break;
+		case SOURCE_TYPE::PSEUDO_DIFF:
+			termConfig = DAQmx_Val_PseudoDiff; break;
+		default:
+			termConfig = DAQmx_Val_Cfg_Default;
+		}
+
+		DAQmxErrChk(NIDAQ::DAQmxCreateAIVoltageChan(
+			taskHandleAI,					//task handle
+			STR2CHR(ai[i].id),			//NIDAQ physical channel name (e.g. dev1/ai1)
+			"",							//user-defined channel name (optional)
+			termConfig,					//input terminal configuration
+			voltageRange.vmin,			//min input voltage
+			voltageRange.vmax,			//max input voltage
+			DAQmx_Val_Volts,			//voltage units
+			NULL));
+
+	}
+
+	/* Configure sample clock timing */
+	DAQmxErrChk(NIDAQ::DAQmxCfgSampClkTiming(
+		taskHandleAI,
+		STR2CHR(clockSource),								//source : NULL means use internal clock, otherwise the clock shared by another device
+		samplerate,											//rate : samples per second per channel
+		DAQmx_Val_Rising,									//activeEdge : (DAQmc_Val_Rising || DAQmx_Val_Falling)
+		getSampleMode(),									//sampleMode : (DAQmx_Val_FiniteSamps || DAQmx_Val_ContSamps || DAQmx_Val_HWTimedSinglePoint)
+		getInputBufferSize()));								//sampsPerChanToAcquire : 
+																//If sampleMode == DAQmx_Val_FiniteSamps : # of samples to acquire for each channel
+																//Elif sampleMode == DAQmx_Val_ContSamps : circular buffer size
+
+	/* A late loop iteration is counted as missed samples instead of stopping the acquisition; polling for
+	   the sample clock keeps a core busy but answers faster than waiting for the interrupt */
+	if (acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT)
+	{
+		DAQmxErrChk(NIDAQ::DAQmxSetRealTimeConvLateErrorsToWarnings(taskHandleAI, 1));
+		DAQmxErrChk(NIDAQ::DAQmxSetRealTimeWaitForNextSampClkWaitMode(taskHandleAI, DAQmx_Val_Poll));
+	}
+
+	/* Devices sharing a clock also wait for the start trigger of the device that owns it */
+	if (startTrigger.isNotEmpty())
+		DAQmxErrChk(NIDAQ::DAQmxCfgDigEdgeStartTrig(taskHandleAI, STR2CHR(startTrigger), DAQmx_Val_Rising));
+
+	DAQmxErrChk(configureDataTransfer());
+
+	/* Get handle to analog trigger to sync with digital inputs */
+	char trigName[256];
+	DAQmxErrChk(GetTerminalNameWithDevPrefix(taskHandleAI, "ai/SampleClock", trigName));
+
+	/************************************/
+	/********CONFIG DIGITAL LINES********/
+	/************************************/
+
+	char ports[2048];
+	NIDAQ::DAQmxGetDevDIPorts(STR2CHR(deviceName), &ports[0], sizeof(ports));
+
+	{
+		StringArray port_list;
+		port_list.addTokens(&ports[0], ", ", "\"");
+		usePort = port_list[0];
+	}
+
+	/* Every port with lines goes into the one task so a block takes a single read; change detection reads raw port words */
+	if (diTimingMode == DI_CHANGE_DETECTION && acquisitionMode != ACQ_HW_TIMED_SINGLE_POINT)
+		selectDigitalPorts(usePort);
+	else
+		selectDigitalPorts(String());
+
+	if (diTaskPorts.size() == 0)
+		diTaskPorts.add(usePort);
+
+	/* Create a digital input task using device serial number to gurantee unique task name per device */
+	if (isUSBDevice)
+		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("DITask_USB"+getSerialNumber()), &taskHandleDI));
+	else
+		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("DITask_PXI"+getSerialNumber()), &taskHandleDI));
+
+	/* One channel per port, so each scan reads as one word per port */
+	for (int p = 0; p < diTaskPorts.size(); p++)
+		DAQmxErrChk(NIDAQ::DAQmxCreateDIChan(
+			taskHandleDI,
+			STR2CHR(diTaskPorts[p]),
+			"",
+			DAQmx_Val_ChanForAllLines));
+
+	/* Change detection only samples the port when an enabled line toggles; each sample is
+	   timestamped by a counter that counts AI sample clock edges, latched on the same event */
+	changeDetectionActive = false;
+
+	/* Single point reads take the port state on each scan, there is no buffer to take edges from */
+	if (diTimingMode == DI_CHANGE_DETECTION && acquisitionMode != ACQ_HW_TIMED_SINGLE_POINT)
+	{
+		String lines = getChangeDetectionLines(usePort);
+		String counter = getTimestampCounter();
+
+		if (lines.isEmpty() || counter.isEmpty())
+		{
+			LOGC("Change detection needs enabled lines on ", usePort, " and a free counter, using the sample clock");
+		}
+		else
+		{
+			DAQmxErrChk(NIDAQ::DAQmxCfgChangeDetectionTiming(
+				taskHandleDI,
+				STR2CHR(lines),						//risingEdgeChan
+				STR2CHR(lines),						//fallingEdgeChan
+				DAQmx_Val_ContSamps,
+				getInputBufferSize()));
+
+			char changeEventName[256];
+			DAQmxErrChk(GetTerminalNameWithDevPrefix(taskHandleDI, "ChangeDetectionEvent", changeEventName));
+
+			DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("CITask_" + getSerialNumber()), &taskHandleCI));
+
+			DAQmxErrChk(NIDAQ::DAQmxCreateCICountEdgesChan(
+				taskHandleCI,
+				STR2CHR(counter),
+				"",
+				DAQmx_Val_Rising,
+				0,									//initialCount
+				DAQmx_Val_CountUp));
+
+			DAQmxErrChk(NIDAQ::DAQmxSetCICountEdgesTerm(taskHandleCI, "", trigName));
+
+			DAQmxErrChk(NIDAQ::DAQmxCfgSampClkTiming(
+				taskHandleCI,
+				changeEventName,					//source : latch the count on each change detection event
+				samplerate,							//rate : upper bound on the edge rate
+				DAQmx_Val_Rising,
+				DAQmx_Val_ContSamps,
+				getInputBufferSize()));
+
+			changeDetectionActive = true;
+		}
+	}
+
+	if (!changeDetectionActive && !isUSBDevice) //USB devices do not have an internal clock and instead use CPU, so we can't configure the sample clock timing
+		DAQmxErrChk(NIDAQ::DAQmxCfgSampClkTiming(
+			taskHandleDI,							//task handle
+			trigName,								//source : NULL means use internal clock, we will sync to analog input clock
+			samplerate,								//rate : samples per second per channel
+			DAQmx_Val_Rising,						//activeEdge : (DAQmc_Val_Rising || DAQmx_Val_Falling)
+			getSampleMode(),						//sampleMode : (DAQmx_Val_FiniteSamps || DAQmx_Val_ContSamps || DAQmx_Val_HWTimedSinglePoint)
+			getInputBufferSize()));					//sampsPerChanToAcquire : want to sync with analog samples per channel
+														//If sampleMode == DAQmx_Val_FiniteSamps : # of samples to acquire for each channel
+														//Elif sampleMode == DAQmx_Val_ContSamps : circular buffer size
+
+	/* After the DI task, which decides whether change detection takes a counter */
+	DAQmxErrChk(createCounterTask(trigName));
+
+	sizeBlocks();
+
+	/* The driver calls back every numSampsPerChan scans; must be registered before the task is committed */
+	if (acquisitionMode == ACQ_EVERY_N_SAMPLES)
+		DAQmxErrChk(NIDAQ::DAQmxRegisterEveryNSamplesEvent(
+			taskHandleAI,
+			DAQmx_Val_Acquired_Into_Buffer,
+			numSampsPerChan,
+			0,									//options : callbacks run on a DAQmx thread
+			EveryNSamplesCallback,
+			this));
+
+	DAQmxErrChk(NIDAQ::DAQmxTaskControl(taskHandleAI, DAQmx_Val_Task_Commit));
+	DAQmxErrChk(NIDAQ::DAQmxTaskControl(taskHandleDI, DAQmx_Val_Task_Commit));
+	if (changeDetectionActive)
+		DAQmxErrChk(NIDAQ::DAQmxTaskControl(taskHandleCI, DAQmx_Val_Task_Commit));
+	if (taskHandleCtr != 0)
+		DAQmxErrChk(NIDAQ::DAQmxTaskControl(taskHandleCtr, DAQmx_Val_Task_Commit));
+
+	/* Raw reads are scaled in the plugin with the same polynomial the driver would apply */
+	if (readMode == READ_RAW_I16)
+	{
+		aiScalingCoeffs.clearQuick();
+		for (int k = 0; k < aiTaskChannels.size(); k++)
+		{
+			NIDAQ::float64 coeffs[NUM_SCALING_COEFFS] = { 0 };
+			DAQmxErrChk(NIDAQ::DAQmxGetAIDevScalingCoeff(taskHandleAI, STR2CHR(ai[aiTaskChannels[k]].id), coeffs, NUM_SCALING_COEFFS));
+			for (int c = 0; c < NUM_SCALING_COEFFS; c++)
+				aiScalingCoeffs.add(coeffs[c]);
+		}
+	}
+
+	allocateBuffers(maxSampsPerChan);
+	pendingEdges.ensureStorageAllocated(maxSampsPerChan);
+
+	backend = new DAQmxBackend();
+	DAQmxErrChk(backend->configure(getBackendConfig()));
+
+	LOGD("Using ", getKernelISAName(getKernelISA()), " conversion kernels");
+
+Error:
+
+	return error;
+
+}
+
+NIDAQ::int32 NIDAQmx::createCounterTask(const char* sampleClock)
+{
+
+	NIDAQ::int32 error = 0;
+
+	/* Change detection timestamps its edges with the last counter */
+	String reserved = changeDetectionActive ? getTimestampCounter() : String();
+
+	ciTaskChannels.clearQuick();
+	ciTaskRows.clearQuick();
+	ciIdleRows.clearQuick();
+
+	for (int i = 0; i < ci.size(); i++)
+	{
+		if (ciMode[i] == CI_OFF)
+			continue;
+
+		if (ci[i].id == reserved)
+		{
+			LOGC(ci[i].id, " is in use by change detection, its channel stays at zero");
+			ciIdleRows.add(getCounterRow(i));
+			continue;
+		}
+
+		ciTaskChannels.add(i);
+		ciTaskRows.add(getCounterRow(i));
+	}
+
+	if (ciTaskChannels.size() == 0)
+		return 0;
+
+	DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("CtrTask_" + getSerialNumber()), &taskHandleCtr));
+
+	/* Each counter uses its default terminals (e.g. PFI8 for ctr0 source / encoder A on X Series) */
+	for (int k = 0; k < ciTaskChannels.size(); k++)
+	{
+		const Counter& counter = ci[ciTaskChannels[k]];
+
+		switch (ciMode[ciTaskChannels[k]]) {
+		case CI_EDGE_COUNT:
+			DAQmxErrChk(NIDAQ::DAQmxCreateCICountEdgesChan(
+				taskHandleCtr,
+				STR2CHR(counter.id),
+				"",
+				DAQmx_Val_Rising,
+				0,									//initialCount
+				DAQmx_Val_CountUp));
+			break;
+		case CI_FREQUENCY:
+			DAQmxErrChk(NIDAQ::DAQmxCreateCIFreqChan(
+				taskHandleCtr,
+				STR2CHR(counter.id),
+				"",
+				CI_MIN_FREQUENCY,
+				CI_MAX_FREQUENCY,
+				DAQmx_Val_Hz,
+				DAQmx_Val_Rising,
+				DAQmx_Val_LowFreq1Ctr,				//measMethod : period of the input against the counter timebase
+				0.001,								//measTime : unused by LowFreq1Ctr
+				4,									//divisor : unused by LowFreq1Ctr
+				NULL));
+			break;
+		default:
+			DAQmxErrChk(NIDAQ::DAQmxCreateCIAngEncoderChan(
+				taskHandleCtr,
+				STR2CHR(counter.id),
+				"",
+				DAQmx_Val_X4,
+				0,									//ZidxEnable
+				0,									//ZidxVal
+				DAQmx_Val_AHighBHigh,				//ZidxPhase
+				DAQmx_Val_Ticks,
+				1,									//pulsesPerRev : unused with ticks
+				0,									//initialAngle
+				NULL));
+		}
+	}
+
+	/* Latched on every AI scan, so each reading lines up with a sample number */
+	DAQmxErrChk(NIDAQ::DAQmxCfgSampClkTiming(
+		taskHandleCtr,
+		sampleClock,
+		samplerate,
+		DAQmx_Val_Rising,
+		getSampleMode(),
+		getInputBufferSize()));
+
+Error:
+
+	return error;
+
+}
+
+String NIDAQmx::getTaskConfiguration()
+{
+
+	/* Everything createTasks() depends on */
+	String configuration = String(samplerate) + ";" + String(voltageRange.vmin) + ";" + String(voltageRange.vmax) + ";";
+
+	for (int i = 0; i < ai.size(); i++)
+		configuration += String(aiChannelEnabled[i] ? 1 : 0) + String((int)st[i]);
+
+	configuration += ";" + String((int)readMode) + ";" + String((int)acquisitionMode)
+		+ ";" + String(samplesPerRead) + ";" + String(targetLatencyMs)
+		+ ";" + String(inputBufferMs) + ";" + String((int)xferMech) + ";" + String((int)xferReqCond)
+		+ ";" + clockSource + ";" + startTrigger + ";" + String((int)diTimingMode)
+		+ ";" + String(getDecimationFactor()) + ";" + String(driverLogging ? 1 : 0);
+
+	configuration += ";";
+	for (int i = 0; i < ci.size(); i++)
+		configuration += String((int)ciMode[i]);
+
+	/* Change detection watches the lines enabled when the task was created */
+	if (diTimingMode == DI_CHANGE_DETECTION)
+		configuration += ";" + String((int64)getActiveDigitalLines());
+
+	/* The MockBackend takes the signals over when the tasks are created */
+	if (isSimulated())
+		configuration += ";" + String((int)simulation.waveform) + ";" + String(simulation.frequency)
+			+ ";" + String(simulation.amplitude) + ";" + String(simulation.ttlPeriodMs);
+
+	return configuration;
+
+}
+
+NIDAQ::int32 NIDAQmx::startTasks()
+{
+
+	NIDAQ::int32	error = 0;
+
+	/* The adaptive block size starts over on every run */
+	numSampsPerChan = getSamplesPerRead();
+	lowBacklogReads = 0;
+
+	ai_timestamp = 0;
+	eventCode = 0;
+	decimator.reset();
+	nextCodeSample = 0;
+	linesSeen = 0;
+
+	/* The fit runs on steady_clock; the offset puts its times on the wall clock other systems share */
+	clockFit.reset(samplerate > 0 ? 1.0 / samplerate : 0.0);
+	hostClockOffset = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()
+		- std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	gapMarkerPending = false;
+	pendingEdges.clearQuick();
+	runStartSample = 0;
+	gapPending = false;
+
+	fifoCounters.reset();
+	fifoCounters.bufferSize = aiBufferSize;
+	hasLastReadTime = false;
+
+	{
+		NIDAQ::uInt32 bufferSize = NIDAQ::uInt32(getInputBufferSize());
+		if (!isSimulated())
+			NIDAQ::DAQmxGetBufInputBufSize(taskHandleAI, &bufferSize);
+		fifoCounters.inputBufferSize = bufferSize;
+	}
+
+	DAQmxErrChk(configureLogging());
+
+	/* The counters have to be armed before the AI sample clock starts so they count from scan 0 */
+	if (changeDetectionActive)
+		DAQmxErrChk(NIDAQ::DAQmxStartTask(taskHandleCI));
+	if (taskHandleCtr != 0)
+		DAQmxErrChk(NIDAQ::DAQmxStartTask(taskHandleCtr));
+	DAQmxErrChk(backend->start());
+
+	seedSinglePointClockFit();
+
+Error:
+
+	return error;
+
+}
+
+void NIDAQmx::seedSinglePointClockFit()
+{
+
+	/* Single point scans are timestamped before the fit is first updated, so it starts from the task start */
+	if (acquisitionMode != ACQ_HW_TIMED_SINGLE_POINT)
+		return;
+
+	lastFitSample = ai_timestamp;
+	updateClockFit(ai_timestamp, std::chrono::steady_clock::now());
+
+}
+
+NIDAQ::int32 NIDAQmx::configureLogging()
+{
+
+	loggingFile = String();
+
+	/* The SimulatedDevice has no driver to log through */
+	if (!driverLogging || isSimulated())
+		return 0;
+
+	if (acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT)
+	{
+		LOGC(deviceName, " can't log to TDMS in single point mode, which has no input buffer");
+		return 0;
+	}
+
+	File directory = loggingDirectory.isNotEmpty() ? File(loggingDirectory)
+		: File::getSpecialLocation(File::userDocumentsDirectory);
+	directory.createDirectory();
+
+	String path = directory.getChildFile(deviceName + "_" + Time::getCurrentTime().formatted("%Y-%m-%d_%H-%M-%S") + ".tdms").getFullPathName();
+
+	/* A new file for every run. This takes the committed task back to verified, so start() recommits it */
+	NIDAQ::int32 error = NIDAQ::DAQmxConfigureLogging(
+		taskHandleAI,
+		STR2CHR(path),
+		DAQmx_Val_LogAndRead,					//loggingMode : the driver writes each block to disk before it is read
+		STR2CHR(deviceName),					//groupName : TDMS group of the AI channels
+		DAQmx_Val_CreateOrReplace);
+
+	if (!DAQmxFailed(error))
+	{
+		loggingFile = path;
+		LOGC(deviceName, " logging to ", loggingFile);
+	}
+
+	return error;
+
+}
+
+NIDAQ::int32 NIDAQmx::readBlock()
+{
+
+	NIDAQ::int32	error = 0;
+
+	const int numTaskChannels = aiTaskChannels.size();
+
+	NIDAQ::int32 arraySizeInSamps = numTaskChannels * numSampsPerChan;
+	NIDAQ::float64 timeout = 5.0;
+
+	NIDAQ::uInt32	backlog = 0;
+	NIDAQ::int32	backlogError = 0;
+
+	int	start1, size1, start2, size2;
+	AcquisitionBlock* block = nullptr;
+
+	if (stats.takeResetRequest(readResetsSeen))
+		stats.resetReadStats();
+
+	/* A full ring means the converter is behind; the driver buffer absorbs the wait */
+	pipelineFifo.prepareToWrite(1, start1, size1, start2, size2);
+	while (size1 == 0)
+	{
+		if (threadShouldExit())
+			return 0;
+
+		blockFreed.wait(PIPELINE_WAIT_MS);
+		pipelineFifo.prepareToWrite(1, start1, size1, start2, size2);
+	}
+
+	block = &pipeline[start1];
+	block->readStart = std::chrono::steady_clock::now();
+	block->aiRead = 0;
+	block->diRead = 0;
+	block->ctrRead = 0;
+	block->numEdges = -1;
+	block->firstSample = ai_timestamp + 1;
+
+	/* Snapshot the line and channel masks once per block */
+	block->linesEnabled = getActiveDigitalLines();
+
+	for (int k = 0; k < numTaskChannels; k++)
+		block->ai_mask[k] = aiChannelEnabled[aiTaskChannels[k]] ? 1 : 0;
+
+	if (readMode == READ_RAW_I16)
+		DAQmxErrChk(backend->readAnalogI16(numSampsPerChan, timeout, block->ai_data_i16.get(), arraySizeInSamps, &block->aiRead));
+	else
+		DAQmxErrChk(backend->readAnalogF64(numSampsPerChan, timeout, block->ai_data.get(), arraySizeInSamps, &block->aiRead));
+
+	block->readDone = std::chrono::steady_clock::now();
+
+	updateClockFit(ai_timestamp + block->aiRead, block->readDone);
+	block->firstTime = clockFit.getTime(block->firstSample);
+	block->samplePeriod = clockFit.getPeriod();
+
+	/* Compared with the block duration so a slow consumer doesn't read as jitter when the blocks grow */
+	if (hasLastReadTime && samplerate > 0)
+		stats.readJitter.add(std::abs(nanosecondsBetween(lastReadTime, block->readDone) - int64(1.0e9 * block->aiRead / samplerate)));
+	lastReadTime = block->readDone;
+	hasLastReadTime = true;
+
+	LOGD("arraySizeInSamps: ", arraySizeInSamps, "Samples read: ", block->aiRead);
+
+	if (changeDetectionActive)
+	{
+		/* Drained even with no lines enabled so the DI buffer can't overflow */
+		DAQmxErrChk(readChangeDetectionEdges());
+		block->numEdges = takePendingEdges(block->firstSample, block->aiRead, block->di_edges.get(), block->di_edge_states.get());
+	}
+	else if (block->linesEnabled > 0)
+	{
+		DAQmxErrChk(backend->readDigitalU32(numSampsPerChan, timeout, block->di_data.get(), numSampsPerChan * diRemap.getNumPorts(), &block->diRead));
+	}
+
+	/* Clocked by the same scans, so the readings for this block are already in the buffer */
+	if (taskHandleCtr != 0 && block->aiRead > 0)
+		DAQmxErrChk(NIDAQ::DAQmxReadCounterF64Ex(taskHandleCtr, block->aiRead, timeout, DAQmx_Val_GroupByScanNumber,
+			block->ctr_data.get(), NIDAQ::uInt32(ciTaskChannels.size() * numSampsPerChan), &block->ctrRead, NULL));
+
+	ai_timestamp += block->aiRead;
+
+	/* The converter marks the first sample it pushes after the gap */
+	block->afterGap = gapPending && block->aiRead > 0;
+	if (block->afterGap)
+		gapPending = false;
+
+	pipelineFifo.finishedWrite(1);
+	blockQueued.signal();
+
+	backlogError = backend->getBacklog(&backlog);
+
+	if (!DAQmxFailed(backlogError))
+	{
+		fifoCounters.backlog.store(backlog, std::memory_order_relaxed);
+
+		/* The every N samples callback is registered for a fixed N */
+		if (isAdaptiveBlockSize() && acquisitionMode == ACQ_BLOCKING_READ)
+			adaptSamplesPerRead(backlog);
+	}
+
+Error:
+
+	return error;
+
+}
+
+NIDAQ::int32 NIDAQmx::readSinglePoint()
+{
+
+	NIDAQ::int32	error = 0;
+	NIDAQ::bool32	isLate = 0;
+	NIDAQ::uInt64	acquired = 0;
+	int64			missed = 0;
+
+	const int numTaskChannels = aiTaskChannels.size();
+	const NIDAQ::float64 timeout = 1.0;
+
+	AcquisitionBlock& block = singlePoint;
+
+	if (stats.takeResetRequest(readResetsSeen))
+		stats.resetReadStats();
+
+	/* The SimulatedDevice paces its reads instead */
+	if (!isSimulated())
+		DAQmxErrChk(NIDAQ::DAQmxWaitForNextSampleClock(taskHandleAI, timeout, &isLate));
+
+	block.readStart = std::chrono::steady_clock::now();
+	block.aiRead = 0;
+	block.diRead = 0;
+	block.ctrRead = 0;
+	block.numEdges = -1;
+	block.linesEnabled = getActiveDigitalLines();
+
+	for (int k = 0; k < numTaskChannels; k++)
+		block.ai_mask[k] = aiChannelEnabled[aiTaskChannels[k]] ? 1 : 0;
+
+	if (readMode == READ_RAW_I16)
+		DAQmxErrChk(backend->readAnalogI16(1, timeout, block.ai_data_i16.get(), numTaskChannels, &block.aiRead));
+	else
+		DAQmxErrChk(backend->readAnalogF64(1, timeout, block.ai_data.get(), numTaskChannels, &block.aiRead));
+
+	if (block.linesEnabled > 0)
+		DAQmxErrChk(backend->readDigitalU32(1, timeout, block.di_data.get(), diRemap.getNumPorts(), &block.diRead));
+
+	if (taskHandleCtr != 0)
+		DAQmxErrChk(NIDAQ::DAQmxReadCounterF64Ex(taskHandleCtr, 1, timeout, DAQmx_Val_GroupByScanNumber,
+			block.ctr_data.get(), NIDAQ::uInt32(ciTaskChannels.size()), &block.ctrRead, NULL));
+
+	block.readDone = std::chrono::steady_clock::now();
+
+	/* Each read returns the latest scan, so a late iteration skips the ones in between */
+	if (isLate && !DAQmxFailed(backend->getTotalAcquired(&acquired)))
+	{
+		missed = jmax(int64(0), int64(acquired) - (ai_timestamp - runStartSample) - block.aiRead);
+		ai_timestamp += missed;
+		gapPending = gapPending || missed > 0;
+		stats.missedSamples.store(stats.missedSamples.load(std::memory_order_relaxed) + uint64(missed), std::memory_order_relaxed);
+	}
+
+	block.firstSample = ai_timestamp + 1;
+	block.firstTime = clockFit.getTime(block.firstSample);
+	block.samplePeriod = clockFit.getPeriod();
+
+	ai_timestamp += block.aiRead;
+
+	block.afterGap = gapPending && block.aiRead > 0;
+	if (block.afterGap)
+		gapPending = false;
+
+	/* Nothing goes through the ring in this mode, so the converter state is this thread's */
+	convertBlock(block);
+
+	/* After the push, so the driver query doesn't add to the latency of this scan; counted from
+	   the last update, since a late scan can step ai_timestamp over any fixed multiple */
+	if (ai_timestamp - lastFitSample >= SINGLE_POINT_FIT_INTERVAL || clockFit.getNumPoints() == 0)
+	{
+		lastFitSample = ai_timestamp;
+		updateClockFit(ai_timestamp, block.readDone);
+	}
+
+Error:
+
+	return error;
+
+}
+
+void NIDAQmx::updateClockFit(int64 lastSample, std::chrono::steady_clock::time_point readDone)
+{
+
+	NIDAQ::uInt64 acquired = 0;
+
+	auto before = std::chrono::steady_clock::now();
+	NIDAQ::int32 error = backend->getTotalAcquired(&acquired);
+	auto after = std::chrono::steady_clock::now();
+
+	/* Scan n of the run is sample runStartSample + n; a preempted query can't say when it was taken */
+	if (!DAQmxFailed(error) && acquired > 0 && nanosecondsBetween(before, after) < CLOCK_QUERY_MAX_US * 1000)
+		clockFit.addPoint(runStartSample + int64(acquired), getHostTime(before) + 0.5e-9 * nanosecondsBetween(before, after));
+	else if (clockFit.getNumPoints() == 0)
+		clockFit.addPoint(lastSample, getHostTime(readDone));
+
+}
+
+double NIDAQmx::getHostTime(std::chrono::steady_clock::time_point time) const
+{
+	return std::chrono::duration<double>(time.time_since_epoch()).count() + hostClockOffset;
+}
+
+BlockConverter::BlockConverter(NIDAQmx* device) : Thread("NIDAQmx_Converter"), device(device) {}
+
+void BlockConverter::run()
+{
+	device->runConverter(this);
+}
+
+void NIDAQmx::runConverter(Thread* stage)
+{
+
+	int	start1, size1, start2, size2;
+
+	while (true)
+	{
+		pipelineFifo.prepareToRead(1, start1, size1, start2, size2);
+
+		if (size1 == 0)
+		{
+			/* Only stopped once the reader has, so whatever it queued is still pushed */
+			if (stage->threadShouldExit())
+				return;
+
+			blockQueued.wait(PIPELINE_WAIT_MS);
+			continue;
+		}
+
+		convertBlock(pipeline[start1]);
+
+		pipelineFifo.finishedRead(1);
+		blockFreed.signal();
+	}
+
+}
+
+void NIDAQmx::convertBlock(AcquisitionBlock& block)
+{
+
+	const int numTaskChannels = aiTaskChannels.size();
+	const int numScans = block.aiRead;
+
+	int				numEdges = block.numEdges;
+	const int*		edges = block.di_edges.get();
+	const uint32*	edgeStates = block.di_edge_states.get();
+
+	float*			output = ai_block.get();
+	double*			outputTimes = timestamps.get();
+	uint64*			outputCodes = eventCodes.get();
+	int				numOutputs = numScans;
+
+	if (stats.takeResetRequest(convertResetsSeen))
+		stats.resetConvertStats();
+
+	int64			readTime = 0;
+	uint64			numReads = 0;
+	int64			kernelNs = 0;
+	int				written = 0;
+
+	/* Each read is transposed into the channel-major layout DataBuffer expects as it is converted */
+	auto kernelStart = std::chrono::steady_clock::now();
+
+	if (readMode == READ_RAW_I16)
+		deinterleaveI16(block.ai_data_i16.get(), ai_block.get(), numScans, numTaskChannels, aiScalingCoeffs.getRawDataPointer(), block.ai_mask.get(), aiTaskChannels.getRawDataPointer());
+	else
+		deinterleaveF64(block.ai_data.get(), ai_block.get(), numScans, numTaskChannels, block.ai_mask.get(), aiTaskChannels.getRawDataPointer());
+
+	kernelNs = nanosecondsBetween(kernelStart, std::chrono::steady_clock::now());
+
+	/* Counter readings go in the rows after AI; a short read (e.g. at stop) leaves them at zero */
+	if (ciTaskChannels.size() > 0 && block.ctrRead == numScans)
+		deinterleaveF64(block.ctr_data.get(), ai_block.get(), numScans, ciTaskChannels.size(), ci_mask.get(), ciTaskRows.getRawDataPointer());
+	else
+		for (int k = 0; k < ciTaskRows.size(); k++)
+			FloatVectorOperations::clear(ai_block.get() + ciTaskRows[k] * numScans, numScans);
+
+	/* Inputs and counters left out of their task still get a (zero) row in DataBuffer */
+	for (int k = 0; k < aiIdleRows.size(); k++)
+		FloatVectorOperations::clear(ai_block.get() + aiIdleRows[k] * numScans, numScans);
+
+	for (int k = 0; k < ciIdleRows.size(); k++)
+		FloatVectorOperations::clear(ai_block.get() + ciIdleRows[k] * numScans, numScans);
+
+	for (int i = 0; i < numScans; i++)
+	{
+		ai_timestamps[i] = block.firstSample + i;
+		timestamps[i] = block.firstTime + i * block.samplePeriod;
+	}
+
+	/* The lines are idle most of the time: locate the transitions, then fill the codes run by run */
+	kernelStart = std::chrono::steady_clock::now();
+
+	if (numEdges < 0)
+	{
+		const int numDIScans = jmin(block.diRead, numScans);
+		const uint32* words = block.di_data.get();
+
+		/* Lines spread over several ports are gathered into one word first */
+		if (!diRemap.isIdentity())
+		{
+			diRemap.pack(block.di_data.get(), numDIScans, di_packed.get());
+			words = di_packed.get();
+		}
+
+		numEdges = findDigitalEdges(words, numDIScans, uint32(block.linesEnabled), uint32(eventCode & block.linesEnabled), di_edges.get());
+		for (int e = 0; e < numEdges; e++)
+			di_edge_states[e] = words[di_edges[e]];
+
+		edges = di_edges.get();
+		edgeStates = di_edge_states.get();
+	}
+
+	fillEventCodes(numScans, numEdges, edges, edgeStates, block.linesEnabled);
+
+	/* Decimated samples are numbered at the output rate and keep the timestamp of the scan they are centered on */
+	if (decimator.getFactor() > 1)
+	{
+		const int delay = decimator.getDelay();
+
+		/* The data around a gap is discontinuous, so none of it is filtered into the outputs after it */
+		if (block.afterGap)
+		{
+			decimator.reset();
+			nextCodeSample = block.firstSample;
+			linesSeen = 0;
+		}
+
+		numOutputs = decimator.process(ai_block.get(), numScans, block.firstSample, ai_decimated.get(), decimatedScans.get());
+
+		for (int j = 0; j < numOutputs; j++)
+		{
+			const int s = decimatedScans[j];
+			ai_timestamps[j] = (block.firstSample + s) / decimator.getFactor();
+			decimatedTimes[j] = s < 0 ? delayedTimes[delay + s] : timestamps[s];
+		}
+
+		/* A pulse shorter than the factor still shows: each output ORs the line states since the previous one, up to its center */
+		int j = 0;
+		for (int k = int(jmax(nextCodeSample - block.firstSample, int64(-delay))); k < numScans - delay; k++)
+		{
+			linesSeen |= k < 0 ? delayedCodes[delay + k] : eventCodes[k];
+			if (j < numOutputs && k == decimatedScans[j])
+			{
+				decimatedCodes[j++] = linesSeen;
+				linesSeen = 0;
+			}
+		}
+		nextCodeSample = jmax(nextCodeSample, block.firstSample + numScans - delay);
+
+		/* The outputs centered on the last delay scans come with the next block */
+		const int kept = jmin(numScans, delay);
+		std::copy(delayedTimes.get() + kept, delayedTimes.get() + delay, delayedTimes.get());
+		std::copy(delayedCodes.get() + kept, delayedCodes.get() + delay, delayedCodes.get());
+		std::copy_n(timestamps.get() + numScans - kept, kept, delayedTimes.get() + delay - kept);
+		std::copy_n(eventCodes.get() + numScans - kept, kept, delayedCodes.get() + delay - kept);
+
+		output = ai_decimated.get();
+		outputTimes = decimatedTimes.get();
+		outputCodes = decimatedCodes.get();
+	}
+
+	/* eventCode doesn't carry the marker, so the line drops again on the next sample */
+	gapMarkerPending = gapMarkerPending || block.afterGap;
+	if (gapMarkerPending && numOutputs > 0)
+	{
+		outputCodes[0] |= uint64(1) << getGapMarkerLine();
+		gapMarkerPending = false;
+	}
+
+	kernelNs += nanosecondsBetween(kernelStart, std::chrono::steady_clock::now());
+	stats.kernelTime.add(kernelNs);
+
+	written = aiBuffer->addToBuffer(output, ai_timestamps.get(), outputTimes, outputCodes, numOutputs, numOutputs);
+
+	stats.readToPush.add(nanosecondsBetween(block.readDone, std::chrono::steady_clock::now()));
+	if (written < numOutputs)
+		stats.droppedSamples.store(stats.droppedSamples.load(std::memory_order_relaxed) + (numOutputs - written), std::memory_order_relaxed);
+
+	/* Published with relaxed stores: the readers only need a recent, not a consistent, snapshot */
+	readTime = nanosecondsBetween(block.readStart, std::chrono::steady_clock::now());
+	numReads = fifoCounters.numReads.load(std::memory_order_relaxed);
+
+	if (numReads == 0 || readTime < fifoCounters.minReadTime.load(std::memory_order_relaxed))
+		fifoCounters.minReadTime.store(readTime, std::memory_order_relaxed);
+	if (readTime > fifoCounters.maxReadTime.load(std::memory_order_relaxed))
+		fifoCounters.maxReadTime.store(readTime, std::memory_order_relaxed);
+	fifoCounters.totalReadTime.store(fifoCounters.totalReadTime.load(std::memory_order_relaxed) + readTime, std::memory_order_relaxed);
+	fifoCounters.samplesRead.store(fifoCounters.samplesRead.load(std::memory_order_relaxed) + numScans, std::memory_order_relaxed);
+	fifoCounters.bufferedSamples.store(aiBuffer->getNumSamples(), std::memory_order_relaxed);
+	fifoCounters.numReads.store(numReads + 1, std::memory_order_relaxed);
+
+}
+
+NIDAQ::int32 NIDAQmx::handleEveryNSamples()
+{
+
+	/* Called on a DAQmx thread; a failed read stops the acquisition thread */
+	if (threadShouldExit() || DAQmxFailed(callbackError.load()))
+		return 0;
+
+	/* The driver owns this thread and shares it with other tasks, so threadSettings are left to the converter */
+	NIDAQ::int32 error = readBlock();
+
+	if (DAQmxFailed(error))
+	{
+		callbackError = error;
+		notify();
+	}
+
+	return 0;
+
+}
+
+String NIDAQmx::getChangeDetectionLines(String port)
+{
+	StringArray lines;
+	for (int i = 0; i < di.size(); i++)
+	{
+		if (diChannelEnabled[i] && di[i].id.startsWith(port + "/"))
+			lines.add(di[i].id);
+	}
+	return lines.joinIntoString(",");
+}
+
+String NIDAQmx::getTimestampCounter()
+{
+	char data[2048] = { 0 };
+	NIDAQ::DAQmxGetDevCIPhysicalChans(STR2CHR(deviceName), &data[0], sizeof(data));
+
+	StringArray counters;
+	counters.addTokens(&data[0], ", ", "\"");
+	counters.removeEmptyStrings();
+
+	/* Take the last counter, keeping the low ones free for counter inputs */
+	return counters.size() > 0 ? counters[counters.size() - 1] : String();
+}
+
+NIDAQ::int32 NIDAQmx::readChangeDetectionEdges()
+{
+	NIDAQ::int32 error = 0;
+
+	NIDAQ::uInt32 availableDI = 0, availableCI = 0;
+	DAQmxErrChk(NIDAQ::DAQmxGetReadAvailSampPerChan(taskHandleDI, &availableDI));
+	DAQmxErrChk(NIDAQ::DAQmxGetReadAvailSampPerChan(taskHandleCI, &availableCI));
+
+	{
+		/* The port and the counter are latched on the same event; anything beyond the buffers waits for the next block */
+		int numSamples = jmin((int)jmin(availableDI, availableCI), (int)maxSampsPerChan - pendingEdges.size());
+
+		if (numSamples <= 0)
+			return 0;
+
+		NIDAQ::int32 di_read = 0, ci_read = 0;
+
+		DAQmxErrChk(NIDAQ::DAQmxReadDigitalU32(taskHandleDI, numSamples, 0, DAQmx_Val_GroupByScanNumber,
+			di_data_32.get(), numSamples, &di_read, NULL));
+		DAQmxErrChk(NIDAQ::DAQmxReadCounterU32(taskHandleCI, numSamples, 0,
+			ci_data.get(), numSamples, &ci_read, NULL));
+
+		for (int i = 0; i < jmin(di_read, ci_read); i++)
+		{
+			/* The 32-bit count wraps; unwrap it around the current read position, which is always within the buffer of it.
+			   It restarts from 0 when the tasks are restarted after an overrun */
+			int64 position = ai_timestamp - runStartSample;
+			int64 count = runStartSample + position + int32(ci_data[i] - uint32(position));
+
+			/* count sample clocks had occurred at the edge, so the new state applies from the next sample */
+			DigitalEdge edge = { count + 1, di_data_32[i] };
+			pendingEdges.add(edge);
+		}
+	}
+
+Error:
+	return error;
+}
+
+int NIDAQmx::takePendingEdges(int64 firstSample, int numScans, int* edges, uint32* edgeStates)
+{
+	int numEdges = 0;
+
+	while (numEdges < pendingEdges.size() && pendingEdges.getReference(numEdges).sampleNumber < firstSample + numScans)
+	{
+		const DigitalEdge& edge = pendingEdges.getReference(numEdges);
+		edges[numEdges] = (int)jmax(int64(0), edge.sampleNumber - firstSample);
+		edgeStates[numEdges] = edge.state;
+		numEdges++;
+	}
+
+	pendingEdges.removeRange(0, numEdges);
+
+	return numEdges;
+}
+
+void NIDAQmx::fillEventCodes(int numScans, int numEdges, const int* edges, const uint32* edgeStates, uint64 linesEnabled)
+{
+	eventCode = expandEventCodes(edges, edgeStates, numEdges, numScans, linesEnabled, eventCode, eventCodes.get());
+}
+
+void NIDAQmx::selectTaskChannels()
+{
+
+	/* Only enabled inputs go into the task so they get the full aggregate rate on multiplexed devices */
+	aiTaskChannels.clearQuick();
+	for (int i = 0; i < ai.size(); i++)
+		if (aiChannelEnabled[i])
+			aiTaskChannels.add(i);
+
+	/* A task needs at least one channel; keep AI0 (masked) so DI can still be acquired */
+	if (aiTaskChannels.size() == 0 && ai.size() > 0)
+		aiTaskChannels.add(0);
+
+	/* Those still get a (zero) row in DataBuffer */
+	aiIdleRows.clearQuick();
+	for (int i = 0; i < ai.size(); i++)
+		if (!aiTaskChannels.contains(i))
+			aiIdleRows.add(i);
+
+}
+
+void NIDAQmx::sizeBlocks()
+{
+
+	numSampsPerChan = getSamplesPerRead();
+	lowBacklogReads = 0;
+
+	/* The adaptive block size can grow up to MAX_LATENCY_MS (within the DAQmx buffer), so size the buffers for that */
+	if (isAdaptiveBlockSize() && acquisitionMode == ACQ_BLOCKING_READ)
+		maxSampsPerChan = jlimit(numSampsPerChan, getMaxSamplesPerRead(), roundToInt(samplerate * MAX_LATENCY_MS / 1000.0f));
+	else
+		maxSampsPerChan = numSampsPerChan;
+
+}
+
+BackendTaskConfig NIDAQmx::getBackendConfig()
+{
+
+	BackendTaskConfig config;
+
+	config.aiTask = taskHandleAI;
+	config.diTask = taskHandleDI;
+	config.channels.assign(aiTaskChannels.begin(), aiTaskChannels.end());
+	config.sampleRate = samplerate;
+	config.bufferSize = getInputBufferSize();
+	config.voltsPerCode = (voltageRange.vmax - voltageRange.vmin) / 65536.0;
+
+	return config;
+
+}
+
+NIDAQ::int32 NIDAQmx::createSimulatedTasks()
+{
+
+	/* The SimulatedDevice has no driver callback and always runs the read loop */
+	selectTaskChannels();
+	changeDetectionActive = false;
+	selectDigitalPorts(String());
+	createCounterTask(nullptr); //no counters, only clears the counter channel lists
+
+	sizeBlocks();
+
+	/* A linear code-to-volts polynomial over the selected range, as the driver would report for a 16-bit ADC */
+	BackendTaskConfig config = getBackendConfig();
+
+	aiScalingCoeffs.clearQuick();
+	for (int k = 0; k < aiTaskChannels.size(); k++)
 	{
-		NIDAQ::float64 vmin = data[i];
-		NIDAQ::float64 vmax = data[i + 1];
-		if (vmin == vmax || vmax < 1e-2)
-			break;
-		//printf("Vmin: %f Vmax: %f \n", vmin, vmax);
-		aiVRanges.add(VRange(vmin, vmax));
+		aiScalingCoeffs.add(0.0);
+		aiScalingCoeffs.add(config.voltsPerCode);
+		for (int c = 2; c < NUM_SCALING_COEFFS; c++)
+			aiScalingCoeffs.add(0.0);
 	}
 
-	fflush(stdout);
+	allocateBuffers(maxSampsPerChan);
+
+	MockBackend* mock = new MockBackend();
+	mock->setSimulation(simulation);
+	backend = mock;
+
+	return backend->configure(config);
 
 }
 
-void NIDAQmx::getAIChannels()
+int NIDAQmx::getGapMarkerLine()
 {
+	return di.size();
+}
 
-	NIDAQ::int32	error = 0;
-	char			errBuff[ERR_BUFF_SIZE] = { '\0' };
-
-	NIDAQ::TaskHandle adcResolutionQuery;
-	NIDAQ::DAQmxCreateTask("ADCResolutionQuery", &adcResolutionQuery);
+bool NIDAQmx::isOverrunError(NIDAQ::int32 error)
+{
+	return error == DAQmxErrorSamplesNoLongerAvailable
+		|| error == DAQmxErrorInputFIFOOverflow
+		|| error == DAQmxErrorInputFIFOOverflow2;
+}
 
-	char data[2048];
-	NIDAQ::DAQmxGetDevAIPhysicalChans(STR2CHR(deviceName), &data[0], sizeof(data));
+NIDAQ::int32 NIDAQmx::recoverFromOverrun()
+{
 
-	StringArray channel_list;
-	channel_list.addTokens(&data[0], ", ", "\"");
+	NIDAQ::int32	error = 0;
+	NIDAQ::uInt64	acquired = 0;
+	int64			lost = 0;
 
-	int aiCount = 0;
+	/* Scans the hardware acquired that were never read, plus those it would have acquired while restarting */
+	backend->getTotalAcquired(&acquired);
+	auto stopTime = std::chrono::steady_clock::now();
 
-	VRange vRange = aiVRanges[aiVRanges.size() - 1];
+	stopTasks();
 
-	for (int i = 0; i < channel_list.size(); i++)
+	/* A follower's start trigger has already fired; run it off the shared clock alone and rebuild it on the next start */
+	if (startTrigger.isNotEmpty() && !isSimulated())
 	{
-		if (channel_list[i].length() > 0 && aiCount++ < MAX_ANALOG_CHANNELS)
-		{
-
-			/* Get channel termination */
-			NIDAQ::int32 termCfgs;
-			NIDAQ::DAQmxGetPhysicalChanAITermCfgs(channel_list[i].toUTF8(), &termCfgs);
+		DAQmxErrChk(NIDAQ::DAQmxDisableStartTrig(taskHandleAI));
+		committedConfiguration = String();
+	}
 
-			LOGD(channel_list[i].toRawUTF8(), " Terminal Config: ", termCfgs);
+	pendingEdges.clearQuick();
 
-			ai.add(AnalogIn(channel_list[i].toUTF8()));
+	/* The acquired count starts over with the tasks */
+	clockFit.reset(samplerate > 0 ? 1.0 / samplerate : 0.0);
 
-			terminalConfig.add(termCfgs);
+	if (changeDetectionActive)
+		DAQmxErrChk(NIDAQ::DAQmxStartTask(taskHandleCI));
+	if (taskHandleCtr != 0)
+		DAQmxErrChk(NIDAQ::DAQmxStartTask(taskHandleCtr));
+	DAQmxErrChk(backend->start());
 
-			if (termCfgs & DAQmx_Val_Bit_TermCfg_RSE)
-			{
-				st.add(SOURCE_TYPE::RSE);
-			}
-			else if (termCfgs & DAQmx_Val_Bit_TermCfg_NRSE)
-			{
-				st.add(SOURCE_TYPE::NRSE);
-			}
-			else if (termCfgs & DAQmx_Val_Bit_TermCfg_Diff)
-			{
-				st.add(SOURCE_TYPE::DIFF);
-			}
-			else 
-			{
-				st.add(SOURCE_TYPE::PSEUDO_DIFF);
-			}
+	lost = jmax(int64(0), int64(acquired) - (ai_timestamp - runStartSample))
+		+ int64(samplerate * nanosecondsBetween(stopTime, std::chrono::steady_clock::now()) / 1.0e9);
 
-			/* Get channel ADC resolution */
-			DAQmxErrChk(NIDAQ::DAQmxCreateAIVoltageChan(
-				adcResolutionQuery,			//task handle
-				STR2CHR(ai[aiCount-1].id),	//NIDAQ physical channel name (e.g. dev1/ai1)
-				"",							//user-defined channel name (optional)
-				DAQmx_Val_Cfg_Default,		//input terminal configuration
-				vRange.vmin,				//min input voltage
-				vRange.vmax,				//max input voltage
-				DAQmx_Val_Volts,			//voltage units
-				NULL));
+	ai_timestamp += lost;
+	runStartSample = ai_timestamp;
+	gapPending = true;
+	hasLastReadTime = false;
 
-			DAQmxErrChk(NIDAQ::DAQmxGetAIResolution(adcResolutionQuery, channel_list[i].toUTF8(), &adcResolution));
-			aiChannelEnabled.add(true);
+	seedSinglePointClockFit();
 
-		}
-	}
+	stats.recoveries.store(stats.recoveries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	stats.lostSamples.store(stats.lostSamples.load(std::memory_order_relaxed) + uint64(lost), std::memory_order_relaxed);
 
-	fflush(stdout);
-	NIDAQ::DAQmxStopTask(adcResolutionQuery);
-	NIDAQ::DAQmxClearTask(adcResolutionQuery);
+	LOGC(deviceName, " overrun: restarted the tasks, skipped ", lost, " samples");
 
 Error:
 
-	if (DAQmxFailed(error))
-		NIDAQ::DAQmxGetExtendedErrorInfo(errBuff, ERR_BUFF_SIZE);
+	return error;
 
-	if (adcResolutionQuery != 0) {
-		// DAQmx Stop Code
-		NIDAQ::DAQmxStopTask(adcResolutionQuery);
-		NIDAQ::DAQmxClearTask(adcResolutionQuery);
-	}
+}
 
-	if (DAQmxFailed(error))
-		//LOGE("DAQmx Error: ", errBuff);
-	fflush(stdout);
+void NIDAQmx::stopTasks()
+{
 
-	return;
+	/* Committed tasks go back to the committed state and can be started again right away */
+	if (backend != nullptr)
+		backend->stop();
+
+	if (taskHandleCI != 0)
+		NIDAQ::DAQmxStopTask(taskHandleCI);
+
+	if (taskHandleCtr != 0)
+		NIDAQ::DAQmxStopTask(taskHandleCtr);
 
 }
 
-void NIDAQmx::getDIChannels()
+void NIDAQmx::clearTasks()
 {
 
-	char data[2048];
-	//NIDAQ::DAQmxGetDevTerminals(STR2CHR(deviceName), &data[0], sizeof(data)); //gets all terminals
-	//NIDAQ::DAQmxGetDevDIPorts(STR2CHR(deviceName), &data[0], sizeof(data));	//gets line name
-	NIDAQ::DAQmxGetDevDILines(STR2CHR(deviceName), &data[0], sizeof(data));	//gets ports on line
-	LOGD("Found digital inputs: ");
+	committedConfiguration = String();
+	backend = nullptr;
 
-	StringArray channel_list;
-	channel_list.addTokens(&data[0], ", ", "\"");
+	if (taskHandleAI != 0) {
+		// DAQmx Stop Code
+		NIDAQ::DAQmxStopTask(taskHandleAI);
+		if (acquisitionMode == ACQ_EVERY_N_SAMPLES)
+			NIDAQ::DAQmxRegisterEveryNSamplesEvent(taskHandleAI, DAQmx_Val_Acquired_Into_Buffer, numSampsPerChan, 0, NULL, NULL);
+		NIDAQ::DAQmxClearTask(taskHandleAI);
+		taskHandleAI = 0;
+	}
 
-	int diCount = 0;
+	if (taskHandleDI != 0) {
+		// DAQmx Stop Code
+		NIDAQ::DAQmxStopTask(taskHandleDI);
+		NIDAQ::DAQmxClearTask(taskHandleDI);
+		taskHandleDI = 0;
+	}
 
-	for (int i = 0; i < channel_list.size(); i++)
-	{
-		StringArray channel_type;
-		channel_type.addTokens(channel_list[i], "/", "\"");
-		if (channel_list[i].length() > 0 && diCount++ < MAX_DIGITAL_CHANNELS)
-		{
-			LOGD(channel_list[i].toRawUTF8());
-			di.add(DigitalIn(channel_list[i].toUTF8()));
-			diChannelEnabled.add(false);
-		}
+	if (taskHandleCI != 0) {
+		NIDAQ::DAQmxStopTask(taskHandleCI);
+		NIDAQ::DAQmxClearTask(taskHandleCI);
+		taskHandleCI = 0;
 	}
 
-	fflush(stdout);
+	if (taskHandleCtr != 0) {
+		NIDAQ::DAQmxStopTask(taskHandleCtr);
+		NIDAQ::DAQmxClearTask(taskHandleCtr);
+		taskHandleCtr = 0;
+	}
 
 }
 
-int NIDAQmx::getActiveDigitalLines()
+const char* NIDAQmx::getMMCSSTaskName(MMCSS_TASK task)
 {
-	uint16 linesEnabled = 0;
-	for (int i = 0; i < diChannelEnabled.size(); i++)
-	{
-		if (diChannelEnabled[i])
-			linesEnabled += pow(2, i);
+	switch (task) {
+	case MMCSS_PRO_AUDIO:
+		return "Pro Audio";
+	case MMCSS_CAPTURE:
+		return "Capture";
+	default:
+		return "Off";
 	}
-	return linesEnabled;
 }
 
-void NIDAQmx::toggleSourceType(int index)
+bool NIDAQmx::isMMCSSAvailable()
 {
-
-	SOURCE_TYPE current = st[index];
-	int next = (static_cast<int>(current)+1) % NUM_SOURCE_TYPES;
-	SOURCE_TYPE source = static_cast<SOURCE_TYPE>(next);
-	while (!((1 << next) & terminalConfig[index]))
-		source = static_cast<SOURCE_TYPE>(++next % NUM_SOURCE_TYPES);
-	st.set(index,source);
-
+#ifdef _WIN32
+	return true;
+#else
+	return false;
+#endif
 }
 
-void NIDAQmx::run()
+int NIDAQmx::getThreadPriority() const
 {
-	/* Derived from NIDAQmx: ANSI C Example program: ContAI-ReadDigChan.c */
-
-	NIDAQ::int32	error = 0;
-	char			errBuff[ERR_BUFF_SIZE] = { '\0' };
-
-	/**************************************/
-	/********CONFIG ANALOG CHANNELS********/
-	/**************************************/
+	if (threadSettings.priority >= 0)
+		return threadSettings.priority;
 
-	NIDAQ::int32		ai_read = 0;
-	static int			totalAIRead = 0;
-	NIDAQ::TaskHandle	taskHandleAI = 0;
+	return acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT ? SINGLE_POINT_THREAD_PRIORITY : DEFAULT_THREAD_PRIORITY;
+}
 
-	aiBuffer->clear();
+void NIDAQmx::applyThreadSettings()
+{
 
-	String usePort; //Temporary digital port restriction until software buffering is implemented
+	Thread::setCurrentThreadPriority(getThreadPriority());
 
-	/* Create an analog input task */
-	if (isUSBDevice)
-		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("AITask_USB" + getSerialNumber()), &taskHandleAI));
-	else
-		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("AITask_PXI" + getSerialNumber()), &taskHandleAI));
+	/* run() gets a new thread every start, so "any core" leaves the affinity alone; the JUCE mask only reaches the first 32 cores */
+	if (threadSettings.cpuCore >= 0 && threadSettings.cpuCore < jmin(32, SystemStats::getNumCpus()))
+		Thread::setCurrentThreadAffinityMask(uint32(1) << threadSettings.cpuCore);
 
-	/* Create a voltage channel for each analog input */
-	for (int i = 0; i < ai.size(); i++)
+#ifdef _WIN32
+	if (threadSettings.mmcssTask != MMCSS_OFF && mmcssHandle == nullptr)
 	{
-		NIDAQ::int32 termConfig;
+		auto setCharacteristics = (AvSetMmThreadCharacteristicsFn)getAvrtLibrary().getFunction("AvSetMmThreadCharacteristicsW");
+		auto setPriority = (AvSetMmThreadPriorityFn)getAvrtLibrary().getFunction("AvSetMmThreadPriority");
+		unsigned long taskIndex = 0;
 
-		switch (st[i]) {
-		case SOURCE_TYPE::RSE:
-			termConfig = DAQmx_Val_RSE;
-		case SOURCE_TYPE::NRSE:
-			termConfig = DAQmx_Val_NRSE;
-		case SOURCE_TYPE::DIFF:
-			termConfig = DAQmx_Val_Diff;
-		case SOURCE_TYPE::PSEUDO_DIFF:
-			termConfig = DAQmx_Val_PseudoDiff;
-		default:
-			termConfig = DAQmx_Val_Cfg_Default;
-		}
+		if (setCharacteristics != nullptr)
+			mmcssHandle = setCharacteristics(String(getMMCSSTaskName(threadSettings.mmcssTask)).toWideCharPointer(), &taskIndex);
 
-		DAQmxErrChk(NIDAQ::DAQmxCreateAIVoltageChan(
-			taskHandleAI,					//task handle
-			STR2CHR(ai[i].id),			//NIDAQ physical channel name (e.g. dev1/ai1)
-			"",							//user-defined channel name (optional)
-			termConfig,					//input terminal configuration
-			voltageRange.vmin,			//min input voltage
-			voltageRange.vmax,			//max input voltage
-			DAQmx_Val_Volts,			//voltage units
-			NULL));
+		if (mmcssHandle != nullptr && setPriority != nullptr)
+			setPriority(mmcssHandle, AVRT_PRIORITY_HIGH);
 
+		if (mmcssHandle == nullptr)
+			LOGC(deviceName, " couldn't register the acquisition thread as an MMCSS ", getMMCSSTaskName(threadSettings.mmcssTask), " task");
 	}
+#endif
 
-	/* Configure sample clock timing */
-	DAQmxErrChk(NIDAQ::DAQmxCfgSampClkTiming(
-		taskHandleAI,
-		"",													//source : NULL means use internal clock
-		samplerate,											//rate : samples per second per channel
-		DAQmx_Val_Rising,									//activeEdge : (DAQmc_Val_Rising || DAQmx_Val_Falling)
-		DAQmx_Val_ContSamps,								//sampleMode : (DAQmx_Val_FiniteSamps || DAQmx_Val_ContSamps || DAQmx_Val_HWTimedSinglePoint)
-		MAX_ANALOG_CHANNELS * CHANNEL_BUFFER_SIZE));		//sampsPerChanToAcquire : 
-																//If sampleMode == DAQmx_Val_FiniteSamps : # of samples to acquire for each channel
-																//Elif sampleMode == DAQmx_Val_ContSamps : circular buffer size
-
-
-	/* Get handle to analog trigger to sync with digital inputs */
-	char trigName[256];
-	DAQmxErrChk(GetTerminalNameWithDevPrefix(taskHandleAI, "ai/SampleClock", trigName));
-
-	/************************************/
-	/********CONFIG DIGITAL LINES********/
-	/************************************/
-
-	NIDAQ::int32		di_read = 0;
-	static int			totalDIRead = 0;
-	NIDAQ::TaskHandle	taskHandleDI = 0;
+}
 
-	char ports[2048];
-	NIDAQ::DAQmxGetDevDIPorts(STR2CHR(deviceName), &ports[0], sizeof(ports));
+void NIDAQmx::revertThreadSettings()
+{
 
-	/* For now, restrict max num digital inputs until software buffering is implemented */
-	if (MAX_DIGITAL_CHANNELS <= 8)
+#ifdef _WIN32
+	if (mmcssHandle != nullptr)
 	{
-		StringArray port_list;
-		port_list.addTokens(&ports[0], ", ", "\"");
-		usePort = port_list[0];
+		auto revert = (AvRevertMmThreadCharacteristicsFn)getAvrtLibrary().getFunction("AvRevertMmThreadCharacteristics");
+		if (revert != nullptr)
+			revert(mmcssHandle);
 	}
+#endif
 
-	/* Create a digital input task using device serial number to gurantee unique task name per device */
-	if (isUSBDevice)
-		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("DITask_USB"+getSerialNumber()), &taskHandleDI));
-	else
-		DAQmxErrChk(NIDAQ::DAQmxCreateTask(STR2CHR("DITask_PXI"+getSerialNumber()), &taskHandleDI));
-
-	/* Create a channel for each digital input */
-	DAQmxErrChk(NIDAQ::DAQmxCreateDIChan(
-		taskHandleDI,
-		STR2CHR(usePort),
-		"",
-		DAQmx_Val_ChanForAllLines));
+	mmcssHandle = nullptr;
 
-	
-	if (!isUSBDevice) //USB devices do not have an internal clock and instead use CPU, so we can't configure the sample clock timing
-		DAQmxErrChk(NIDAQ::DAQmxCfgSampClkTiming(
-			taskHandleDI,							//task handle
-			trigName,								//source : NULL means use internal clock, we will sync to analog input clock
-			samplerate,								//rate : samples per second per channel
-			DAQmx_Val_Rising,						//activeEdge : (DAQmc_Val_Rising || DAQmx_Val_Falling)
-			DAQmx_Val_ContSamps,					//sampleMode : (DAQmx_Val_FiniteSamps || DAQmx_Val_ContSamps || DAQmx_Val_HWTimedSinglePoint)
-			CHANNEL_BUFFER_SIZE));					//sampsPerChanToAcquire : want to sync with analog samples per channel
-														//If sampleMode == DAQmx_Val_FiniteSamps : # of samples to acquire for each channel
-														//Elif sampleMode == DAQmx_Val_ContSamps : circular buffer size
+}
 
-	DAQmxErrChk(NIDAQ::DAQmxTaskControl(taskHandleAI, DAQmx_Val_Task_Commit));
-	DAQmxErrChk(NIDAQ::DAQmxTaskControl(taskHandleDI, DAQmx_Val_Task_Commit));
+void NIDAQmx::run()
+{
 
-	DAQmxErrChk(NIDAQ::DAQmxStartTask(taskHandleDI));
-	DAQmxErrChk(NIDAQ::DAQmxStartTask(taskHandleAI));
+	NIDAQ::int32	error = 0;
+	char			errBuff[ERR_BUFF_SIZE] = { '\0' };
 
-	NIDAQ::int32 numSampsPerChan;
-	if (isUSBDevice)
-		numSampsPerChan = 100;
-	else
-		numSampsPerChan = CHANNEL_BUFFER_SIZE;
+	aiBuffer->clear();
 
-	NIDAQ::int32 arraySizeInSamps = ai.size() * numSampsPerChan;
-	NIDAQ::float64 timeout = 5.0;
+	callbackError = 0;
 
-	uint64 linesEnabled = 0;
-	double ts;
+	applyThreadSettings();
 
-	ai_timestamp = 0;
-	eventCode = 0;
+	/* The converter has to be running before the first driver callback can queue a block */
+	pipelineFifo.reset();
+	if (converter == nullptr)
+		converter = new BlockConverter(this);
+	converter->startThread(getThreadPriority());
 
-	
+	/* Tasks stay committed between runs and are only rebuilt when their configuration changes */
+	String configuration = getTaskConfiguration();
 
-	while (!threadShouldExit())
+	if (taskHandleAI == 0 || configuration != committedConfiguration)
 	{
+		clearTasks();
+		error = createTasks();
+		if (!DAQmxFailed(error))
+			committedConfiguration = configuration;
+	}
 
-		DAQmxErrChk(NIDAQ::DAQmxReadAnalogF64(
-			taskHandleAI,
-			numSampsPerChan,
-			timeout,
-			DAQmx_Val_GroupByScanNumber, //DAQmx_Val_GroupByScanNumber
-			ai_data,
-			arraySizeInSamps,
-			&ai_read,
-			NULL));
-
-		LOGD("arraySizeInSamps: ", arraySizeInSamps, "Samples read: ", ai_read);
-
-		if (getActiveDigitalLines() > 0)
-		{
-			//if (isUSBDevice)
-			if (true)	
-				DAQmxErrChk(NIDAQ::DAQmxReadDigitalU32(
-					taskHandleDI,
-					numSampsPerChan,
-					timeout,
-					DAQmx_Val_GroupByScanNumber,
-					di_data_32,
-					numSampsPerChan,
-					&di_read,
-					NULL));
-			else 
-				DAQmxErrChk(NIDAQ::DAQmxReadDigitalU8(
-					taskHandleDI,
-					numSampsPerChan,
-					timeout,
-					DAQmx_Val_GroupByScanNumber,
-					di_data_8,
-					numSampsPerChan,
-					&di_read,
-					NULL));
-		}
+	if (!DAQmxFailed(error))
+		error = startTasks();
 
-		/*
-		std::chrono::milliseconds last_time;
-		std::chrono::milliseconds t = std::chrono::duration_cast< std::chrono::milliseconds >(
-			std::chrono::system_clock::now().time_since_epoch());
-		long long t_ms = t.count()*std::chrono::milliseconds::period::num / std::chrono::milliseconds::period::den;
-		if (ai_read>0) {
-			printf("Read @ %i | ", t_ms);
-			printf("Acquired %d AI samples. Total %d | ", (int)ai_read, (int)(totalAIRead += ai_read));
-			printf("Acquired %d DI samples. Total %d\n", (int)di_read, (int)(totalDIRead += di_read));
-			fflush(stdout);
-		}
-		*/
+	/* Lets NIDAQThread start the device that owns a shared clock once the others are armed */
+	startError = error;
+	tasksStarted.signal();
 
-		float aiSamples[MAX_ANALOG_CHANNELS];
-		int count = 0;
-		for (int i = 0; i < arraySizeInSamps; i++)
+	if (!DAQmxFailed(error))
+	{
+		/* The SimulatedDevice has no driver callback and always runs the read loop */
+		if (acquisitionMode == ACQ_EVERY_N_SAMPLES && !isSimulated())
 		{
-	
-			int channel = i % MAX_ANALOG_CHANNELS;
-
-			aiSamples[channel] = 0;
-			if (aiChannelEnabled[channel])
-				aiSamples[channel] = ai_data[i];
-
-			if (i % MAX_ANALOG_CHANNELS == 0)
+			/* Reads happen in the driver callback; wake up on stop or on a callback error */
+			while (!threadShouldExit() && !DAQmxFailed(error))
 			{
-				ai_timestamp++;
-				if (getActiveDigitalLines() > 0)
+				wait(100);
+
+				error = callbackError;
+				if (overrunRecovery && isOverrunError(error) && !threadShouldExit())
 				{
-					//if (isUSBDevice)
-					if (true)	
-						eventCode = di_data_32[count++] & getActiveDigitalLines();
-					else
-						eventCode = di_data_8[count++] & getActiveDigitalLines();
+					/* The callback ignores the restarted task until callbackError is cleared */
+					error = recoverFromOverrun();
+					callbackError = error;
 				}
-				aiBuffer->addToBuffer(aiSamples, &ai_timestamp, &ts, &eventCode, 1);
 			}
-
 		}
+		else if (acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT)
+		{
+			while (!threadShouldExit() && !DAQmxFailed(error))
+				error = readSinglePoint();
+		}
+		else
+		{
+			while (!threadShouldExit() && !DAQmxFailed(error))
+			{
+				error = readBlock();
 
-		//fflush(stdout);
-
+				if (overrunRecovery && isOverrunError(error) && !threadShouldExit())
+					error = recoverFromOverrun();
+			}
+		}
 	}
 
+	if (DAQmxFailed(error))
+		NIDAQ::DAQmxGetExtendedErrorInfo(errBuff, ERR_BUFF_SIZE);
+
 	/*********************************************/
 	// DAQmx Stop Code
 	/*********************************************/
 
-	NIDAQ::DAQmxStopTask(taskHandleAI);
-	NIDAQ::DAQmxClearTask(taskHandleAI);
-	NIDAQ::DAQmxStopTask(taskHandleDI);
-	NIDAQ::DAQmxClearTask(taskHandleDI);
-
-	return;
+	stopTasks();
 
-Error:
+	/* Nothing is queued any more; let the converter push what is left */
+	converter->signalThreadShouldExit();
+	blockQueued.signal();
+	converter->waitForThreadToExit(-1);
 
+	/* Don't reuse tasks left in an unknown state */
 	if (DAQmxFailed(error))
-		NIDAQ::DAQmxGetExtendedErrorInfo(errBuff, ERR_BUFF_SIZE);
+		clearTasks();
 
-	if (taskHandleAI != 0) {
-		// DAQmx Stop Code
-		NIDAQ::DAQmxStopTask(taskHandleAI);
-		NIDAQ::DAQmxClearTask(taskHandleAI);
-	}
+	revertThreadSettings();
 
-	if (taskHandleDI != 0) {
-		// DAQmx Stop Code
-		NIDAQ::DAQmxStopTask(taskHandleDI);
-		NIDAQ::DAQmxClearTask(taskHandleDI);
-	}
 	if (DAQmxFailed(error))
 		LOGE("DAQmx Error: ", errBuff);
 		fflush(stdout);
@@ -654,12 +2815,12 @@ Error:
 
 }
 
-InputChannel::InputChannel()
+InputChannel::InputChannel() : fifo(nullptr)
 {
 
 }
 
-InputChannel::InputChannel(String id) : id(id), enabled(true)
+InputChannel::InputChannel(String id, const FifoCounters* fifo) : id(id), enabled(true), fifo(fifo)
 {
 }
 
@@ -672,11 +2833,16 @@ void InputChannel::setEnabled(bool enable)
 	enabled = enable;
 }
 
+float InputChannel::getFillPercentage()
+{
+	return fifo != nullptr ? fifo->getBufferFill() : 0.0f;
+}
+
 AnalogIn::AnalogIn()
 {
 }
 
-AnalogIn::AnalogIn(String id) : InputChannel(id)
+AnalogIn::AnalogIn(String id, const FifoCounters* fifo) : InputChannel(id, fifo)
 {
 	
 }
@@ -686,7 +2852,7 @@ AnalogIn::~AnalogIn()
 
 }
 
-DigitalIn::DigitalIn(String id) : InputChannel(id)
+DigitalIn::DigitalIn(String id, const FifoCounters* fifo) : InputChannel(id, fifo)
 {
 
 }
@@ -701,5 +2867,20 @@ DigitalIn::~DigitalIn()
 
 }
 
+Counter::Counter(String id, const FifoCounters* fifo) : InputChannel(id, fifo)
+{
+
+}
+
+Counter::Counter()
+{
+
+}
+
+Counter::~Counter()
+{
+
+}
+
 
 
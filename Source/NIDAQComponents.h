@@ -27,14 +27,40 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <DataThreadHeaders.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <chrono>
+#include <map>
 
 #include "nidaq-api/NIDAQmx.h"
+#include "NIDAQKernels.h"
+#include "NIDAQBackend.h"
 
 #define NUM_SOURCE_TYPES 4
 #define CHANNEL_BUFFER_SIZE 500
-#define MAX_ANALOG_CHANNELS 8
-#define NUM_SAMPLE_RATES 17
-#define MAX_DIGITAL_CHANNELS 8
+#define HOST_BUFFER_BLOCKS 8
+#define DEFAULT_LATENCY_MS 20.0f
+#define MIN_LATENCY_MS 1.0f
+#define MAX_LATENCY_MS 100.0f
+#define ADAPTIVE_SHRINK_READS 8
+#define DEFAULT_INPUT_BUFFER_MS 2000.0f
+#define MAX_INPUT_BUFFER_BYTES (256 * 1024 * 1024)
+#define DEFAULT_DATA_BUFFER_MS 1000.0f //DataBuffer headroom for GUI stalls
+#define MIN_DATA_BUFFER_READS 4 //the DataBuffer holds at least this many blocks
+#define MAX_DATA_BUFFER_BYTES (256 * 1024 * 1024)
+#define MIN_LISTED_SAMPLE_RATE 1000.0 //lowest round rate offered in the sample rate list
+#define DEFAULT_TIMEBASE_RATE 100.0e6 //AI sample clock timebase assumed if the device can't report it
+#define NUM_HISTOGRAM_BINS 36 //bin i counts durations in [2^i, 2^(i+1)) ns
+#define DEFAULT_SIMULATED_CHANNELS 8
+#define MAX_SIMULATED_CHANNELS 64
+#define CAPABILITIES_XML_VERSION 1 //saved capability snapshots of another version are ignored
+#define DEFAULT_THREAD_PRIORITY 5 //JUCE thread priority, 0 to 10
+#define SINGLE_POINT_THREAD_PRIORITY 10 //default in single point mode, which has a sample clock period to react in
+#define NUM_PIPELINE_BLOCKS 8 //blocks in the ring between the reader and the converter; one slot always stays empty
+#define CLOCK_QUERY_MAX_US 200 //host clock samples around a slower acquired-count query are left out of the fit
+#define CI_MIN_FREQUENCY 1.0 //Hz, range of the counter frequency measurements
+#define CI_MAX_FREQUENCY 100000.0
+#define SINGLE_POINT_FIT_INTERVAL 256 //scans between clock fit updates in single point mode
+#define PIPELINE_WAIT_MS 100 //longest wait of either stage before checking whether it should exit
 #define ERR_BUFF_SIZE 2048
 #define STR2CHR( jString ) ((jString).toUTF8())
 #define DAQmxErrChk(functionCall) if( DAQmxFailed(error=(functionCall)) ) goto Error; else
@@ -64,24 +90,51 @@ public:
 	void getInfo();
 };
 
+struct DeviceCapabilities;
+
 class NIDAQmxDeviceManager
 {
 public:
 	NIDAQmxDeviceManager();
 	~NIDAQmxDeviceManager();
 
-	void scanForDevices();
+	/* Lists the connected devices and probes only those not already cached (by name and serial number).
+	   Returns true if any device was added, removed or replaced. */
+	bool scanForDevices();
 
 	String getDeviceFromIndex(int deviceIndex);
 	String getDeviceFromProductName(String productName);
 
+	/* Capabilities probed for a device in the last scan; valid until the next one */
+	const DeviceCapabilities* getCapabilities(int deviceIndex);
+
 	int getNumAvailableDevices();
 
+	/* AI channels of the SimulatedDevice listed when no hardware is found; applied on the next scan */
+	void setNumSimulatedChannels(int numChannels);
+	int getNumSimulatedChannels();
+
+	/* Writes the capabilities of the probed hardware as a CAPABILITIES child of xml */
+	void saveCapabilities(XmlElement* xml);
+
+	/* Seeds the cache with a saved snapshot, so the next scan only probes boards that aren't in it.
+	   Safe to call while a scan runs; the entries are then used from the scan after it. */
+	void loadCapabilities(const XmlElement* xml);
+
 	friend class NIDAQThread;
 
 private:
 	int selectedDeviceIndex;
+	int numSimulatedChannels;
 	StringArray devices;
+
+	/* One entry per device, same order as devices */
+	OwnedArray<DeviceCapabilities> capabilities;
+
+	/* Guards devices and capabilities, which a scan replaces while the message thread reads them,
+	   and the loaded snapshot entries, merged into capabilities when the next scan starts */
+	CriticalSection snapshotLock;
+	OwnedArray<DeviceCapabilities> snapshot;
 	
 };
 
@@ -99,6 +152,27 @@ struct SRange {
 		: smin(smin), smaxs(smaxs), smaxm(smaxm) {}
 };
 
+/* Everything connect() learns about a device, so it only has to be probed once */
+struct DeviceCapabilities
+{
+	String				deviceName;
+	NIDAQ::uInt32		serialNum;
+	String				productName;
+	NIDAQ::int32		deviceCategory;
+	NIDAQ::uInt32		productNum;
+	bool				isUSBDevice;
+	bool				simAISamplingSupported;
+	NIDAQ::float64		adcResolution;
+	SRange				sampleRateRange;
+	NIDAQ::float64		timebaseRate; //AI sample clock timebase, every rate is timebaseRate / N
+	std::map<int, Array<float>> verifiedSampleRates; //coerced rate list for each enabled channel count
+	Array<VRange>		aiVRanges;
+	StringArray			aiChannels;
+	Array<NIDAQ::int32>	terminalConfigs; //DAQmx_Val_Bit_TermCfg_* flags for each AI channel
+	StringArray			diLines;
+	StringArray			ciChannels;
+};
+
 enum SOURCE_TYPE {
 	RSE = 0,
 	NRSE,
@@ -106,27 +180,383 @@ enum SOURCE_TYPE {
 	PSEUDO_DIFF
 };
 
+enum ACQUISITION_MODE {
+	ACQ_BLOCKING_READ = 0,	//acquisition thread blocks in the DAQmx read calls
+	ACQ_EVERY_N_SAMPLES,	//reads run in a DAQmxRegisterEveryNSamplesEvent callback
+	ACQ_HW_TIMED_SINGLE_POINT,	//one scan per sample clock (DAQmx_Val_HWTimedSinglePoint), pushed by the reading thread
+	NUM_ACQUISITION_MODES
+};
+
+enum AI_READ_MODE {
+	READ_SCALED_F64 = 0,	//DAQmxReadAnalogF64, driver applies the scaling
+	READ_RAW_I16			//DAQmxReadBinaryI16, scaled in the plugin with the driver coefficients
+};
+
+enum AI_XFER_MECH {
+	XFER_MECH_DEFAULT = 0,	//let the driver pick for the bus
+	XFER_MECH_DMA,
+	XFER_MECH_INTERRUPTS
+};
+
+enum AI_XFER_REQ_COND {
+	XFER_REQ_DEFAULT = 0,	//let the driver pick for the device
+	XFER_REQ_NOT_EMPTY,		//transfer as soon as the onboard FIFO has data (lowest latency)
+	XFER_REQ_HALF_FULL		//transfer in larger bursts once the FIFO is half full (fewest bus transactions)
+};
+
+enum DI_TIMING_MODE {
+	DI_SAMPLE_CLOCK = 0,	//DI port sampled on every AI scan
+	DI_CHANGE_DETECTION		//DI port sampled only on edges of the enabled lines, timestamped with a counter
+};
+
+enum COUNTER_MODE {
+	CI_OFF = 0,
+	CI_EDGE_COUNT,			//rising edges on the counter source terminal since the start
+	CI_FREQUENCY,			//frequency on the counter source terminal, in Hz
+	CI_ENCODER,				//X4 quadrature encoder position on the A and B terminals, in ticks
+	NUM_COUNTER_MODES
+};
+
+enum MMCSS_TASK {
+	MMCSS_OFF = 0,
+	MMCSS_PRO_AUDIO,	//Windows Multimedia Class Scheduler "Pro Audio" task
+	MMCSS_CAPTURE		//"Capture" task
+};
+
+/* Scheduling of the thread that reads from the device */
+struct AcquisitionThreadSettings
+{
+	int			priority = -1; //10 : realtime, -1 : the default for the acquisition mode
+	int			cpuCore = -1; //core the thread is pinned to, -1 : any
+	MMCSS_TASK	mmcssTask = MMCSS_OFF; //only available on Windows
+};
+
+/* A change of the DI port state, at the AI sample number from which it applies */
+struct DigitalEdge
+{
+	int64 sampleNumber;
+	uint32 state;
+};
+
+/* Published by the acquisition thread once per read and read from the message thread without locking */
+struct FifoCounters
+{
+	FifoCounters();
+
+	/* Called from startTasks, before the first read of a run */
+	void reset();
+
+	/* Scans per channel waiting in the DAQmx input buffer after the last read, and the buffer size */
+	std::atomic<NIDAQ::uInt32>	backlog;
+	std::atomic<NIDAQ::uInt32>	inputBufferSize;
+
+	/* Samples waiting in the DataBuffer after the last push, and its size */
+	std::atomic<int>			bufferedSamples;
+	std::atomic<int>			bufferSize;
+
+	std::atomic<uint64>			samplesRead;
+	std::atomic<uint64>			numReads;
+
+	/* Duration of the read calls, in ns */
+	std::atomic<int64>			minReadTime;
+	std::atomic<int64>			maxReadTime;
+	std::atomic<int64>			totalReadTime;
+
+	/* Fraction of the DAQmx input buffer in use, 0 to 1 */
+	float getBacklogFill() const;
+
+	/* Fraction of the DataBuffer in use, 0 to 1 */
+	float getBufferFill() const;
+
+	/* Mean read call duration in ns, 0 before the first read */
+	int64 getAverageReadTime() const;
+};
+
+/* Histogram of durations with power-of-two bins; one writer, any number of readers, no locking */
+class LogHistogram
+{
+public:
+	LogHistogram();
+
+	void add(int64 ns);
+	void reset();
+
+	uint64 getCount() const;
+	int64 getMax() const;
+
+	/* Upper edge, in ns, of the bin reached by the given fraction (0 to 1) of the samples */
+	int64 getPercentile(float fraction) const;
+
+	/* One line: count, percentiles, max, then the non-empty bins as <upper edge in us>:<count> */
+	String toString() const;
+
+private:
+	std::atomic<uint32>	bins[NUM_HISTOGRAM_BINS];
+	std::atomic<int64>	maxValue;
+};
+
+/* Hot path telemetry, kept across runs until reset with a NIDAQ STATS RESET message */
+struct AcquisitionStats
+{
+	void reset();
+
+	/* The stats are written with plain load/store pairs, so while acquiring each side clears the ones it writes
+	   when it sees a new request: the read side (readBlock, readSinglePoint, recoverFromOverrun) and the converter */
+	void resetReadStats();
+	void resetConvertStats();
+	bool takeResetRequest(uint32& seen) const;
+	std::atomic<uint32>	resetRequests{ 0 };
+
+	LogHistogram		readToPush; //from the AI read returning to the block being in the DataBuffer
+	LogHistogram		readJitter; //deviation of the time between reads from the block duration
+	LogHistogram		kernelTime; //deinterleave and event code kernels
+	std::atomic<uint64>	droppedSamples{ 0 }; //scans per channel the DataBuffer had no room for
+	std::atomic<uint64>	recoveries{ 0 }; //overruns recovered from by restarting the tasks
+	std::atomic<uint64>	lostSamples{ 0 }; //scans per channel skipped over by those restarts
+	std::atomic<uint64>	missedSamples{ 0 }; //sample clocks a late single point loop iteration didn't read
+};
+
+/* A block read by the acquisition thread and waiting to be converted, owned by the stage working on it */
+struct AcquisitionBlock
+{
+	/* Interleaved as read, sized with the other per-block buffers */
+	AlignedBuffer<NIDAQ::float64>	ai_data;
+	AlignedBuffer<NIDAQ::int16>		ai_data_i16;
+	AlignedBuffer<uint8>			ai_mask;
+	AlignedBuffer<NIDAQ::uInt32>	di_data; //one word per DI task port per scan
+	AlignedBuffer<NIDAQ::float64>	ctr_data; //counter task, interleaved like ai_data
+
+	/* Change detection edges taken for this block; unused when the port is sampled on every scan */
+	AlignedBuffer<int>				di_edges;
+	AlignedBuffer<uint32>			di_edge_states;
+
+	NIDAQ::int32	aiRead = 0;
+	NIDAQ::int32	diRead = 0;
+	NIDAQ::int32	ctrRead = 0;
+	int				numEdges = -1; //-1 : find the edges in di_data
+	int64			firstSample = 0; //sample number of scan 0
+	double			firstTime = 0; //host time of scan 0, in s since the Unix epoch
+	double			samplePeriod = 0; //host time between two scans, in s
+	uint64			linesEnabled = 0; //snapshot of the enabled lines when the block was read
+	bool			afterGap = false; //first block after an overrun
+	std::chrono::steady_clock::time_point readStart, readDone;
+};
+
+/* Second pipeline stage: converts and pushes the blocks NIDAQmx reads, so the reads keep their cadence */
+class BlockConverter : public Thread
+{
+public:
+	BlockConverter(NIDAQmx* device);
+	void run() override;
+private:
+	NIDAQmx* device;
+};
+
 class NIDAQmx : public Thread
 {
 public:
 
 	NIDAQmx();
 	NIDAQmx(const char* deviceName);
+
+	/* Builds the device from cached capabilities, without talking to the driver */
+	NIDAQmx(const DeviceCapabilities& capabilities);
 	~NIDAQmx();
 
 	void connect(); 
 
+	/* Copies what connect() found, or restores it from a cache */
+	void getCapabilities(DeviceCapabilities& capabilities);
+	void setCapabilities(const DeviceCapabilities& capabilities);
+
+	/* Probes a device once to fill a cache entry */
+	static void probeCapabilities(const String& deviceName, DeviceCapabilities& capabilities);
+
+	/* Capabilities of the SimulatedDevice, which has no driver counterpart */
+	static void getSimulatedCapabilities(int numChannels, DeviceCapabilities& capabilities);
+
+	/* True for the SimulatedDevice: a MockBackend stands in for the DAQmx tasks */
+	bool isSimulated() const;
+
 	String getProductName();
 	String getSerialNumber();
 
 	void getAIChannels();
 	void getAIVoltageRanges();
 	void getDIChannels();
+	void getCIChannels();
+	void getTimebaseRate();
 
 	SOURCE_TYPE getSourceTypeForInput(int index);
 	void toggleSourceType(int id);
 
-	int getActiveDigitalLines();
+	uint64 getActiveDigitalLines();
+
+	/* Recomputes the cached mask after diChannelEnabled changes */
+	void updateDigitalLineMask();
+
+	int getNumEnabledAnalogInputs();
+
+	/* Picks the DI ports the task reads (only onlyPort if not empty) and builds diRemap for them */
+	void selectDigitalPorts(const String& onlyPort);
+
+	/* Counters not set to CI_OFF; their rows follow the AI rows in DataBuffer */
+	int getNumCounterChannels();
+
+	/* DataBuffer row of counter index, -1 if it is off */
+	int getCounterRow(int index);
+
+	/* AI and counter rows handed to DataBuffer */
+	int getNumDataChannels();
+
+	static const char* getCounterModeName(COUNTER_MODE mode);
+
+	/* Highest per-channel rate for the enabled inputs */
+	NIDAQ::float64 getMaxSampleRate();
+
+	/* Rebuilds sampleRates after the enabled inputs change */
+	void updateSampleRates();
+
+	/* The standard round rates within the device limits, plus the fastest rate the timebase gives for the enabled inputs */
+	Array<float> getCandidateSampleRates();
+
+	/* Replaces rates with what the driver coerces each of them to for a task of numChannels inputs */
+	void verifySampleRates(int numChannels, Array<float>& rates);
+
+	/* Returns true if the device ADC codes fit in a 16-bit raw read */
+	bool supportsRawRead();
+
+	/* The samplerate / outputRate decimation (1 : none), and the rate the stream runs at */
+	int getDecimationFactor() const;
+	float getOutputSampleRate() const;
+
+	/* Volts per ADC code reported to the GUI for an AI channel */
+	float getBitVolts(int index);
+
+	/* Sizes the per-block buffers for the current channel layout */
+	void allocateBuffers(int numSampsPerChan);
+
+	/* DAQmx input buffer size, in scans per channel: inputBufferMs if set, otherwise
+	   DEFAULT_INPUT_BUFFER_MS of data capped to MAX_INPUT_BUFFER_BYTES for the enabled channels */
+	NIDAQ::int32 getInputBufferSize();
+
+	/* DataBuffer size, in samples per channel: dataBufferMs of the output rate for the
+	   channels pushed, at least MIN_DATA_BUFFER_READS blocks and capped to MAX_DATA_BUFFER_BYTES */
+	int getDataBufferSize();
+
+	/* Applies the advanced AI transfer options to the AI task */
+	NIDAQ::int32 configureDataTransfer();
+
+	/* Creates the counter input task for the counters in use, clocked by sampleClock */
+	NIDAQ::int32 createCounterTask(const char* sampleClock);
+
+	/* Points driver-side logging of the AI task at a new TDMS file in loggingDirectory */
+	NIDAQ::int32 configureLogging();
+
+	/* Limits for the number of scans per channel in each read */
+	NIDAQ::int32 getMaxSamplesPerRead();
+	NIDAQ::int32 getMinSamplesPerRead();
+
+	/* True when the block size follows the driver backlog (no fixed size or latency set) */
+	bool isAdaptiveBlockSize();
+
+	/* Scans per channel in each read: samplesPerRead if set, otherwise derived from targetLatencyMs; 1 in single point mode */
+	NIDAQ::int32 getSamplesPerRead();
+
+	/* DAQmx sampleMode of the AI task and the tasks clocked by it */
+	NIDAQ::int32 getSampleMode() const;
+
+	/* Grows the block when the driver backlog builds up and shrinks it when the backlog stays low */
+	void adaptSamplesPerRead(NIDAQ::uInt32 available);
+
+	/* Counters updated once per read; safe to read from any thread */
+	const FifoCounters& getFifoCounters() const;
+
+	/* Latency histograms and drop count, kept until resetStats; while acquiring, the reset is applied on the next read */
+	const AcquisitionStats& getStats() const;
+	void resetStats();
+
+	/* Enabled lines of a DI port, as a DAQmx channel list */
+	String getChangeDetectionLines(String port);
+
+	/* Counter used to timestamp change detection edges, or an empty string if the device has none */
+	String getTimestampCounter();
+
+	/* Reads the change detection samples available so far into pendingEdges */
+	NIDAQ::int32 readChangeDetectionEdges();
+
+	/* Moves the pending edges that fall within the block starting at firstSample into edges / edgeStates */
+	int takePendingEdges(int64 firstSample, int numScans, int* edges, uint32* edgeStates);
+
+	/* Event line after the DI lines, pulsed on the first sample after an overrun gap */
+	int getGapMarkerLine();
+
+	/* True for the driver errors reported when the input buffer overflows */
+	static bool isOverrunError(NIDAQ::int32 error);
+
+	/* Restarts the committed tasks in place after an overrun and skips ai_timestamp over the lost scans */
+	NIDAQ::int32 recoverFromOverrun();
+
+	/* threadSettings.priority, or the default for the acquisition mode if it isn't set */
+	int getThreadPriority() const;
+
+	/* Applies threadSettings to the run() thread; MMCSS registration is undone by revertThreadSettings */
+	void applyThreadSettings();
+	void revertThreadSettings();
+
+	/* Names of the MMCSS tasks, and whether this platform has MMCSS */
+	static const char* getMMCSSTaskName(MMCSS_TASK task);
+	static bool isMMCSSAvailable();
+
+	/* SimulatedDevice: selects the channels and sizes the buffers like createTasks, for a MockBackend */
+	NIDAQ::int32 createSimulatedTasks();
+
+	/* Block size, buffers and task channel layout shared by createTasks and createSimulatedTasks */
+	void selectTaskChannels();
+	void sizeBlocks();
+	BackendTaskConfig getBackendConfig();
+
+	/* Fills eventCodes from numEdges state changes */
+	void fillEventCodes(int numScans, int numEdges, const int* edges, const uint32* edgeStates, uint64 linesEnabled);
+
+	/* Creates and commits the AI and DI tasks for the current settings */
+	NIDAQ::int32 createTasks();
+
+	/* Settings the committed tasks were built from, compared on each start */
+	String getTaskConfiguration();
+
+	/* Starts the committed tasks, counter and DI ahead of AI */
+	NIDAQ::int32 startTasks();
+
+	/* Stops the tasks but keeps them committed for the next run */
+	void stopTasks();
+
+	/* Reads one block of numSampsPerChan scans and queues it for the converter; waits while the ring is full */
+	NIDAQ::int32 readBlock();
+
+	/* Adds the scans acquired so far and the host time to clockFit, or lastSample at readDone if that is
+	   all there is to go on; reader only */
+	void updateClockFit(int64 lastSample, std::chrono::steady_clock::time_point readDone);
+
+	/* In single point mode, gives clockFit a first point at the task start; reader only */
+	void seedSinglePointClockFit();
+
+	/* Host time of a steady_clock sample, in s since the Unix epoch */
+	double getHostTime(std::chrono::steady_clock::time_point time) const;
+
+	/* Single point mode: waits for the next sample clock, then reads, converts and pushes that scan */
+	NIDAQ::int32 readSinglePoint();
+
+	/* Converts and pushes the queued blocks until the converter is told to exit and the ring is empty */
+	void runConverter(Thread* stage);
+
+	/* Deinterleaves, extracts the events of and pushes one block */
+	void convertBlock(AcquisitionBlock& block);
+
+	/* Entry point for the every N samples callback */
+	NIDAQ::int32 handleEveryNSamples();
+
+	void clearTasks();
 
 	void run();
 
@@ -134,6 +564,12 @@ public:
 
 private:
 
+	/* Shared by the constructors: initial state before the device is known, and default settings after */
+	void resetState();
+	void setDefaultSettings();
+
+	static SOURCE_TYPE getDefaultSourceType(NIDAQ::int32 termCfgs);
+
 	String				deviceName;
 	String				productName;
 	NIDAQ::int32		deviceCategory;
@@ -143,29 +579,136 @@ private:
 	bool				simAISamplingSupported;
 	NIDAQ::float64		adcResolution;
 	SRange 				sampleRateRange;
+	NIDAQ::float64		timebaseRate;
+	std::map<int, Array<float>> verifiedSampleRates; //verified once per enabled channel count
 
 	Array<VRange>		aiVRanges;
 	VRange				voltageRange;
 
 	Array<float>		sampleRates;
 	float				samplerate;
+	float				outputRate; //decimated rate handed to the GUI, 0 : samplerate
 
 	Array<AnalogIn> 	ai;
 	Array<NIDAQ::int32> terminalConfig;
 	Array<SOURCE_TYPE>  st;
 	Array<bool>			aiChannelEnabled;
+	Array<int>			aiTaskChannels; //AI index of each channel in the running task
+	Array<int>			aiIdleRows; //rows of the inputs left out of the task
 
 	Array<DigitalIn> 	di;
 	Array<bool>			diChannelEnabled;
+	StringArray			diTaskPorts; //ports of the DI task, one channel each
+	DigitalLineRemap	diRemap; //port words of a DI read to line bits
+
+	Array<Counter>		ci;
+	Array<COUNTER_MODE>	ciMode;
+	Array<int>			ciTaskChannels; //counter index of each channel in the counter task
+	Array<int>			ciTaskRows; //DataBuffer row of each counter task channel
+	Array<int>			ciIdleRows; //rows of counters in use that couldn't go into the task
+	std::atomic<uint64>	digitalLineMask; //bit i set if DI line i is enabled, read once per block
+
+	ACQUISITION_MODE	acquisitionMode;
+	NIDAQ::int32		samplesPerRead;
+	float				targetLatencyMs; //0 : adapt the block size to the backlog
+	NIDAQ::int32		numSampsPerChan;
+	NIDAQ::int32		maxSampsPerChan;
+	int					lowBacklogReads;
+
+	/* Advanced device options */
+	float				inputBufferMs; //0 : scale with the sample rate and channel count
+	float				dataBufferMs; //headroom of the DataBuffer the GUI drains
+	AI_XFER_MECH		xferMech;
+	AI_XFER_REQ_COND	xferReqCond;
+
+	NIDAQ::TaskHandle	taskHandleAI;
+	NIDAQ::TaskHandle	taskHandleDI;
+	NIDAQ::TaskHandle	taskHandleCI; //edge timestamp counter for change detection
+	NIDAQ::TaskHandle	taskHandleCtr; //counter inputs, clocked by the AI sample clock
+
+	/* Multi-device acquisition */
+	bool				deviceEnabled; //acquire from this device
+	String				clockSource; //AI sample clock terminal, empty for the onboard clock
+	String				startTrigger; //AI start trigger terminal, empty to start immediately
+	WaitableEvent		tasksStarted; //signalled once startTasks has returned
+	NIDAQ::int32		startError; //result of creating and starting the tasks, set before tasksStarted is signalled
+
+	String				committedConfiguration; //getTaskConfiguration() of the committed tasks, empty if none
+
+	DI_TIMING_MODE		diTimingMode;
+	bool				changeDetectionActive; //diTimingMode could be applied to the running task
+	Array<DigitalEdge>	pendingEdges; //edges read ahead of the AI data
+
+	/* Overrun recovery */
+	bool				overrunRecovery; //restart the tasks instead of stopping on an overrun
+	int64				runStartSample; //ai_timestamp of scan 0 of the running tasks
+	bool				gapPending; //mark the next block as following a gap
+
+	/* Driver-side TDMS logging */
+	bool				driverLogging; //DAQmx writes the raw AI data to disk while the plugin reads it
+	String				loggingDirectory; //set by NIDAQThread before each run
+	String				loggingFile; //TDMS file of the running tasks, empty if not logging
+
+	/* Acquisition thread scheduling */
+	AcquisitionThreadSettings threadSettings;
+	void*				mmcssHandle; //AvSetMmThreadCharacteristics handle of the run() thread
+
+	/* Reads the committed tasks, or generates the SimulatedDevice signals */
+	ScopedPointer<AcquisitionBackend> backend;
+	SimulationSettings	simulation;
+
+	/* First error reported by a read in the every N samples callback */
+	std::atomic<NIDAQ::int32> callbackError;
+
+	AI_READ_MODE		readMode;
+	Array<NIDAQ::float64> aiScalingCoeffs; //NUM_SCALING_COEFFS per AI channel, read from the committed task
+
+	/* Read/convert pipeline: run() (or the driver callback) fills the ring, the converter empties it */
+	AcquisitionBlock				pipeline[NUM_PIPELINE_BLOCKS];
+	AbstractFifo					pipelineFifo;
+	WaitableEvent					blockQueued;
+	WaitableEvent					blockFreed;
+	ScopedPointer<BlockConverter>	converter;
+	AcquisitionBlock				singlePoint; //single point mode bypasses the ring and the converter
+
+	/* Converter output: the channel-major block handed to DataBuffer in a single call per read */
+	AlignedBuffer<float>			ai_block;
+	FIRDecimator					decimator;
+	AlignedBuffer<float>			ai_decimated;
+	AlignedBuffer<int>				decimatedScans; //scan of ai_block each decimated sample is centered on (negative: a previous block)
+	AlignedBuffer<double>			decimatedTimes;
+	AlignedBuffer<uint64>			decimatedCodes;
+	AlignedBuffer<double>			delayedTimes; //timestamps and codes of the last getDelay() scans, for the outputs centered on them
+	AlignedBuffer<uint64>			delayedCodes;
+	int64							nextCodeSample; //first scan not yet ORed into a decimated event code
+	uint64							linesSeen; //line states since the last decimated output
+	bool							gapMarkerPending; //the first block after a gap kept no samples
+	AlignedBuffer<int64>			ai_timestamps;
+	AlignedBuffer<double>			timestamps;
+	AlignedBuffer<uint64>			eventCodes;
+	AlignedBuffer<int>				di_edges;
+	AlignedBuffer<uint32>			di_edge_states;
+	AlignedBuffer<NIDAQ::uInt32>	ci_data;
+	AlignedBuffer<NIDAQ::uInt32>	di_data_32; //change detection reads
+	AlignedBuffer<uint32>			di_packed; //DI words after diRemap
+	AlignedBuffer<uint8>			ci_mask; //every counter task channel is pushed
+
+	int64 ai_timestamp; //reader: sample number of the last scan read
+	SampleClockFit clockFit; //reader: host time of each sample number
+	int64 lastFitSample; //single point reader: ai_timestamp when clockFit was last updated
+	double hostClockOffset; //system_clock - steady_clock when the tasks started, in s
+	uint64 eventCode; //converter: DI state after the last scan pushed
 
-	NIDAQ::float64		ai_data[CHANNEL_BUFFER_SIZE * MAX_ANALOG_CHANNELS];
-	NIDAQ::uInt8		di_data_8[CHANNEL_BUFFER_SIZE];  //PXI devices use 8-bit read
-	NIDAQ::uInt32		di_data_32[CHANNEL_BUFFER_SIZE]; //USB devices use 32-bit read
+	DataBuffer* aiBuffer;
+	int aiBufferSize; //samples per channel aiBuffer was created with
 
-	int64 ai_timestamp;
-	uint64 eventCode;
+	FifoCounters fifoCounters;
 
-	DataBuffer* aiBuffer;
+	AcquisitionStats stats;
+	uint32 readResetsSeen; //reader: stats.resetRequests when the read side stats were last cleared
+	uint32 convertResetsSeen; //converter: same, for the convert side
+	std::chrono::steady_clock::time_point lastReadTime; //when the previous AI read returned
+	bool hasLastReadTime; //false until the first read of a run
 
 };
 
@@ -175,7 +718,7 @@ class InputChannel
 {
 public:
 	InputChannel();
-	InputChannel(String id);
+	InputChannel(String id, const FifoCounters* fifo = nullptr);
 	~InputChannel();
 
 	void setSampleRate(int rateIndex);
@@ -189,6 +732,7 @@ public:
 	void setSavingDirectory(File);
 	File getSavingDirectory();
 
+	/* DataBuffer fill of the owning device, 0 to 1 */
 	float getFillPercentage();
 
 	friend class NIDAQmx;
@@ -197,6 +741,7 @@ private:
 	String id;
 	bool enabled;
 	File savingDirectory;
+	const FifoCounters* fifo; //counters of the owning device, may be null
 
 };
 
@@ -205,7 +750,7 @@ class AnalogIn : public InputChannel
 
 public:
 	AnalogIn();
-	AnalogIn(String id);
+	AnalogIn(String id, const FifoCounters* fifo = nullptr);
 	~AnalogIn();
 
 	Array<SOURCE_TYPE> getTerminalConfig();
@@ -217,10 +762,19 @@ private:
 class DigitalIn : public InputChannel
 {
 public:
-	DigitalIn(String id);
+	DigitalIn(String id, const FifoCounters* fifo = nullptr);
 	DigitalIn();
 	~DigitalIn();
 private:
 };
 
+class Counter : public InputChannel
+{
+public:
+	Counter(String id, const FifoCounters* fifo = nullptr);
+	Counter();
+	~Counter();
+private:
+};
+
 #endif  // __NIDAQCOMPONENTS_H__
\ No newline at end of file
@@ -24,6 +24,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "NIDAQThread.h"
 #include "NIDAQEditor.h"
 
+/* Target latency options in ms, 0 : auto */
+#define NUM_LATENCY_OPTIONS 8
+static const float latencyOptions[NUM_LATENCY_OPTIONS] = { 0, 1, 2, 5, 10, 20, 50, 100 };
+
 EditorBackground::EditorBackground(int nAI, int nDI) : nAI(nAI), nDI(nDI) {}
 
 void EditorBackground::paint(Graphics& g)
@@ -128,6 +132,7 @@ void EditorBackground::paint(Graphics& g)
 		g.setFont(10);
 		g.drawText(String("SAMPLE RATE"), settingsOffsetX, 13, 100, 10, Justification::centredLeft);
 		g.drawText(String("AI VOLTAGE RANGE"), settingsOffsetX, 45, 100, 10, Justification::centredLeft);
+		g.drawText(String("LATENCY"), settingsOffsetX, 77, 100, 10, Justification::centredLeft);
 
 		/*
 		g.drawText(String("USAGE"), settingsOffsetX, 77, 100, 10, Justification::centredLeft);
@@ -149,12 +154,17 @@ FifoMonitor::FifoMonitor(NIDAQThread* thread_) : thread(thread_), fillPercentage
 
 void FifoMonitor::timerCallback()
 {
-	//TODO:
+	/* Whichever of the driver buffer and the DataBuffer is closer to overrunning */
+	const FifoCounters& counters = thread->getFifoCounters();
+	setFillPercentage(jmax(counters.getBacklogFill(), counters.getBufferFill()));
 }
 
 
 void FifoMonitor::setFillPercentage(float fill_)
 {
+	if (fill_ == fillPercentage)
+		return;
+
 	fillPercentage = fill_;
 
 	repaint();
@@ -167,9 +177,9 @@ void FifoMonitor::paint(Graphics& g)
 	g.setColour(Colours::lightslategrey);
 	g.fillRoundedRectangle(2, 2, this->getWidth() - 4, this->getHeight() - 4, 2);
 
-	g.setColour(Colours::yellow);
-	float barHeight = (this->getHeight() - 4) * fillPercentage;
-	g.fillRoundedRectangle(2, this->getHeight() - 2 - barHeight, this->getWidth() - 4, barHeight, 2);
+	g.setColour(fillPercentage > 0.8f ? Colours::red : Colours::yellow);
+	float barWidth = (this->getWidth() - 4) * fillPercentage;
+	g.fillRoundedRectangle(2, 2, barWidth, this->getHeight() - 4, 2);
 }
 
 AIButton::AIButton(int id_, NIDAQThread* thread_) : id(id_), thread(thread_), enabled(true)
@@ -325,11 +335,25 @@ BackgroundLoader::~BackgroundLoader()
 
 void BackgroundLoader::run()
 {
+	/* Lets the message thread finish loading the editor first: the settings loaded with it seed the capability cache */
+	{
+		MessageManagerLock mml(this);
+		if (!mml.lockWasGained())
+			return;
+	}
+
 	/* This process is used to initiate processor loading in the background to prevent this plugin from blocking the main GUI*/
+	t->probeDevices();
+
+	/* Gives up if the editor is destroyed while waiting for the message thread */
+	MessageManagerLock mml(this);
+	if (!mml.lockWasGained())
+		return;
 
+	t->finishProbing();
+	e->probingFinished();
 
 	/* Let the main GUI know the plugin is done initializing */
-	MessageManagerLock mml;
 	CoreServices::updateSignalChain(e);
 	CoreServices::sendStatusMessage("NIDAQ plugin ready for acquisition!");
 
@@ -342,6 +366,27 @@ NIDAQEditor::NIDAQEditor(GenericProcessor* parentNode, NIDAQThread* t)
 
 	draw();
 
+	if (thread->isProbing())
+	{
+		uiLoader = new BackgroundLoader(thread, this);
+		uiLoader->startThread();
+	}
+
+}
+
+void NIDAQEditor::probingFinished()
+{
+
+	setDisplayName(thread->getProductName());
+	draw();
+
+	/* Settings loaded while the devices were being probed */
+	if (pendingParameters != nullptr)
+	{
+		loadCustomParameters(pendingParameters);
+		pendingParameters = nullptr;
+	}
+
 }
 
 void NIDAQEditor::draw()
@@ -352,17 +397,22 @@ void NIDAQEditor::draw()
 	int nAI;
 	int nDI;
 
-	if (t->getProductName() == "No Device Detected")
-	{
-		nAI = 8;
-		nDI = 8;
-	}
-	else
+	/* Until the BackgroundLoader is done there is nothing to show; probingFinished() draws again */
+	if (t->isProbing())
 	{
-		nAI = t->getNumAnalogInputs();
-		nDI = t->getNumDigitalInputs();
+		probingLabel = new Label("ProbingLabel", "Probing devices...");
+		probingLabel->setBounds(10, 60, 150, 20);
+		addAndMakeVisible(probingLabel);
+		desiredWidth = 170;
+		return;
 	}
 
+	probingLabel = nullptr;
+
+	/* The SimulatedDevice lists its own channels */
+	nAI = t->getNumAnalogInputs();
+	nDI = t->getNumDigitalInputs();
+
 	int maxChannelsPerColumn = 4;
 	int aiChannelsPerColumn = nAI > 0 && nAI < maxChannelsPerColumn ? nAI : maxChannelsPerColumn;
 	int diChannelsPerColumn = nDI > 0 && nDI < maxChannelsPerColumn ? nDI : maxChannelsPerColumn;
@@ -418,12 +468,7 @@ void NIDAQEditor::draw()
 
 	sampleRateSelectBox = new ComboBox("SampleRateSelectBox");
 	sampleRateSelectBox->setBounds(xOffset, 39, 85, 20);
-	Array<String> sampleRates = t->getSampleRates();
-	for (int i = 0; i < sampleRates.size(); i++)
-	{
-		sampleRateSelectBox->addItem(sampleRates[i], i + 1);
-	}
-	sampleRateSelectBox->setSelectedItemIndex(t->getSampleRateIndex(), false);
+	updateSampleRateSelectBox();
 	sampleRateSelectBox->addListener(this);
 	addAndMakeVisible(sampleRateSelectBox);
 
@@ -438,11 +483,24 @@ void NIDAQEditor::draw()
 	voltageRangeSelectBox->addListener(this);
 	addAndMakeVisible(voltageRangeSelectBox);
 
+	latencySelectBox = new ComboBox("LatencySelectBox");
+	latencySelectBox->setBounds(xOffset, 102, 85, 20);
+	for (int i = 0; i < NUM_LATENCY_OPTIONS; i++)
+	{
+		if (latencyOptions[i] > 0)
+			latencySelectBox->addItem(String(latencyOptions[i]) + " ms", i + 1);
+		else
+			latencySelectBox->addItem("Auto", i + 1);
+	}
+	updateLatencySelectBox();
+	latencySelectBox->addListener(this);
+	addAndMakeVisible(latencySelectBox);
+
 	fifoMonitor = new FifoMonitor(thread);
-	fifoMonitor->setBounds(xOffset + 2, 105, 70, 12);
-	//addAndMakeVisible(fifoMonitor);
+	fifoMonitor->setBounds(xOffset + 45, 92, 40, 8);
+	addAndMakeVisible(fifoMonitor);
 
-	if (t->getNumAvailableDevices() > 1)
+	/* Always available so newly connected devices can be picked up with a rescan */
 	{
 		swapDeviceButton = new UtilityButton("...", Font("Small Text", 15, Font::plain));
 		swapDeviceButton->setBounds(xOffset + 60, 5, 25, 15);
@@ -454,7 +512,7 @@ void NIDAQEditor::draw()
 	desiredWidth = xOffset + 100;
 
 	background = new EditorBackground(nAI, nDI);
-	background->setBounds(0, 15, 500, 150);
+	background->setBounds(0, 15, desiredWidth, 150);
 	addAndMakeVisible(background);
 	background->toBack();
 	background->repaint();
@@ -464,9 +522,35 @@ void NIDAQEditor::draw()
 
 }
 
+void NIDAQEditor::updateSampleRateSelectBox()
+{
+	sampleRateSelectBox->clear(dontSendNotification);
+	Array<String> sampleRates = thread->getSampleRates();
+	for (int i = 0; i < sampleRates.size(); i++)
+	{
+		sampleRateSelectBox->addItem(sampleRates[i], i + 1);
+	}
+	sampleRateSelectBox->setSelectedItemIndex(thread->getSampleRateIndex(), dontSendNotification);
+}
+
+void NIDAQEditor::updateLatencySelectBox()
+{
+	float latency = thread->getTargetLatency();
+	int index = 0;
+	for (int i = 0; i < NUM_LATENCY_OPTIONS; i++)
+	{
+		if (latencyOptions[i] == latency)
+			index = i;
+	}
+	latencySelectBox->setSelectedItemIndex(index, dontSendNotification);
+}
+
 NIDAQEditor::~NIDAQEditor()
 {
 
+	if (uiLoader != nullptr)
+		uiLoader->stopThread(TASK_START_TIMEOUT_MS);
+
 }
 
 /** Respond to button presses */
@@ -490,6 +574,13 @@ void NIDAQEditor::comboBoxChanged(ComboBox* comboBox)
 			comboBox->setSelectedItemIndex(thread->getSampleRateIndex());
 		}
 	}
+	else if (comboBox == latencySelectBox)
+	{
+		if (!thread->isThreadRunning())
+			thread->setTargetLatency(latencyOptions[comboBox->getSelectedId() - 1]);
+		else
+			updateLatencySelectBox();
+	}
 	else // (comboBox == voltageRangeSelectBox)
 	{
 		if (!thread->isThreadRunning())
@@ -511,7 +602,11 @@ void NIDAQEditor::buttonEvent(Button* button)
 	if (aiButtons.contains((AIButton*)button))
 	{
 		((AIButton*)button)->setEnabled(!((AIButton*)button)->enabled);
+		float previousRate = thread->getSampleRate();
 		thread->toggleAIChannel(((AIButton*)button)->getId());
+		updateSampleRateSelectBox();
+		if (thread->getSampleRate() != previousRate)
+			CoreServices::updateSignalChain(this);
 		repaint();
 	}
 	else if (diButtons.contains((DIButton*)button))
@@ -529,9 +624,11 @@ void NIDAQEditor::buttonEvent(Button* button)
 	{
 		if (!thread->isThreadRunning())
 		{
-			thread->selectFromAvailableDevices();
+			bool devicesChanged = thread->selectFromAvailableDevices();
 			setDisplayName(thread->getProductName());
 			draw();
+			if (devicesChanged)
+				CoreServices::updateSignalChain(this);
 		}
 	}
 }
@@ -539,13 +636,127 @@ void NIDAQEditor::buttonEvent(Button* button)
 
 void NIDAQEditor::saveCustomParameters(XmlElement* xml)
 {
+
+	/* Nothing has been applied yet: keep the settings that are waiting for the probe */
+	if (pendingParameters != nullptr)
+	{
+		for (int i = 0; i < pendingParameters->getNumAttributes(); i++)
+			xml->setAttribute(pendingParameters->getAttributeName(i), pendingParameters->getAttributeValue(i));
+		for (auto* child : pendingParameters->getChildIterator())
+			xml->addChildElement(new XmlElement(*child));
+		return;
+	}
+
 	xml->setAttribute("productName", thread->getProductName());
+	xml->setAttribute("selectedDevice", thread->getDeviceSerialNumber(thread->getSelectedDeviceIndex()));
+	thread->saveDeviceSettings(xml);
+	thread->saveCapabilities(xml);
+
+	StringArray enabledDevices;
+	for (int i = 0; i < thread->getNumAvailableDevices(); i++)
+		if (thread->isDeviceEnabled(i))
+			enabledDevices.add(thread->getDeviceSerialNumber(i));
+	xml->setAttribute("enabledDevices", enabledDevices.joinIntoString(","));
+	xml->setAttribute("syncDevices", thread->getDeviceSync());
+	xml->setAttribute("readMode", (int)thread->getReadMode());
+	xml->setAttribute("acquisitionMode", (int)thread->getAcquisitionMode());
+	xml->setAttribute("samplesPerRead", thread->getSamplesPerRead());
+	xml->setAttribute("targetLatencyMs", thread->getTargetLatency());
+	xml->setAttribute("outputRate", thread->getOutputRate());
+	xml->setAttribute("driverLogging", thread->getDriverLogging());
+
+	StringArray counterModes;
+	for (int i = 0; i < thread->getNumCounterInputs(); i++)
+		counterModes.add(String((int)thread->getCounterMode(i)));
+	xml->setAttribute("counterModes", counterModes.joinIntoString(","));
+	xml->setAttribute("inputBufferMs", thread->getInputBufferLength());
+	xml->setAttribute("dataBufferMs", thread->getDataBufferLength());
+	xml->setAttribute("dataXferMech", (int)thread->getDataTransferMechanism());
+	xml->setAttribute("dataXferReqCond", (int)thread->getDataTransferRequestCondition());
+	xml->setAttribute("diTimingMode", (int)thread->getDigitalTimingMode());
+	xml->setAttribute("overrunRecovery", thread->getOverrunRecovery());
+
+	AcquisitionThreadSettings threadSettings = thread->getThreadSettings();
+	xml->setAttribute("threadPriority", threadSettings.priority);
+	xml->setAttribute("threadCpuCore", threadSettings.cpuCore);
+	xml->setAttribute("mmcssTask", (int)threadSettings.mmcssTask);
+
+	SimulationSettings simulation = thread->getSimulation();
+	xml->setAttribute("simChannels", thread->getNumSimulatedChannels());
+	xml->setAttribute("simWaveform", (int)simulation.waveform);
+	xml->setAttribute("simFrequency", simulation.frequency);
+	xml->setAttribute("simAmplitude", simulation.amplitude);
+	xml->setAttribute("simTtlPeriodMs", simulation.ttlPeriodMs);
 }
 
 
 void NIDAQEditor::loadCustomParameters(XmlElement* xml)
 {
+
+	/* Applied by probingFinished() once the devices are known; the snapshot spares the probe the boards in it */
+	if (thread->isProbing())
+	{
+		thread->loadCapabilities(xml);
+		pendingParameters = new XmlElement(*xml);
+		return;
+	}
+
 	String productName = xml->getStringAttribute("productName", "NIDAQmx");
-	if (!thread->swapConnection(productName));
-		draw();
+
+	/* Before the device selection, which may name the SimulatedDevice */
+	thread->setNumSimulatedChannels(xml->getIntAttribute("simChannels", thread->getNumSimulatedChannels()));
+
+	if (xml->hasAttribute("enabledDevices"))
+	{
+		StringArray enabledDevices;
+		enabledDevices.addTokens(xml->getStringAttribute("enabledDevices"), ",", "");
+
+		/* Enable before disabling so at least one device stays on */
+		for (int i = 0; i < thread->getNumAvailableDevices(); i++)
+			if (enabledDevices.contains(thread->getDeviceSerialNumber(i)))
+				thread->setDeviceEnabled(i, true);
+		for (int i = 0; i < thread->getNumAvailableDevices(); i++)
+			if (!enabledDevices.contains(thread->getDeviceSerialNumber(i)))
+				thread->setDeviceEnabled(i, false);
+	}
+	thread->setDeviceSync(xml->getBoolAttribute("syncDevices", thread->getDeviceSync()));
+
+	/* The serial number tells identical boards apart; older settings only have the product name */
+	if (thread->selectDeviceBySerialNumber(xml->getStringAttribute("selectedDevice")) != 0)
+		thread->swapConnection(productName);
+	thread->loadDeviceSettings(xml);
+	thread->setReadMode((AI_READ_MODE)xml->getIntAttribute("readMode", (int)thread->getReadMode()));
+	thread->setAcquisitionMode((ACQUISITION_MODE)xml->getIntAttribute("acquisitionMode", (int)thread->getAcquisitionMode()));
+	thread->setSamplesPerRead(xml->getIntAttribute("samplesPerRead", thread->getSamplesPerRead()));
+	thread->setTargetLatency(xml->getDoubleAttribute("targetLatencyMs", thread->getTargetLatency()));
+	thread->setOutputRate(xml->getDoubleAttribute("outputRate", thread->getOutputRate()));
+	thread->setDriverLogging(xml->getBoolAttribute("driverLogging", thread->getDriverLogging()));
+
+	StringArray counterModes;
+	counterModes.addTokens(xml->getStringAttribute("counterModes"), ",", "");
+	for (int i = 0; i < jmin(counterModes.size(), thread->getNumCounterInputs()); i++)
+		thread->setCounterMode(i, (COUNTER_MODE)jlimit((int)CI_OFF, (int)NUM_COUNTER_MODES - 1, counterModes[i].getIntValue()));
+	thread->setInputBufferLength(xml->getDoubleAttribute("inputBufferMs", thread->getInputBufferLength()));
+	thread->setDataBufferLength(xml->getDoubleAttribute("dataBufferMs", thread->getDataBufferLength()));
+	thread->setDataTransferMechanism((AI_XFER_MECH)xml->getIntAttribute("dataXferMech", (int)thread->getDataTransferMechanism()));
+	thread->setDataTransferRequestCondition((AI_XFER_REQ_COND)xml->getIntAttribute("dataXferReqCond", (int)thread->getDataTransferRequestCondition()));
+	thread->setDigitalTimingMode((DI_TIMING_MODE)xml->getIntAttribute("diTimingMode", (int)thread->getDigitalTimingMode()));
+	thread->setOverrunRecovery(xml->getBoolAttribute("overrunRecovery", thread->getOverrunRecovery()));
+
+	AcquisitionThreadSettings threadSettings = thread->getThreadSettings();
+	threadSettings.priority = jlimit(-1, 10, xml->getIntAttribute("threadPriority", threadSettings.priority));
+	threadSettings.cpuCore = xml->getIntAttribute("threadCpuCore", threadSettings.cpuCore);
+	threadSettings.mmcssTask = (MMCSS_TASK)jlimit((int)MMCSS_OFF, (int)MMCSS_CAPTURE, xml->getIntAttribute("mmcssTask", (int)threadSettings.mmcssTask));
+	thread->setThreadSettings(threadSettings);
+
+	SimulationSettings simulation = thread->getSimulation();
+	simulation.waveform = (SIM_WAVEFORM)xml->getIntAttribute("simWaveform", (int)simulation.waveform);
+	simulation.frequency = xml->getDoubleAttribute("simFrequency", simulation.frequency);
+	simulation.amplitude = xml->getDoubleAttribute("simAmplitude", simulation.amplitude);
+	simulation.ttlPeriodMs = xml->getDoubleAttribute("simTtlPeriodMs", simulation.ttlPeriodMs);
+	thread->setSimulation(simulation);
+
+	setDisplayName(thread->getProductName());
+	draw();
+	updateLatencySelectBox();
 }
@@ -169,6 +169,15 @@ public:
 	/** Respond to button presses */
 	void buttonClicked(Button* button) override;
 
+	/** Called by the BackgroundLoader on the message thread once the devices are probed */
+	void probingFinished();
+
+	/** Refills the sample rate options, which depend on the enabled inputs */
+	void updateSampleRateSelectBox();
+
+	/** Selects the latency option matching the thread setting */
+	void updateLatencySelectBox();
+
 	void saveCustomParameters(XmlElement*);
 	void loadCustomParameters(XmlElement*);
 
@@ -180,10 +189,16 @@ private:
 
 	ScopedPointer<ComboBox> sampleRateSelectBox;
 	ScopedPointer<ComboBox> voltageRangeSelectBox;
+	ScopedPointer<ComboBox> latencySelectBox;
 	ScopedPointer<FifoMonitor> fifoMonitor;
 
 	ScopedPointer<UtilityButton> swapDeviceButton;
 
+	ScopedPointer<Label> probingLabel;
+
+	/* Settings loaded before the devices were probed */
+	ScopedPointer<XmlElement> pendingParameters;
+
 	Array<File> savingDirectories;
 
 	ScopedPointer<BackgroundLoader> uiLoader;
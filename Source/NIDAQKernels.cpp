@@ -0,0 +1,803 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NIDAQKernels.h"
+
+#include <cmath>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NIDAQ_KERNELS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define NIDAQ_TARGET_SSE2
+#define NIDAQ_TARGET_AVX2
+#else
+#define NIDAQ_TARGET_SSE2 __attribute__((target("sse2")))
+#define NIDAQ_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define NIDAQ_KERNELS_X86 0
+#endif
+
+static KERNEL_ISA activeISA = detectKernelISA();
+
+KERNEL_ISA detectKernelISA()
+{
+
+#if NIDAQ_KERNELS_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	/* AVX registers are only usable if the OS saves them on context switches */
+	if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return KERNEL_AVX2;
+	}
+
+	if (sse2)
+		return KERNEL_SSE2;
+#else
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return KERNEL_AVX2;
+
+	if (__builtin_cpu_supports("sse2"))
+		return KERNEL_SSE2;
+#endif
+#endif
+
+	return KERNEL_SCALAR;
+
+}
+
+void selectKernelISA(KERNEL_ISA isa)
+{
+	KERNEL_ISA supported = detectKernelISA();
+	activeISA = isa > supported ? supported : isa;
+}
+
+KERNEL_ISA getKernelISA()
+{
+	return activeISA;
+}
+
+const char* getKernelISAName(KERNEL_ISA isa)
+{
+	switch (isa) {
+	case KERNEL_SSE2:
+		return "SSE2";
+	case KERNEL_AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+/* Scalar kernels: convert channels [chBegin, chEnd) for scans [sBegin, numScans).
+   Also used by the vector kernels for the channels and scans left over by the vector width. */
+
+static void deinterleaveF64Scalar(const double* in, float* out, int numScans, int numChannels,
+	const uint8_t* channelMask, const int* outputRows, int chBegin, int chEnd, int sBegin)
+{
+
+	for (int ch = chBegin; ch < chEnd; ch++)
+	{
+		float* dst = out + outputRows[ch] * numScans;
+
+		if (!channelMask[ch])
+		{
+			for (int s = sBegin; s < numScans; s++)
+				dst[s] = 0;
+			continue;
+		}
+
+		const double* src = in + ch;
+		for (int s = sBegin; s < numScans; s++)
+			dst[s] = float(src[s * numChannels]);
+	}
+
+}
+
+static void deinterleaveI16Scalar(const int16_t* in, float* out, int numScans, int numChannels,
+	const double* coeffs, const uint8_t* channelMask, const int* outputRows, int chBegin, int chEnd, int sBegin)
+{
+
+	for (int ch = chBegin; ch < chEnd; ch++)
+	{
+		float* dst = out + outputRows[ch] * numScans;
+
+		if (!channelMask[ch])
+		{
+			for (int s = sBegin; s < numScans; s++)
+				dst[s] = 0;
+			continue;
+		}
+
+		const double* c = coeffs + ch * NUM_SCALING_COEFFS;
+		const float c0 = float(c[0]), c1 = float(c[1]), c2 = float(c[2]), c3 = float(c[3]);
+
+		const int16_t* src = in + ch;
+		for (int s = sBegin; s < numScans; s++)
+		{
+			float x = float(src[s * numChannels]);
+
+			/* Horner form of c0 + c1*x + c2*x^2 + c3*x^3 */
+			dst[s] = c0 + x * (c1 + x * (c2 + x * c3));
+		}
+	}
+
+}
+
+/* Scalar edge scan for scans [sBegin, numScans), appending to the numEdges edges already found */
+static int findDigitalEdgesScalar(const uint32_t* in, int numScans, uint32_t mask, uint32_t previous,
+	int* edges, int sBegin, int numEdges)
+{
+
+	for (int s = sBegin; s < numScans; s++)
+	{
+		uint32_t state = in[s] & mask;
+		if (state != previous)
+			edges[numEdges++] = s;
+		previous = state;
+	}
+
+	return numEdges;
+
+}
+
+#if NIDAQ_KERNELS_X86
+
+/* SSE2 kernels: 4x4 tiles of (scans x channels) are loaded, transposed in registers
+   and stored as 4 contiguous samples per channel row. */
+
+NIDAQ_TARGET_SSE2
+static inline void storeRowSSE2(float* dst, __m128 row, bool enabled)
+{
+	_mm_storeu_ps(dst, enabled ? row : _mm_setzero_ps());
+}
+
+NIDAQ_TARGET_SSE2
+static void deinterleaveF64SSE2(const double* in, float* out, int numScans, int numChannels,
+	const uint8_t* channelMask, const int* outputRows, int chBegin, int chEnd)
+{
+
+	const int vecScans = numScans & ~3;
+
+	int ch = chBegin;
+	for (; ch + 4 <= chEnd; ch += 4)
+	{
+		for (int s = 0; s < vecScans; s += 4)
+		{
+			__m128 r[4];
+			for (int k = 0; k < 4; k++)
+			{
+				const double* src = in + (s + k) * numChannels + ch;
+				__m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src));
+				__m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + 2));
+				r[k] = _mm_movelh_ps(lo, hi);
+			}
+
+			_MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+
+			for (int k = 0; k < 4; k++)
+				storeRowSSE2(out + outputRows[ch + k] * numScans + s, r[k], channelMask[ch + k] != 0);
+		}
+
+		deinterleaveF64Scalar(in, out, numScans, numChannels, channelMask, outputRows, ch, ch + 4, vecScans);
+	}
+
+	deinterleaveF64Scalar(in, out, numScans, numChannels, channelMask, outputRows, ch, chEnd, 0);
+
+}
+
+NIDAQ_TARGET_SSE2
+static void deinterleaveI16SSE2(const int16_t* in, float* out, int numScans, int numChannels,
+	const double* coeffs, const uint8_t* channelMask, const int* outputRows, int chBegin, int chEnd)
+{
+
+	const int vecScans = numScans & ~3;
+
+	int ch = chBegin;
+	for (; ch + 4 <= chEnd; ch += 4)
+	{
+		__m128 c0[4], c1[4], c2[4], c3[4];
+		for (int k = 0; k < 4; k++)
+		{
+			const double* c = coeffs + (ch + k) * NUM_SCALING_COEFFS;
+			c0[k] = _mm_set1_ps(float(c[0]));
+			c1[k] = _mm_set1_ps(float(c[1]));
+			c2[k] = _mm_set1_ps(float(c[2]));
+			c3[k] = _mm_set1_ps(float(c[3]));
+		}
+
+		for (int s = 0; s < vecScans; s += 4)
+		{
+			__m128 r[4];
+			for (int k = 0; k < 4; k++)
+			{
+				__m128i v = _mm_loadl_epi64((const __m128i*)(in + (s + k) * numChannels + ch));
+				/* Sign-extend 4 x int16 to int32 */
+				r[k] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+			}
+
+			_MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+
+			for (int k = 0; k < 4; k++)
+			{
+				__m128 x = r[k];
+				__m128 y = _mm_add_ps(c2[k], _mm_mul_ps(x, c3[k]));
+				y = _mm_add_ps(c1[k], _mm_mul_ps(x, y));
+				y = _mm_add_ps(c0[k], _mm_mul_ps(x, y));
+				storeRowSSE2(out + outputRows[ch + k] * numScans + s, y, channelMask[ch + k] != 0);
+			}
+		}
+
+		deinterleaveI16Scalar(in, out, numScans, numChannels, coeffs, channelMask, outputRows, ch, ch + 4, vecScans);
+	}
+
+	deinterleaveI16Scalar(in, out, numScans, numChannels, coeffs, channelMask, outputRows, ch, chEnd, 0);
+
+}
+
+/* AVX2 kernels: same scheme with 8x8 tiles; the remaining channels go through the SSE2 kernels. */
+
+NIDAQ_TARGET_AVX2
+static inline void transpose8AVX(__m256* r)
+{
+	__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+	__m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+	__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+	__m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+	__m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+	__m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+	__m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+	__m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+
+	__m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+	r[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+	r[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+	r[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+	r[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+	r[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+	r[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+	r[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+	r[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+NIDAQ_TARGET_AVX2
+static inline void storeRowAVX(float* dst, __m256 row, bool enabled)
+{
+	_mm256_storeu_ps(dst, enabled ? row : _mm256_setzero_ps());
+}
+
+NIDAQ_TARGET_AVX2
+static void deinterleaveF64AVX2(const double* in, float* out, int numScans, int numChannels,
+	const uint8_t* channelMask, const int* outputRows)
+{
+
+	const int vecScans = numScans & ~7;
+
+	int ch = 0;
+	for (; ch + 8 <= numChannels; ch += 8)
+	{
+		for (int s = 0; s < vecScans; s += 8)
+		{
+			__m256 r[8];
+			for (int k = 0; k < 8; k++)
+			{
+				const double* src = in + (s + k) * numChannels + ch;
+				__m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(src));
+				__m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(src + 4));
+				r[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+			}
+
+			transpose8AVX(r);
+
+			for (int k = 0; k < 8; k++)
+				storeRowAVX(out + outputRows[ch + k] * numScans + s, r[k], channelMask[ch + k] != 0);
+		}
+
+		deinterleaveF64Scalar(in, out, numScans, numChannels, channelMask, outputRows, ch, ch + 8, vecScans);
+	}
+
+	deinterleaveF64SSE2(in, out, numScans, numChannels, channelMask, outputRows, ch, numChannels);
+
+}
+
+NIDAQ_TARGET_AVX2
+static void deinterleaveI16AVX2(const int16_t* in, float* out, int numScans, int numChannels,
+	const double* coeffs, const uint8_t* channelMask, const int* outputRows)
+{
+
+	const int vecScans = numScans & ~7;
+
+	int ch = 0;
+	for (; ch + 8 <= numChannels; ch += 8)
+	{
+		for (int s = 0; s < vecScans; s += 8)
+		{
+			__m256 r[8];
+			for (int k = 0; k < 8; k++)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(in + (s + k) * numChannels + ch));
+				r[k] = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+			}
+
+			transpose8AVX(r);
+
+			for (int k = 0; k < 8; k++)
+			{
+				const double* c = coeffs + (ch + k) * NUM_SCALING_COEFFS;
+				__m256 x = r[k];
+				__m256 y = _mm256_add_ps(_mm256_set1_ps(float(c[2])), _mm256_mul_ps(x, _mm256_set1_ps(float(c[3]))));
+				y = _mm256_add_ps(_mm256_set1_ps(float(c[1])), _mm256_mul_ps(x, y));
+				y = _mm256_add_ps(_mm256_set1_ps(float(c[0])), _mm256_mul_ps(x, y));
+				storeRowAVX(out + outputRows[ch + k] * numScans + s, y, channelMask[ch + k] != 0);
+			}
+		}
+
+		deinterleaveI16Scalar(in, out, numScans, numChannels, coeffs, channelMask, outputRows, ch, ch + 8, vecScans);
+	}
+
+	deinterleaveI16SSE2(in, out, numScans, numChannels, coeffs, channelMask, outputRows, ch, numChannels);
+
+}
+
+/* Edge scans: each vector compares scans [s, s + width) with [s - 1, s + width - 1)
+   and only falls back to the scalar check when some masked line differs. */
+
+NIDAQ_TARGET_SSE2
+static int findDigitalEdgesSSE2(const uint32_t* in, int numScans, uint32_t mask, uint32_t previous, int* edges)
+{
+
+	int numEdges = findDigitalEdgesScalar(in, 1, mask, previous, edges, 0, 0);
+
+	const __m128i m = _mm_set1_epi32((int)mask);
+	const __m128i zero = _mm_setzero_si128();
+
+	int s = 1;
+	for (; s + 4 <= numScans; s += 4)
+	{
+		__m128i cur = _mm_loadu_si128((const __m128i*)(in + s));
+		__m128i prv = _mm_loadu_si128((const __m128i*)(in + s - 1));
+		__m128i diff = _mm_and_si128(_mm_xor_si128(cur, prv), m);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(diff, zero)) == 0xFFFF)
+			continue;
+
+		for (int k = s; k < s + 4; k++)
+			if ((in[k] ^ in[k - 1]) & mask)
+				edges[numEdges++] = k;
+	}
+
+	return findDigitalEdgesScalar(in, numScans, mask, in[s - 1] & mask, edges, s, numEdges);
+
+}
+
+NIDAQ_TARGET_AVX2
+static int findDigitalEdgesAVX2(const uint32_t* in, int numScans, uint32_t mask, uint32_t previous, int* edges)
+{
+
+	int numEdges = findDigitalEdgesScalar(in, 1, mask, previous, edges, 0, 0);
+
+	const __m256i m = _mm256_set1_epi32((int)mask);
+
+	int s = 1;
+	for (; s + 8 <= numScans; s += 8)
+	{
+		__m256i cur = _mm256_loadu_si256((const __m256i*)(in + s));
+		__m256i prv = _mm256_loadu_si256((const __m256i*)(in + s - 1));
+		__m256i diff = _mm256_and_si256(_mm256_xor_si256(cur, prv), m);
+
+		if (_mm256_testz_si256(diff, diff))
+			continue;
+
+		for (int k = s; k < s + 8; k++)
+			if ((in[k] ^ in[k - 1]) & mask)
+				edges[numEdges++] = k;
+	}
+
+	return findDigitalEdgesScalar(in, numScans, mask, in[s - 1] & mask, edges, s, numEdges);
+
+}
+
+#endif
+
+void deinterleaveF64(const double* in, float* out, int numScans, int numChannels, const uint8_t* channelMask, const int* outputRows)
+{
+
+	switch (activeISA) {
+#if NIDAQ_KERNELS_X86
+	case KERNEL_AVX2:
+		deinterleaveF64AVX2(in, out, numScans, numChannels, channelMask, outputRows);
+		return;
+	case KERNEL_SSE2:
+		deinterleaveF64SSE2(in, out, numScans, numChannels, channelMask, outputRows, 0, numChannels);
+		return;
+#endif
+	default:
+		deinterleaveF64Scalar(in, out, numScans, numChannels, channelMask, outputRows, 0, numChannels, 0);
+		return;
+	}
+
+}
+
+void deinterleaveI16(const int16_t* in, float* out, int numScans, int numChannels, const double* coeffs, const uint8_t* channelMask, const int* outputRows)
+{
+
+	switch (activeISA) {
+#if NIDAQ_KERNELS_X86
+	case KERNEL_AVX2:
+		deinterleaveI16AVX2(in, out, numScans, numChannels, coeffs, channelMask, outputRows);
+		return;
+	case KERNEL_SSE2:
+		deinterleaveI16SSE2(in, out, numScans, numChannels, coeffs, channelMask, outputRows, 0, numChannels);
+		return;
+#endif
+	default:
+		deinterleaveI16Scalar(in, out, numScans, numChannels, coeffs, channelMask, outputRows, 0, numChannels, 0);
+		return;
+	}
+
+}
+
+int findDigitalEdges(const uint32_t* in, int numScans, uint32_t mask, uint32_t previous, int* edges)
+{
+
+	if (numScans <= 0)
+		return 0;
+
+	switch (activeISA) {
+#if NIDAQ_KERNELS_X86
+	case KERNEL_AVX2:
+		return findDigitalEdgesAVX2(in, numScans, mask, previous, edges);
+	case KERNEL_SSE2:
+		return findDigitalEdgesSSE2(in, numScans, mask, previous, edges);
+#endif
+	default:
+		return findDigitalEdgesScalar(in, numScans, mask, previous, edges, 0, 0);
+	}
+
+}
+
+/* Decimation: dot product of the reversed taps with the window ending at each kept scan */
+
+static float dotScalar(const float* a, const float* b, int n)
+{
+	float sum = 0;
+	for (int k = 0; k < n; k++)
+		sum += a[k] * b[k];
+	return sum;
+}
+
+#if NIDAQ_KERNELS_X86
+
+NIDAQ_TARGET_SSE2
+static float dotSSE2(const float* a, const float* b, int n)
+{
+
+	/* Two accumulators hide the latency of the adds */
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+
+	int k = 0;
+	for (; k + 8 <= n; k += 8)
+	{
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + k + 4), _mm_loadu_ps(b + k + 4)));
+	}
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dotScalar(a + k, b + k, n - k);
+
+}
+
+NIDAQ_TARGET_AVX2
+static float dotAVX2(const float* a, const float* b, int n)
+{
+
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+
+	int k = 0;
+	for (; k + 16 <= n; k += 16)
+	{
+		acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k)));
+		acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(a + k + 8), _mm256_loadu_ps(b + k + 8)));
+	}
+
+	float lanes[8];
+	_mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+
+	float sum = 0;
+	for (int i = 0; i < 8; i++)
+		sum += lanes[i];
+
+	return sum + dotScalar(a + k, b + k, n - k);
+
+}
+
+#endif
+
+static double besselI0(double x)
+{
+	double sum = 1, term = 1;
+	for (int k = 1; k < 64 && term > sum * 1e-12; k++)
+	{
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+FIRDecimator::FIRDecimator() : numChannels(0), factor(1), numTaps(1), maxScans(0), nextCenter(0), started(false) {}
+
+void FIRDecimator::configure(int numChannels_, int factor_, int maxScans_)
+{
+
+	numChannels = numChannels_ > 0 ? numChannels_ : 0;
+	factor = factor_ > 1 ? factor_ : 1;
+	maxScans = maxScans_ > 0 ? maxScans_ : 0;
+	numTaps = factor > 1 ? factor * DECIMATOR_TAPS_PER_PHASE + 1 : 1; //odd, so the delay is a whole number of scans
+
+	taps.allocate(numTaps);
+
+	/* Kaiser beta for ~86 dB of stopband attenuation */
+	const double beta = 8.6;
+	const double pi = 3.14159265358979323846;
+	const double cutoff = 0.4 / factor; //cycles per input sample
+	const double center = (numTaps - 1) / 2.0;
+	double gain = 0;
+
+	for (int i = 0; i < numTaps; i++)
+	{
+		double t = i - center;
+		double x = 2.0 * cutoff * t;
+		double sinc = t == 0 ? 1.0 : std::sin(pi * x) / (pi * x);
+		double r = numTaps > 1 ? (2.0 * i / (numTaps - 1) - 1.0) : 0.0;
+		double h = 2.0 * cutoff * sinc * besselI0(beta * std::sqrt(1.0 - r * r)) / besselI0(beta);
+
+		taps[numTaps - 1 - i] = float(h);
+		gain += h;
+	}
+
+	for (int i = 0; i < numTaps; i++)
+		taps[i] = factor > 1 ? float(taps[i] / gain) : 1.0f;
+
+	history.allocate(size_t(numChannels) * (numTaps - 1));
+	window.allocate(size_t(numTaps - 1) + maxScans);
+
+}
+
+void FIRDecimator::reset()
+{
+	for (size_t i = 0; i < history.size(); i++)
+		history[i] = 0;
+	started = false;
+}
+
+int FIRDecimator::process(const float* in, int numScans, int64_t firstSample, float* out, int* outputScans)
+{
+
+	const int historyLength = numTaps - 1;
+	const int delay = getDelay();
+
+	/* After a reset the outputs start at the first new scan; the history before it is zero */
+	if (!started)
+	{
+		nextCenter = firstSample;
+		started = true;
+	}
+
+	/* Outputs are centered on the sample numbers that are a multiple of the factor and whose last input is in this block */
+	int64_t center = std::max(nextCenter, firstSample - delay);
+	center += ((-center) % factor + factor) % factor;
+
+	int numOutputs = 0;
+	for (; center + delay < firstSample + numScans; center += factor)
+		outputScans[numOutputs++] = int(center - firstSample);
+
+	nextCenter = center;
+
+	float (*dot)(const float*, const float*, int) = dotScalar;
+
+#if NIDAQ_KERNELS_X86
+	if (activeISA == KERNEL_AVX2)
+		dot = dotAVX2;
+	else if (activeISA == KERNEL_SSE2)
+		dot = dotSSE2;
+#endif
+
+	/* The window holds maxScans new scans, so a longer block goes through in chunks; rows keep the caller's numScans stride */
+	const int chunkLength = maxScans > 0 ? maxScans : numScans;
+
+	for (int ch = 0; ch < numChannels; ch++)
+	{
+		float* channelHistory = history.get() + size_t(ch) * historyLength;
+		float* dst = out + size_t(ch) * numOutputs;
+		const float* row = in + size_t(ch) * numScans;
+		int j = 0;
+
+		for (int start = 0; start < numScans; start += chunkLength)
+		{
+			const int length = std::min(chunkLength, numScans - start);
+
+			/* window[w] holds input scan start + w - historyLength, so the taps of the output centered on c start at c + delay - start */
+			std::copy_n(channelHistory, historyLength, window.get());
+			std::copy_n(row + start, length, window.get() + historyLength);
+
+			for (; j < numOutputs && outputScans[j] + delay < start + length; j++)
+				dst[j] = dot(taps.get(), window.get() + (outputScans[j] + delay - start), numTaps);
+
+			std::copy_n(window.get() + length, historyLength, channelHistory);
+		}
+	}
+
+	return numOutputs;
+
+}
+
+SampleClockFit::SampleClockFit() { reset(0.0); }
+
+void SampleClockFit::reset(double nominalPeriod_)
+{
+	nominalPeriod = nominalPeriod_;
+	weight = 0.0;
+	meanX = meanY = 0.0;
+	cxx = cxy = 0.0;
+	numPoints = 0;
+}
+
+void SampleClockFit::addPoint(int64_t sampleNumber, double time)
+{
+
+	const double decay = 1.0 - 1.0 / CLOCK_FIT_WINDOW;
+	const double x = double(sampleNumber);
+
+	/* Weighted Welford update: the co-moments take the deviation from the old and the new mean */
+	double dx = x - meanX;
+	double dy = time - meanY;
+
+	weight = decay * weight + 1.0;
+	meanX += dx / weight;
+	meanY += dy / weight;
+
+	cxx = decay * cxx + dx * (x - meanX);
+	cxy = decay * cxy + dx * (time - meanY);
+
+	numPoints++;
+
+}
+
+double SampleClockFit::getPeriod() const
+{
+
+	if (numPoints < 2 || cxx <= 0.0)
+		return nominalPeriod;
+
+	double period = cxy / cxx;
+
+	/* Points from the first few reads are too close together for the slope to mean anything */
+	if (nominalPeriod > 0.0 && std::abs(period / nominalPeriod - 1.0) > CLOCK_FIT_MAX_DEVIATION)
+		return nominalPeriod;
+
+	return period;
+
+}
+
+double SampleClockFit::getTime(int64_t sampleNumber) const
+{
+	return meanY + getPeriod() * (double(sampleNumber) - meanX);
+}
+
+DigitalLineRemap::DigitalLineRemap() : numPorts(1), numTables(0), identity(true) {}
+
+void DigitalLineRemap::configure(const int* linePorts, const int* lineBits, int numLines, int numPorts_)
+{
+
+	numPorts = numPorts_ > 0 ? numPorts_ : 1;
+	numLines = std::min(numLines, MAX_DIGITAL_LINES);
+
+	identity = numPorts == 1;
+	for (int k = 0; k < numLines; k++)
+		if (linePorts[k] >= 0 && (linePorts[k] != 0 || lineBits[k] != k))
+			identity = false;
+
+	/* One table for each (port, byte) a line is read from */
+	const int numBytes = numPorts * 4;
+	std::vector<int> tableOf(numBytes, -1);
+
+	numTables = 0;
+	for (int k = 0; k < numLines; k++)
+	{
+		if (linePorts[k] < 0 || linePorts[k] >= numPorts || lineBits[k] < 0 || lineBits[k] >= 32)
+			continue;
+
+		int byte = linePorts[k] * 4 + lineBits[k] / 8;
+		if (tableOf[byte] < 0)
+			tableOf[byte] = numTables++;
+	}
+
+	tables.allocate(size_t(numTables) * 256);
+	tablePort.allocate(numTables);
+	tableShift.allocate(numTables);
+
+	for (int byte = 0; byte < numBytes; byte++)
+	{
+		if (tableOf[byte] >= 0)
+		{
+			tablePort[tableOf[byte]] = byte / 4;
+			tableShift[tableOf[byte]] = (byte % 4) * 8;
+		}
+	}
+
+	for (int k = 0; k < numLines; k++)
+	{
+		if (linePorts[k] < 0 || linePorts[k] >= numPorts || lineBits[k] < 0 || lineBits[k] >= 32)
+			continue;
+
+		uint32_t* table = tables.get() + size_t(tableOf[linePorts[k] * 4 + lineBits[k] / 8]) * 256;
+		for (int value = 0; value < 256; value++)
+			if (value & (1 << (lineBits[k] % 8)))
+				table[value] |= uint32_t(1) << k;
+	}
+
+}
+
+void DigitalLineRemap::pack(const uint32_t* in, int numScans, uint32_t* out) const
+{
+
+	for (int s = 0; s < numScans; s++)
+	{
+		const uint32_t* words = in + size_t(s) * numPorts;
+		uint32_t packed = 0;
+
+		for (int t = 0; t < numTables; t++)
+			packed |= tables[size_t(t) * 256 + ((words[tablePort[t]] >> tableShift[t]) & 0xff)];
+
+		out[s] = packed;
+	}
+
+}
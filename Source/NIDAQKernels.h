@@ -0,0 +1,325 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __NIDAQKERNELS_H__
+#define __NIDAQKERNELS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <new>
+
+/* Number of polynomial coefficients returned by DAQmxGetAIDevScalingCoeff */
+#define NUM_SCALING_COEFFS 4
+
+#define CACHE_LINE_SIZE 64
+
+/* Taps of the decimation filter per output phase, i.e. numTaps = factor * DECIMATOR_TAPS_PER_PHASE + 1 */
+#define DECIMATOR_TAPS_PER_PHASE 32
+
+/* DI lines an event word holds, one bit per line */
+#define MAX_DIGITAL_LINES 32
+
+/* Time constant of the sample clock fit, in points (i.e. reads) */
+#define CLOCK_FIT_WINDOW 256
+
+/* Largest fitted deviation from the nominal sample period, beyond which the fit is still too noisy to use */
+#define CLOCK_FIT_MAX_DEVIATION 1.0e-3
+
+/**
+
+	Heap buffer aligned to a cache line, used for the per-block acquisition
+	arrays so their size can follow the device instead of a compile-time cap.
+
+	allocate() is meant to be called once when a task starts, never from
+	the read loop.
+
+*/
+template <typename T>
+class AlignedBuffer
+{
+public:
+	AlignedBuffer() : data(nullptr), numElements(0) {}
+	~AlignedBuffer() { release(); }
+
+	/** (Re)allocates the buffer and fills it with zeros */
+	void allocate(size_t size)
+	{
+		if (size != numElements)
+		{
+			release();
+			if (size > 0)
+				data = static_cast<T*>(::operator new(size * sizeof(T), std::align_val_t(CACHE_LINE_SIZE)));
+			numElements = size;
+		}
+		for (size_t i = 0; i < numElements; i++)
+			data[i] = T();
+	}
+
+	void release()
+	{
+		if (data != nullptr)
+			::operator delete(data, std::align_val_t(CACHE_LINE_SIZE));
+		data = nullptr;
+		numElements = 0;
+	}
+
+	T* get() { return data; }
+	const T* get() const { return data; }
+	size_t size() const { return numElements; }
+
+	T& operator[](size_t i) { return data[i]; }
+	const T& operator[](size_t i) const { return data[i]; }
+
+private:
+	AlignedBuffer(const AlignedBuffer&) = delete;
+	AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+	T* data;
+	size_t numElements;
+};
+
+/**
+
+	Sample conversion kernels used on the acquisition path.
+
+	These are kept free of JUCE and DAQmx types so they can be called
+	from any acquisition engine and built into the benchmarks.
+
+	Each kernel transposes a block read with DAQmx_Val_GroupByScanNumber
+	into the channel-major layout used by DataBuffer:
+
+		out[outputRows[ch] * numScans + s] = f(in[s * numChannels + ch])
+
+	where ch is the channel index within the scan. outputRows lets a task
+	that only acquires some of the device channels keep each of them on
+	its device row. Rows of channels whose mask entry is 0 are filled with
+	zeros; rows that no input channel maps to are left untouched.
+
+	The instruction set is picked once at load time from the CPU
+	features and can be lowered with selectKernelISA (e.g. to compare
+	implementations).
+
+*/
+
+enum KERNEL_ISA {
+	KERNEL_SCALAR = 0,
+	KERNEL_SSE2,
+	KERNEL_AVX2
+};
+
+/** Returns the best instruction set supported by this CPU */
+KERNEL_ISA detectKernelISA();
+
+/** Selects the kernels to use, clamped to what the CPU supports */
+void selectKernelISA(KERNEL_ISA isa);
+
+KERNEL_ISA getKernelISA();
+
+const char* getKernelISAName(KERNEL_ISA isa);
+
+/** Transposes and narrows a block of scaled samples (as returned by DAQmxReadAnalogF64) */
+void deinterleaveF64(const double* in, float* out, int numScans, int numChannels, const uint8_t* channelMask, const int* outputRows);
+
+/** Transposes a block of raw ADC codes (as returned by DAQmxReadBinaryI16) and converts them to volts.
+
+	Each channel is scaled with its own third order polynomial
+	v = c0 + c1*x + c2*x^2 + c3*x^3, where coeffs holds NUM_SCALING_COEFFS
+	values per channel in the order returned by the driver.
+*/
+void deinterleaveI16(const int16_t* in, float* out, int numScans, int numChannels, const double* coeffs, const uint8_t* channelMask, const int* outputRows);
+
+/** Finds the scans at which the state of the masked digital lines changes.
+
+	previous is the masked state before in[0]. Writes the index of each
+	scan whose masked state differs from the scan before it to edges
+	(which must hold numScans entries) and returns how many were found.
+	Blocks without transitions are skipped a vector at a time.
+*/
+int findDigitalEdges(const uint32_t* in, int numScans, uint32_t mask, uint32_t previous, int* edges);
+
+/** Expands the state changes found by findDigitalEdges into one event code per scan.
+
+	states holds the line state of each edge; previous is the state
+	before the block. Fills out (numScans entries) run by run and returns
+	the masked state after the last scan. Templated on the code type so
+	it takes DataBuffer's event codes as they are.
+*/
+template <typename Code>
+Code expandEventCodes(const int* edges, const uint32_t* states, int numEdges, int numScans, Code mask, Code previous, Code* out)
+{
+	Code state = previous & mask;
+	int pos = 0;
+
+	for (int e = 0; e < numEdges; e++)
+	{
+		int edge = pos > edges[e] ? pos : edges[e];
+		std::fill(out + pos, out + edge, state);
+		state = states[e] & mask;
+		pos = edge;
+	}
+
+	std::fill(out + pos, out + numScans, state);
+
+	return state;
+}
+
+/**
+
+	Anti-aliasing low-pass and decimation of channel-major blocks.
+
+	Only the kept outputs are computed, i.e. each input sample goes
+	through numTaps / factor multiply-adds as in a polyphase structure.
+	An output is produced at every sample number that is a multiple of
+	the factor, so the phase follows the sample numbers across blocks
+	and across gaps in them. The filter is symmetric around the sample
+	an output is numbered with, so each output is emitted getDelay()
+	scans after it, once the inputs its taps reach have arrived.
+
+	The filter is a Kaiser windowed sinc with its cutoff at 0.4 of the
+	output rate and unity gain at DC. Each channel is filtered in turn
+	through a window holding its history and the new block, so the
+	working set stays in cache whatever the channel count.
+
+*/
+class FIRDecimator
+{
+public:
+	FIRDecimator();
+
+	/** Designs the filter for factor and sizes the state for blocks of up to maxScans; allocates */
+	void configure(int numChannels, int factor, int maxScans);
+
+	/** Clears the filter history, e.g. when a run starts */
+	void reset();
+
+	int getFactor() const { return factor; }
+	int getNumTaps() const { return numTaps; }
+
+	/** Scans between the sample an output is centered on and the last input it uses */
+	int getDelay() const { return (numTaps - 1) / 2; }
+
+	/** Upper bound on the outputs of a block of numScans scans */
+	int getMaxOutputs(int numScans) const { return numScans / factor + 1; }
+
+	/** Filters numScans scans of each of the numChannels rows of in (numScans per row);
+		blocks longer than maxScans are filtered maxScans scans at a time.
+
+		firstSample is the sample number of scan 0. Writes the outputs to
+		out (channel-major, numOutputs per row) and the scan each is centered
+		on to outputScans, and returns numOutputs. Centers run from -getDelay()
+		(the last scans of the previous blocks) to numScans - 1 - getDelay().
+	*/
+	int process(const float* in, int numScans, int64_t firstSample, float* out, int* outputScans);
+
+private:
+	FIRDecimator(const FIRDecimator&) = delete;
+	FIRDecimator& operator=(const FIRDecimator&) = delete;
+
+	int numChannels;
+	int factor;
+	int numTaps;
+	int maxScans;
+	int64_t nextCenter; //sample number the next output may be centered on
+	bool started; //false until the first block after a reset
+
+	AlignedBuffer<float> taps; //in reverse, so each output is a dot product with the window
+	AlignedBuffer<float> history; //last numTaps - 1 inputs of each channel
+	AlignedBuffer<float> window; //history of one channel followed by its new block
+};
+
+/**
+
+	Gathers the DI lines of several ports into one word per scan.
+
+	A DI task with one channel per port returns a word per port for every
+	scan; pack() moves each line to the bit of its line index. The remap is
+	precomputed as a 256-entry table for every byte of a port word that
+	holds lines, so a scan costs one lookup per such byte. A single port
+	whose lines already sit at their index needs no packing at all.
+
+*/
+class DigitalLineRemap
+{
+public:
+	DigitalLineRemap();
+
+	/** Line k is bit lineBits[k] of port word linePorts[k] (-1 : not read), for up to MAX_DIGITAL_LINES lines; allocates */
+	void configure(const int* linePorts, const int* lineBits, int numLines, int numPorts);
+
+	int getNumPorts() const { return numPorts; }
+
+	/** True when the words read can be used as they are */
+	bool isIdentity() const { return identity; }
+
+	/** Packs numScans scans of numPorts words each */
+	void pack(const uint32_t* in, int numScans, uint32_t* out) const;
+
+private:
+	int numPorts;
+	int numTables;
+	bool identity;
+
+	AlignedBuffer<uint32_t> tables; //256 entries for each port byte holding lines
+	AlignedBuffer<int> tablePort; //port word and bit offset of the byte each table reads
+	AlignedBuffer<int> tableShift;
+};
+
+/**
+
+	Running linear fit of host time against sample number.
+
+	NIDAQmx pairs the number of scans the driver has acquired with a host
+	clock sample once per read, and the fit turns those jittery pairs into
+	a time for every sample number. It is a least squares fit with
+	exponential forgetting, so it follows the slow drift between the two
+	clocks. It is kept as weighted means and co-moments rather than raw
+	sums, which stays accurate at large sample numbers.
+
+*/
+class SampleClockFit
+{
+public:
+	SampleClockFit();
+
+	/** Forgets all points; nominalPeriod (s) is the slope until the fit settles */
+	void reset(double nominalPeriod);
+
+	/** Adds the host time (s) at which sampleNumber was acquired */
+	void addPoint(int64_t sampleNumber, double time);
+
+	int getNumPoints() const { return numPoints; }
+
+	/** Fitted host time of sampleNumber, and the time between two samples */
+	double getTime(int64_t sampleNumber) const;
+	double getPeriod() const;
+
+private:
+	double nominalPeriod;
+	double weight; //sum of the decayed point weights
+	double meanX, meanY;
+	double cxx, cxy; //weighted co-moments about the means
+	int numPoints;
+};
+
+#endif  // __NIDAQKERNELS_H__
@@ -0,0 +1,300 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2019 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <thread>
+
+#include "NIDAQBackend.h"
+
+MockBackend::MockBackend()
+	: paced(true),
+	running(false),
+	generated(0),
+	noiseState(1),
+	replayChannels(0),
+	diScans(0)
+{
+}
+
+void MockBackend::setSimulation(const SimulationSettings& settings)
+{
+	simulation = settings;
+}
+
+void MockBackend::setReplayData(const std::vector<NIDAQ::int16>& scans, int numChannels)
+{
+	replay = scans;
+	replayChannels = numChannels;
+}
+
+bool MockBackend::loadReplayFile(const std::string& path, int numChannels)
+{
+
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file || numChannels <= 0)
+		return false;
+
+	std::streamsize bytes = file.tellg();
+	file.seekg(0);
+
+	size_t numCodes = size_t(bytes) / sizeof(NIDAQ::int16);
+	numCodes -= numCodes % size_t(numChannels);
+	if (numCodes == 0)
+		return false;
+
+	std::vector<NIDAQ::int16> scans(numCodes);
+	if (!file.read(reinterpret_cast<char*>(scans.data()), std::streamsize(numCodes * sizeof(NIDAQ::int16))))
+		return false;
+
+	setReplayData(scans, numChannels);
+
+	return true;
+
+}
+
+void MockBackend::setPaced(bool paced_)
+{
+	paced = paced_;
+}
+
+NIDAQ::int32 MockBackend::getDeviceNames(std::vector<std::string>& names)
+{
+	names.assign(1, SIMULATED_DEVICE_NAME);
+	return 0;
+}
+
+NIDAQ::int32 MockBackend::configure(const BackendTaskConfig& config_)
+{
+
+	config = config_;
+
+	/* Reads are capped to the input buffer like the driver's, so the block buffers are sized once here */
+	const size_t capacity = size_t(std::max(NIDAQ::int32(1), config.bufferSize));
+	di.assign(capacity, 0);
+	scratch.assign(capacity * std::max(size_t(1), config.channels.size()), 0);
+	diScans = 0;
+
+	const int tableSize = 1 << SIM_WAVETABLE_BITS;
+	const float peak = std::min(1.0f, std::max(0.0f, simulation.amplitude)) * 32767.0f;
+
+	wavetable.resize(tableSize);
+	for (int i = 0; i < tableSize; i++)
+	{
+		float phase = float(i) / float(tableSize);
+		float value = 0.0f;
+
+		switch (simulation.waveform) {
+		case SIM_SQUARE:
+			value = phase < 0.5f ? 1.0f : -1.0f; break;
+		case SIM_SAWTOOTH:
+			value = 2.0f * phase - 1.0f; break;
+		default:
+			value = std::sin(6.283185307179586f * phase);
+		}
+
+		wavetable[i] = NIDAQ::int16(std::lround(value * peak));
+	}
+
+	/* Channel k runs at (k + 1) times the base frequency so the channels can be told apart */
+	phaseStep.clear();
+	for (int ch : config.channels)
+	{
+		double cyclesPerScan = config.sampleRate > 0 ? simulation.frequency * (ch + 1) / config.sampleRate : 0.0;
+		phaseStep.push_back(NIDAQ::uInt32(int64_t(cyclesPerScan * 4294967296.0)));
+	}
+
+	return 0;
+
+}
+
+NIDAQ::int32 MockBackend::start()
+{
+
+	phase.assign(config.channels.size(), 0);
+	noiseState = 1;
+	generated = 0;
+	diScans = 0;
+	startTime = std::chrono::steady_clock::now();
+	running = true;
+
+	return 0;
+
+}
+
+void MockBackend::stop()
+{
+	running = false;
+}
+
+NIDAQ::int32 MockBackend::getBacklog(NIDAQ::uInt32* scans)
+{
+
+	if (!running || !paced)
+	{
+		*scans = 0;
+		return 0;
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	int64_t due = int64_t(elapsed * config.sampleRate);
+	*scans = NIDAQ::uInt32(std::min(int64_t(0xffffffff), std::max(int64_t(0), due - generated)));
+
+	return 0;
+
+}
+
+NIDAQ::int32 MockBackend::getTotalAcquired(NIDAQ::uInt64* scans)
+{
+
+	NIDAQ::uInt32 backlog = 0;
+	getBacklog(&backlog);
+	*scans = NIDAQ::uInt64(generated) + backlog;
+
+	return 0;
+
+}
+
+NIDAQ::int32 MockBackend::waitForScans(NIDAQ::int32 numScans, NIDAQ::float64 timeout)
+{
+
+	if (!paced)
+		return 0;
+
+	/* Falling a whole input buffer behind is what makes the hardware overrun */
+	NIDAQ::uInt32 backlog = 0;
+	getBacklog(&backlog);
+	if (config.bufferSize > 0 && backlog > NIDAQ::uInt32(config.bufferSize))
+		return DAQmxErrorSamplesNoLongerAvailable;
+
+	const auto due = startTime + std::chrono::nanoseconds(int64_t(1.0e9 * double(generated + numScans) / config.sampleRate));
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(int64_t(timeout * 1.0e9));
+
+	if (timeout >= 0 && due > deadline)
+	{
+		std::this_thread::sleep_until(deadline);
+		return DAQmxErrorSamplesNotYetAvailable;
+	}
+
+	/* Sleep most of the way, then yield until the block is due so the pacing isn't bound to the scheduler tick */
+	std::this_thread::sleep_until(due - std::chrono::milliseconds(SIM_SPIN_WAIT_MS));
+	while (std::chrono::steady_clock::now() < due)
+		std::this_thread::yield();
+
+	return 0;
+
+}
+
+void MockBackend::generate(NIDAQ::int32 numScans, NIDAQ::int16* data)
+{
+
+	const int numChannels = int(config.channels.size());
+	const int tableShift = 32 - SIM_WAVETABLE_BITS;
+	const int noiseScale = int(std::lround(std::min(1.0f, std::max(0.0f, simulation.amplitude)) * 32767.0f));
+	const int64_t ttlPeriod = std::max(int64_t(1), int64_t(simulation.ttlPeriodMs * config.sampleRate / 1000.0));
+	const bool replaying = replayChannels == numChannels && !replay.empty();
+
+	NIDAQ::int16* out = data;
+
+	for (NIDAQ::int32 i = 0; i < numScans; i++)
+	{
+		if (replaying)
+		{
+			size_t scan = size_t(generated + i) % (replay.size() / size_t(numChannels));
+			std::copy_n(replay.data() + scan * numChannels, numChannels, out);
+			out += numChannels;
+		}
+		else
+		{
+			for (int k = 0; k < numChannels; k++)
+			{
+				if (simulation.waveform == SIM_NOISE)
+				{
+					/* xorshift32 */
+					noiseState ^= noiseState << 13;
+					noiseState ^= noiseState >> 17;
+					noiseState ^= noiseState << 5;
+					*out++ = NIDAQ::int16(((int(noiseState >> 16) - 32768) * noiseScale) >> 15);
+				}
+				else
+				{
+					*out++ = wavetable[phase[k] >> tableShift];
+					phase[k] += phaseStep[k];
+				}
+			}
+		}
+
+		/* Line k toggles every 2^k TTL periods */
+		di[i] = NIDAQ::uInt32((generated + i) / ttlPeriod) & ((1u << NUM_SIMULATED_DI_LINES) - 1);
+	}
+
+	generated += numScans;
+	diScans = numScans;
+
+}
+
+NIDAQ::int32 MockBackend::readAnalogI16(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::int16* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead)
+{
+
+	*scansRead = 0;
+
+	numScans = std::min(numScans, arraySize / std::max(1, int(config.channels.size())));
+	numScans = std::min(numScans, NIDAQ::int32(di.size()));
+
+	NIDAQ::int32 error = waitForScans(numScans, timeout);
+	if (DAQmxFailed(error))
+		return error;
+
+	generate(numScans, data);
+	*scansRead = numScans;
+
+	return 0;
+
+}
+
+NIDAQ::int32 MockBackend::readAnalogF64(NIDAQ::int32 numScans, NIDAQ::float64 timeout, NIDAQ::float64* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead)
+{
+
+	const size_t numChannels = config.channels.size();
+
+	NIDAQ::int32 error = readAnalogI16(numScans, timeout, scratch.data(), std::min(arraySize, NIDAQ::int32(scratch.size())), scansRead);
+	if (DAQmxFailed(error))
+		return error;
+
+	for (size_t j = 0; j < size_t(*scansRead) * numChannels; j++)
+		data[j] = scratch[j] * config.voltsPerCode;
+
+	return 0;
+
+}
+
+NIDAQ::int32 MockBackend::readDigitalU32(NIDAQ::int32 numScans, NIDAQ::float64 /*timeout*/, NIDAQ::uInt32* data, NIDAQ::int32 arraySize, NIDAQ::int32* scansRead)
+{
+
+	*scansRead = std::min(std::min(numScans, arraySize), diScans);
+	std::copy_n(di.data(), *scansRead, data);
+
+	return 0;
+
+}
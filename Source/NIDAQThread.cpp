@@ -25,6 +25,14 @@
 #include "NIDAQEditor.h"
 #include <stdexcept>
 
+/* Decimated rates offered in the advanced options, 0 : no decimation */
+#define NUM_OUTPUT_RATE_OPTIONS 6
+static const float outputRateOptions[NUM_OUTPUT_RATE_OPTIONS] = { 0, 1000, 2000, 2500, 5000, 10000 };
+
+/* DataBuffer headroom offered in the advanced options */
+#define NUM_DATA_BUFFER_OPTIONS 6
+static const float dataBufferOptions[NUM_DATA_BUFFER_OPTIONS] = { 100, 250, 500, 1000, 2000, 5000 };
+
 DataThread* NIDAQThread::createDataThread(SourceNode *sn)
 {
 	return new NIDAQThread(sn);
@@ -41,18 +49,40 @@ std::unique_ptr<GenericEditor> NIDAQThread::createEditor(SourceNode* sn)
 
 }
 
-NIDAQThread::NIDAQThread(SourceNode* sn) : DataThread(sn), inputAvailable(false)
+NIDAQThread::NIDAQThread(SourceNode* sn) : DataThread(sn), inputAvailable(false), mNIDAQ(nullptr), syncDevices(false), probing(true)
 {
 
 	dm = new NIDAQmxDeviceManager();
 
+	/* Devices are probed by the editor's BackgroundLoader (see probeDevices); until then a
+	   placeholder that doesn't touch the driver keeps the accessors valid and publishes no stream */
+	mNIDAQ = nidaqDevices.add(new NIDAQmx(SIMULATED_DEVICE_NAME));
+
+}
+
+void NIDAQThread::probeDevices()
+{
 	dm->scanForDevices();
+}
+
+void NIDAQThread::finishProbing()
+{
+
+	nidaqDevices.clear();
+	sourceStreams.clear();
 
-	if (dm->getNumAvailableDevices() > 0 && dm->getDeviceFromIndex(0) != "SimulatedDevice")
-	{
-		inputAvailable = true;
-	}
 	openConnection();
+
+	/* Without hardware the SimulatedDevice acquires instead */
+	inputAvailable = dm->getNumAvailableDevices() > 0;
+
+	probing = false;
+
+}
+
+bool NIDAQThread::isProbing() const
+{
+	return probing;
 }
 
 
@@ -67,15 +97,115 @@ void NIDAQThread::initialize(bool signalChainIsLoading)
 
 }
 
+String NIDAQThread::getStatsReport() const
+{
+
+	String report;
+
+	for (auto device : nidaqDevices)
+	{
+		if (!device->deviceEnabled)
+			continue;
+
+		const AcquisitionStats& stats = device->getStats();
+
+		report += getStreamName(device) + "\n";
+		report += "  read to push: " + stats.readToPush.toString() + "\n";
+		report += "  read jitter: " + stats.readJitter.toString() + "\n";
+		report += "  kernels: " + stats.kernelTime.toString() + "\n";
+		report += "  data buffer: " + String(device->aiBufferSize) + " samples ("
+			+ String(device->getOutputSampleRate() > 0 ? 1000.0 * device->aiBufferSize / device->getOutputSampleRate() : 0.0, 0) + " ms)\n";
+		report += "  dropped samples: " + String((int64)stats.droppedSamples.load()) + "\n";
+		report += "  overrun recoveries: " + String((int64)stats.recoveries.load())
+			+ " (" + String((int64)stats.lostSamples.load()) + " samples lost)\n";
+		if (device->acquisitionMode == ACQ_HW_TIMED_SINGLE_POINT)
+			report += "  missed samples: " + String((int64)stats.missedSamples.load()) + "\n";
+	}
+
+	return report;
+
+}
+
+void NIDAQThread::resetStats()
+{
+	for (auto device : nidaqDevices)
+		device->resetStats();
+}
+
 String NIDAQThread::handleConfigMessage(String msg)
 {
-	//TODO:
+
+	StringArray tokens;
+	tokens.addTokens(msg.toUpperCase(), " ", "");
+	tokens.removeEmptyStrings();
+
+	if (tokens.size() >= 2 && tokens[0] == "NIDAQ" && tokens[1] == "STATS")
+	{
+		if (tokens.size() >= 3 && tokens[2] == "RESET")
+		{
+			resetStats();
+			return "NIDAQ STATS RESET";
+		}
+
+		return getStatsReport();
+	}
+
+	/* NIDAQ SIMULATE CHANNELS <1-64> | WAVEFORM <SINE|SQUARE|SAWTOOTH|NOISE> | FREQUENCY <Hz> | AMPLITUDE <0-1> | TTL <ms> */
+	if (tokens.size() >= 4 && tokens[0] == "NIDAQ" && tokens[1] == "SIMULATE")
+	{
+		SimulationSettings settings = getSimulation();
+
+		if (tokens[2] == "CHANNELS")
+		{
+			setNumSimulatedChannels(tokens[3].getIntValue());
+
+			if (editor != nullptr)
+			{
+				editor->draw();
+				CoreServices::updateSignalChain(editor);
+			}
+		}
+		else if (tokens[2] == "WAVEFORM")
+		{
+			StringArray waveforms = StringArray::fromTokens("SINE SQUARE SAWTOOTH NOISE", " ", "");
+			if (!waveforms.contains(tokens[3]))
+				return "NIDAQ SIMULATE: unknown waveform " + tokens[3];
+			settings.waveform = (SIM_WAVEFORM)waveforms.indexOf(tokens[3]);
+		}
+		else if (tokens[2] == "FREQUENCY")
+			settings.frequency = jmax(0.0f, tokens[3].getFloatValue());
+		else if (tokens[2] == "AMPLITUDE")
+			settings.amplitude = jlimit(0.0f, 1.0f, tokens[3].getFloatValue());
+		else if (tokens[2] == "TTL")
+			settings.ttlPeriodMs = jmax(0.0f, tokens[3].getFloatValue());
+		else
+			return "NIDAQ SIMULATE: unknown setting " + tokens[2];
+
+		setSimulation(settings);
+
+		return "NIDAQ SIMULATE " + tokens[2] + " " + tokens[3];
+	}
+
 	return " ";
+
 }
 
 void NIDAQThread::handleBroadcastMessage(String msg)
 {
-	//TODO
+
+	/* Config messages aren't delivered while acquiring; the same commands are accepted here and logged */
+	StringArray tokens;
+	tokens.addTokens(msg.toUpperCase(), " ", "");
+	tokens.removeEmptyStrings();
+
+	if (tokens.size() >= 2 && tokens[0] == "NIDAQ" && tokens[1] == "STATS")
+	{
+		if (tokens.size() >= 3 && tokens[2] == "RESET")
+			resetStats();
+		else
+			LOGC(getStatsReport());
+	}
+
 }
 
 void NIDAQThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChannels,
@@ -86,23 +216,34 @@ void NIDAQThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChanne
 	OwnedArray<ConfigurationObject>* configurationObjects)
 {
 
-	if (sourceStreams.size() == 0) // initialize data streams
+	/* One stream per device, kept across updates unless its sample rate changes */
+	for (int i = 0; i < nidaqDevices.size(); i++)
 	{
+		NIDAQmx* device = nidaqDevices[i];
+
+		if (i < sourceStreams.size() && sourceStreams[i]->getName() == getStreamName(device) && sourceStreams[i]->getSampleRate() == device->getOutputSampleRate())
+			continue;
 
 		DataStream::Settings settings
 		{
-			getProductName(),
+			getStreamName(device),
 			"Analog input channels from a NIDAQ device",
-			"identifier",
+			device->deviceName,
 
-			getSampleRate()
+			device->getOutputSampleRate()
 
 		};
 
-		sourceStreams.add(new DataStream(settings));
+		if (i < sourceStreams.size())
+			sourceStreams.set(i, new DataStream(settings));
+		else
+			sourceStreams.add(new DataStream(settings));
 
 	}
 
+	/* sourceBuffers has to follow the order of the streams handed to SourceNode */
+	sourceBuffers.clear();
+
 	dataStreams->clear();
 	eventChannels->clear();
 	continuousChannels->clear();
@@ -110,18 +251,26 @@ void NIDAQThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChanne
 	devices->clear();
 	configurationObjects->clear();
 
-	for (int i = 0; i < sourceStreams.size(); i++)
+	for (int i = 0; i < nidaqDevices.size(); i++)
 	{
+		NIDAQmx* device = nidaqDevices[i];
+
+		if (!device->deviceEnabled)
+			continue;
+
 		DataStream* currentStream = sourceStreams[i];
 
 		currentStream->clearChannels();
 
-		// TODO: Maybe implement for each NIDAQ device
-		// StreamInfo info = streamInfo[i];
+		/* Sized for the rate and channels of this layout, so a GUI stall of dataBufferMs doesn't drop samples */
+		const int bufferSize = device->getDataBufferSize();
+		sourceBuffers.add(new DataBuffer(device->getNumDataChannels(), bufferSize));
+		device->aiBuffer = sourceBuffers.getLast();
+		device->aiBufferSize = bufferSize;
 
-		for (int ch = 0; ch < mNIDAQ->aiChannelEnabled.size(); ch++)
+		for (int ch = 0; ch < device->aiChannelEnabled.size(); ch++)
 		{
-			float bitVolts = mNIDAQ->voltageRange.vmax / float(0x7fff);
+			float bitVolts = device->getBitVolts(ch);
 
 			ContinuousChannel::Settings settings{
 				ContinuousChannel::Type::ADC,
@@ -138,13 +287,34 @@ void NIDAQThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChanne
 
 		}
 
+		/* Counts, Hz or encoder ticks, exact up to 2^24 */
+		for (int c = 0; c < device->ci.size(); c++)
+		{
+			if (device->ciMode[c] == CI_OFF)
+				continue;
+
+			ContinuousChannel::Settings settings{
+				ContinuousChannel::Type::ADC,
+				"CTR" + String(c),
+				String(NIDAQmx::getCounterModeName(device->ciMode[c])) + " from a NIDAQ counter input",
+				"identifier",
+
+				1.0f,
+
+				currentStream
+			};
+
+			continuousChannels->add(new ContinuousChannel(settings));
+		}
+
+		/* One line per DI input, plus the overrun gap marker */
 		EventChannel::Settings settings{
 			EventChannel::Type::TTL,
-			getProductName() + "Digital Input Line",
-			"Digital Line from a NIDAQ device containing " + String(mNIDAQ->diChannelEnabled.size()) + " inputs",
+			getStreamName(device) + "Digital Input Line",
+			"Digital Line from a NIDAQ device containing " + String(device->diChannelEnabled.size()) + " inputs and a gap marker on line " + String(device->getGapMarkerLine() + 1),
 			"identifier",
 			currentStream,
-			mNIDAQ->diChannelEnabled.size()
+			device->diChannelEnabled.size() + 1
 		};
 
 		eventChannels->add(new EventChannel(settings));
@@ -162,46 +332,321 @@ void NIDAQThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChanne
 int NIDAQThread::openConnection()
 {
 
-	mNIDAQ = new NIDAQmx(STR2CHR(dm->getDeviceFromIndex(0)));
+	/* Every device gets its own NIDAQmx thread; only the first one acquires until others are enabled */
+	for (int i = 0; i < dm->getNumAvailableDevices(); i++)
+	{
+		NIDAQmx* device = nidaqDevices.add(new NIDAQmx(*dm->getCapabilities(i)));
+
+		device->samplerate = device->sampleRates.getLast();
+		device->voltageRange = device->aiVRanges.getLast();
+	}
+
+	nidaqDevices[0]->deviceEnabled = true;
+
+	selectDevice(0);
 
-	sourceBuffers.add(new DataBuffer(getNumAnalogInputs(), 10000));
+	return 0;
+
+}
 
-	mNIDAQ->aiBuffer = sourceBuffers.getLast();
+void NIDAQThread::selectDevice(int index)
+{
+
+	mNIDAQ = nidaqDevices[index];
 
-	sampleRateIndex = mNIDAQ->sampleRates.size() - 1;
-	setSampleRate(sampleRateIndex);
+	sampleRateIndex = mNIDAQ->sampleRates.indexOf(mNIDAQ->samplerate);
 
 	voltageRangeIndex = mNIDAQ->aiVRanges.size() - 1;
-	setVoltageRange(voltageRangeIndex);
+	for (int i = 0; i < mNIDAQ->aiVRanges.size(); i++)
+	{
+		if (mNIDAQ->aiVRanges[i].vmin == mNIDAQ->voltageRange.vmin && mNIDAQ->aiVRanges[i].vmax == mNIDAQ->voltageRange.vmax)
+			voltageRangeIndex = i;
+	}
 
-	return 0;
+}
+
+String NIDAQThread::getStreamName(NIDAQmx* device) const
+{
+
+	/* Identical boards get their DAQmx device name appended so their streams can be told apart */
+	for (auto other : nidaqDevices)
+	{
+		if (other != device && other->productName == device->productName)
+			return device->productName + " (" + device->deviceName + ")";
+	}
+
+	return device->productName;
 
 }
 
 int NIDAQThread::getNumAvailableDevices()
 {
-	return dm->getNumAvailableDevices();
+	return nidaqDevices.size();
 }
 
-void NIDAQThread::selectFromAvailableDevices()
+bool NIDAQThread::rescanDevices()
 {
 
-	PopupMenu deviceSelect;
-	StringArray productNames;
-	for (int i = 0; i < getNumAvailableDevices(); i++)
+	if (!dm->scanForDevices())
+		return false;
+
+	/* Devices still connected keep their NIDAQmx and settings; new ones are built from the cache */
+	OwnedArray<NIDAQmx> rescanned;
+	String selectedDevice = mNIDAQ->deviceName;
+
+	for (int i = 0; i < dm->getNumAvailableDevices(); i++)
 	{
-		ScopedPointer<NIDAQmx> n = new NIDAQmx(STR2CHR(dm->getDeviceFromIndex(i)));
-		if (!(n->getProductName() == getProductName()))
+		const DeviceCapabilities* capabilities = dm->getCapabilities(i);
+
+		int existing = -1;
+		for (int j = 0; j < nidaqDevices.size(); j++)
+		{
+			if (nidaqDevices[j]->deviceName == capabilities->deviceName && nidaqDevices[j]->serialNum == capabilities->serialNum
+				&& nidaqDevices[j]->ai.size() == capabilities->aiChannels.size())
+				existing = j;
+		}
+
+		if (existing >= 0)
 		{
-			deviceSelect.addItem(productNames.size() + 1, "Swap to " + n->getProductName());
-			productNames.add(n->getProductName());
+			rescanned.add(nidaqDevices.removeAndReturn(existing));
 		}
+		else
+		{
+			NIDAQmx* device = rescanned.add(new NIDAQmx(*capabilities));
+			device->samplerate = device->sampleRates.getLast();
+			device->voltageRange = device->aiVRanges.getLast();
+
+			/* Settings that apply to all devices */
+			device->overrunRecovery = mNIDAQ->overrunRecovery;
+			device->samplesPerRead = mNIDAQ->samplesPerRead;
+			device->targetLatencyMs = mNIDAQ->targetLatencyMs;
+			device->inputBufferMs = mNIDAQ->inputBufferMs;
+			device->dataBufferMs = mNIDAQ->dataBufferMs;
+			device->xferMech = mNIDAQ->xferMech;
+			device->xferReqCond = mNIDAQ->xferReqCond;
+			device->diTimingMode = mNIDAQ->diTimingMode;
+			device->simulation = mNIDAQ->simulation;
+			device->threadSettings = mNIDAQ->threadSettings;
+		}
+	}
+
+	nidaqDevices.swapWith(rescanned);
+
+	if (getNumEnabledDevices() == 0)
+		nidaqDevices[0]->deviceEnabled = true;
+
+	int selected = 0;
+	for (int i = 0; i < nidaqDevices.size(); i++)
+		if (nidaqDevices[i]->deviceName == selectedDevice)
+			selected = i;
+
+	selectDevice(selected);
+
+	inputAvailable = dm->getNumAvailableDevices() > 0;
+
+	return true;
+
+}
+
+bool NIDAQThread::selectFromAvailableDevices()
+{
+
+	const int numDevices = nidaqDevices.size();
+
+	PopupMenu deviceSelect;
+	for (int i = 0; i < numDevices; i++)
+		deviceSelect.addItem(i + 1, "Show " + getStreamName(nidaqDevices[i]), true, nidaqDevices[i] == mNIDAQ);
+
+	deviceSelect.addSeparator();
+	for (int i = 0; i < numDevices; i++)
+		deviceSelect.addItem(numDevices + i + 1, "Acquire from " + getStreamName(nidaqDevices[i]), true, nidaqDevices[i]->deviceEnabled);
+
+	deviceSelect.addSeparator();
+	deviceSelect.addItem(2 * numDevices + 1, "Share clock and start trigger", true, syncDevices);
+	deviceSelect.addItem(2 * numDevices + 2, "Rescan devices");
+
+	/* Advanced options: acquisition thread scheduling */
+	AcquisitionThreadSettings threadSettings = getThreadSettings();
+	const int numCores = jmin(32, SystemStats::getNumCpus());
+	const int priorityItem = 2 * numDevices + 3;
+	const int coreItem = priorityItem + 12;
+	const int mmcssItem = coreItem + numCores + 1;
+	const int outputRateItem = mmcssItem + MMCSS_CAPTURE + 1;
+	const int loggingItem = outputRateItem + NUM_OUTPUT_RATE_OPTIONS;
+	const int counterItem = loggingItem + 1;
+	const int modeItem = counterItem + getNumCounterInputs() * NUM_COUNTER_MODES;
+	const int dataBufferItem = modeItem + NUM_ACQUISITION_MODES;
+
+	PopupMenu priorityMenu;
+	priorityMenu.addItem(priorityItem + 11, "Default (" + String(DEFAULT_THREAD_PRIORITY) + ", " + String(SINGLE_POINT_THREAD_PRIORITY) + " in single point mode)",
+		true, threadSettings.priority < 0);
+	for (int p = 0; p <= 10; p++)
+		priorityMenu.addItem(priorityItem + p, p == 10 ? "10 (realtime)" : String(p), true, threadSettings.priority == p);
+
+	PopupMenu coreMenu;
+	coreMenu.addItem(coreItem, "Any", true, threadSettings.cpuCore < 0);
+	for (int c = 0; c < numCores; c++)
+		coreMenu.addItem(coreItem + c + 1, "CPU " + String(c), true, threadSettings.cpuCore == c);
+
+	PopupMenu mmcssMenu;
+	for (int t = MMCSS_OFF; t <= MMCSS_CAPTURE; t++)
+		mmcssMenu.addItem(mmcssItem + t, NIDAQmx::getMMCSSTaskName((MMCSS_TASK)t), true, threadSettings.mmcssTask == t);
+
+	PopupMenu outputRateMenu;
+	for (int r = 0; r < NUM_OUTPUT_RATE_OPTIONS; r++)
+		outputRateMenu.addItem(outputRateItem + r, outputRateOptions[r] > 0 ? String(outputRateOptions[r]) + " S/s" : "Sample rate",
+			outputRateOptions[r] < getSampleRate(), getOutputRate() == outputRateOptions[r]);
+
+	PopupMenu dataBufferMenu;
+	for (int b = 0; b < NUM_DATA_BUFFER_OPTIONS; b++)
+		dataBufferMenu.addItem(dataBufferItem + b, String(dataBufferOptions[b], 0) + " ms", true, getDataBufferLength() == dataBufferOptions[b]);
+
+	PopupMenu counterMenu;
+	for (int i = 0; i < getNumCounterInputs(); i++)
+	{
+		PopupMenu modeMenu;
+		for (int m = CI_OFF; m < NUM_COUNTER_MODES; m++)
+			modeMenu.addItem(counterItem + i * NUM_COUNTER_MODES + m, NIDAQmx::getCounterModeName((COUNTER_MODE)m), true, getCounterMode(i) == m);
+		counterMenu.addSubMenu("CTR" + String(i), modeMenu);
+	}
+
+	static const char* modeNames[NUM_ACQUISITION_MODES] = { "Blocking reads", "Every N samples callback", "Hardware-timed single point" };
+	PopupMenu acquisitionModeMenu;
+	for (int m = 0; m < NUM_ACQUISITION_MODES; m++)
+		acquisitionModeMenu.addItem(modeItem + m, modeNames[m], true, getAcquisitionMode() == m);
+
+	PopupMenu advancedMenu;
+	advancedMenu.addSubMenu("Acquisition mode", acquisitionModeMenu);
+	advancedMenu.addSubMenu("Counter inputs", counterMenu, getNumCounterInputs() > 0);
+	advancedMenu.addSubMenu("Decimate to", outputRateMenu);
+	advancedMenu.addSubMenu("Buffer headroom", dataBufferMenu);
+	advancedMenu.addSubMenu("Thread priority", priorityMenu);
+	advancedMenu.addSubMenu("Pin thread to", coreMenu);
+	advancedMenu.addSubMenu("MMCSS task", mmcssMenu, NIDAQmx::isMMCSSAvailable());
+	advancedMenu.addItem(loggingItem, "Log to TDMS in the driver", !mNIDAQ->isSimulated(), getDriverLogging());
+
+	deviceSelect.addSeparator();
+	deviceSelect.addSubMenu("Advanced options", advancedMenu);
+
+	int selectedItem = deviceSelect.show();
+	if (selectedItem == 0) //user clicked outside of popup window
+		return false;
+
+	if (selectedItem <= numDevices)
+	{
+		selectDevice(selectedItem - 1);
+		return false;
+	}
+
+	if (selectedItem <= 2 * numDevices)
+	{
+		setDeviceEnabled(selectedItem - numDevices - 1, !nidaqDevices[selectedItem - numDevices - 1]->deviceEnabled);
+		return true;
+	}
+
+	if (selectedItem == 2 * numDevices + 1)
+	{
+		syncDevices = !syncDevices;
+		return false;
+	}
+
+	if (selectedItem == 2 * numDevices + 2)
+		return rescanDevices();
+
+	/* The DataBuffer is reallocated with the next settings update */
+	if (selectedItem >= dataBufferItem)
+	{
+		float previousLength = getDataBufferLength();
+		setDataBufferLength(dataBufferOptions[selectedItem - dataBufferItem]);
+		return getDataBufferLength() != previousLength;
+	}
+
+	if (selectedItem >= modeItem)
+	{
+		setAcquisitionMode((ACQUISITION_MODE)(selectedItem - modeItem));
+		return false;
+	}
+
+	/* Counters in use add channels to the stream */
+	if (selectedItem >= counterItem)
+	{
+		int index = (selectedItem - counterItem) / NUM_COUNTER_MODES;
+		COUNTER_MODE mode = (COUNTER_MODE)((selectedItem - counterItem) % NUM_COUNTER_MODES);
+		bool changed = getCounterMode(index) != mode;
+		setCounterMode(index, mode);
+		return changed;
 	}
-	int selectedDeviceIndex = deviceSelect.show();
-	if (selectedDeviceIndex == 0) //user clicked outside of popup window
+
+	if (selectedItem == loggingItem)
+	{
+		setDriverLogging(!getDriverLogging());
+		return false;
+	}
+
+	/* The stream sample rate changes with the decimation */
+	if (selectedItem >= outputRateItem)
+	{
+		float previousRate = mNIDAQ->getOutputSampleRate();
+		setOutputRate(outputRateOptions[selectedItem - outputRateItem]);
+		return mNIDAQ->getOutputSampleRate() != previousRate;
+	}
+
+	if (selectedItem < coreItem)
+		threadSettings.priority = selectedItem - priorityItem <= 10 ? selectedItem - priorityItem : -1;
+	else if (selectedItem < mmcssItem)
+		threadSettings.cpuCore = selectedItem - coreItem - 1;
+	else
+		threadSettings.mmcssTask = (MMCSS_TASK)(selectedItem - mmcssItem);
+
+	setThreadSettings(threadSettings);
+
+	return false;
+
+}
+
+void NIDAQThread::setDeviceEnabled(int index, bool enabled)
+{
+
+	/* Keep at least one stream */
+	if (!enabled && getNumEnabledDevices() == 1)
 		return;
 
-	swapConnection(productNames[selectedDeviceIndex - 1]);
+	nidaqDevices[index]->deviceEnabled = enabled;
+
+}
+
+bool NIDAQThread::isDeviceEnabled(int index) const
+{
+	return nidaqDevices[index]->deviceEnabled;
+}
+
+int NIDAQThread::getNumEnabledDevices() const
+{
+	int count = 0;
+	for (auto device : nidaqDevices)
+		if (device->deviceEnabled)
+			count++;
+	return count;
+}
+
+String NIDAQThread::getDeviceSerialNumber(int index) const
+{
+	return nidaqDevices[index]->getSerialNumber();
+}
+
+int NIDAQThread::getSelectedDeviceIndex() const
+{
+	return nidaqDevices.indexOf(mNIDAQ);
+}
+
+void NIDAQThread::setDeviceSync(bool sync)
+{
+	syncDevices = sync;
+}
+
+bool NIDAQThread::getDeviceSync() const
+{
+	return syncDevices;
 }
 
 String NIDAQThread::getProductName() const
@@ -212,26 +657,131 @@ String NIDAQThread::getProductName() const
 int NIDAQThread::swapConnection(String productName)
 {
 
-	if (!dm->getDeviceFromProductName(productName).isEmpty())
+	/* Devices are all opened up front, so this only changes the one shown in the editor */
+	for (int i = 0; i < nidaqDevices.size(); i++)
 	{
-		mNIDAQ = new NIDAQmx(STR2CHR(dm->getDeviceFromProductName(productName)));
-
-		sourceBuffers.removeLast();
-		sourceBuffers.add(new DataBuffer(getNumAnalogInputs(), 10000));
-		mNIDAQ->aiBuffer = sourceBuffers.getLast();
+		if (nidaqDevices[i]->getProductName() == productName)
+		{
+			selectDevice(i);
+			return 0;
+		}
+	}
+	return 1;
 
-		sampleRateIndex = mNIDAQ->sampleRates.size() - 1;
-		setSampleRate(sampleRateIndex);
+}
 
-		voltageRangeIndex = mNIDAQ->aiVRanges.size() - 1;
-		setVoltageRange(voltageRangeIndex);
+int NIDAQThread::selectDeviceBySerialNumber(String serialNumber)
+{
 
-		return 0;
+	for (int i = 0; i < nidaqDevices.size(); i++)
+	{
+		if (nidaqDevices[i]->getSerialNumber() == serialNumber)
+		{
+			selectDevice(i);
+			return 0;
+		}
 	}
 	return 1;
 
 }
 
+void NIDAQThread::saveDeviceSettings(XmlElement* xml)
+{
+
+	for (auto device : nidaqDevices)
+	{
+		XmlElement* settings = xml->createNewChildElement("DEVICE");
+		settings->setAttribute("name", device->deviceName);
+		settings->setAttribute("serial", device->getSerialNumber());
+
+		StringArray aiEnabled, sourceTypes, diEnabled;
+		for (int i = 0; i < device->aiChannelEnabled.size(); i++)
+		{
+			aiEnabled.add(device->aiChannelEnabled[i] ? "1" : "0");
+			sourceTypes.add(String((int)device->st[i]));
+		}
+		for (int i = 0; i < device->diChannelEnabled.size(); i++)
+			diEnabled.add(device->diChannelEnabled[i] ? "1" : "0");
+
+		settings->setAttribute("aiEnabled", aiEnabled.joinIntoString(","));
+		settings->setAttribute("sourceTypes", sourceTypes.joinIntoString(","));
+		settings->setAttribute("diEnabled", diEnabled.joinIntoString(","));
+
+		int rangeIndex = device->aiVRanges.size() - 1;
+		for (int i = 0; i < device->aiVRanges.size(); i++)
+			if (device->aiVRanges[i].vmin == device->voltageRange.vmin && device->aiVRanges[i].vmax == device->voltageRange.vmax)
+				rangeIndex = i;
+
+		settings->setAttribute("voltageRangeIndex", rangeIndex);
+		settings->setAttribute("sampleRateIndex", device->sampleRates.indexOf(device->samplerate));
+		settings->setAttribute("sampleRate", device->samplerate);
+	}
+
+}
+
+void NIDAQThread::loadDeviceSettings(const XmlElement* xml)
+{
+
+	for (auto* settings : xml->getChildWithTagNameIterator("DEVICE"))
+	{
+		/* Boards are matched by serial number, the SimulatedDevice (serial 0) by name */
+		NIDAQmx* device = nullptr;
+		for (auto candidate : nidaqDevices)
+			if (candidate->getSerialNumber() == settings->getStringAttribute("serial") && candidate->deviceName == settings->getStringAttribute("name"))
+				device = candidate;
+
+		if (device == nullptr)
+			continue;
+
+		StringArray aiEnabled, sourceTypes, diEnabled;
+		aiEnabled.addTokens(settings->getStringAttribute("aiEnabled"), ",", "");
+		sourceTypes.addTokens(settings->getStringAttribute("sourceTypes"), ",", "");
+		diEnabled.addTokens(settings->getStringAttribute("diEnabled"), ",", "");
+
+		for (int i = 0; i < jmin(aiEnabled.size(), device->aiChannelEnabled.size()); i++)
+			device->aiChannelEnabled.set(i, aiEnabled[i].getIntValue() != 0);
+
+		/* Only source types the input supports, as toggleSourceType would pick */
+		for (int i = 0; i < jmin(sourceTypes.size(), device->st.size()); i++)
+		{
+			int type = sourceTypes[i].getIntValue();
+			if (type >= 0 && type < NUM_SOURCE_TYPES && ((1 << type) & device->terminalConfig[i]))
+				device->st.set(i, (SOURCE_TYPE)type);
+		}
+
+		for (int i = 0; i < jmin(diEnabled.size(), device->diChannelEnabled.size()); i++)
+			device->diChannelEnabled.set(i, diEnabled[i].getIntValue() != 0);
+		device->updateDigitalLineMask();
+
+		int rangeIndex = settings->getIntAttribute("voltageRangeIndex", -1);
+		if (rangeIndex >= 0 && rangeIndex < device->aiVRanges.size())
+			device->voltageRange = device->aiVRanges[rangeIndex];
+
+		/* The rate list depends on the enabled inputs; the rate itself is kept if the list still has it, else the index */
+		device->updateSampleRates();
+		float rate = (float)settings->getDoubleAttribute("sampleRate");
+		int rateIndex = settings->getIntAttribute("sampleRateIndex", -1);
+		if (device->sampleRates.contains(rate))
+			device->samplerate = rate;
+		else if (rateIndex >= 0 && rateIndex < device->sampleRates.size())
+			device->samplerate = device->sampleRates[rateIndex];
+	}
+
+	/* Refreshes the indices of the device shown */
+	selectDevice(nidaqDevices.indexOf(mNIDAQ));
+
+}
+
+void NIDAQThread::saveCapabilities(XmlElement* xml)
+{
+	dm->saveCapabilities(xml);
+}
+
+void NIDAQThread::loadCapabilities(const XmlElement* xml)
+{
+	dm->loadCapabilities(xml);
+}
+
 void NIDAQThread::toggleSourceType(int id)
 {
 	mNIDAQ->toggleSourceType(id);
@@ -256,14 +806,35 @@ int NIDAQThread::getNumDigitalInputs() const
 	return mNIDAQ->di.size();
 }
 
+int NIDAQThread::getNumCounterInputs() const
+{
+	return mNIDAQ->ci.size();
+}
+
+void NIDAQThread::setCounterMode(int index, COUNTER_MODE mode)
+{
+	if (index >= 0 && index < mNIDAQ->ciMode.size())
+		mNIDAQ->ciMode.set(index, mode);
+}
+
+COUNTER_MODE NIDAQThread::getCounterMode(int index)
+{
+	return index >= 0 && index < mNIDAQ->ciMode.size() ? mNIDAQ->ciMode[index] : CI_OFF;
+}
+
 void NIDAQThread::toggleAIChannel(int index)
 {
 	mNIDAQ->aiChannelEnabled.set(index, !mNIDAQ->aiChannelEnabled[index]);
+
+	/* The available rates depend on how many inputs share the ADC */
+	mNIDAQ->updateSampleRates();
+	sampleRateIndex = mNIDAQ->sampleRates.indexOf(mNIDAQ->samplerate);
 }
 
 void NIDAQThread::toggleDIChannel(int index)
 {
 	mNIDAQ->diChannelEnabled.set(index, !mNIDAQ->diChannelEnabled[index]);
+	mNIDAQ->updateDigitalLineMask();
 }
 
 void NIDAQThread::setVoltageRange(int rangeIndex)
@@ -283,6 +854,189 @@ float NIDAQThread::getSampleRate()
 	return mNIDAQ->samplerate;
 }
 
+void NIDAQThread::setOutputRate(float rate)
+{
+	mNIDAQ->outputRate = jmax(0.0f, rate);
+}
+
+float NIDAQThread::getOutputRate()
+{
+	return mNIDAQ->outputRate;
+}
+
+void NIDAQThread::setReadMode(AI_READ_MODE mode)
+{
+	if (mode == READ_RAW_I16 && !mNIDAQ->supportsRawRead())
+		mode = READ_SCALED_F64;
+	mNIDAQ->readMode = mode;
+}
+
+AI_READ_MODE NIDAQThread::getReadMode()
+{
+	return mNIDAQ->readMode;
+}
+
+void NIDAQThread::setDriverLogging(bool enabled)
+{
+	mNIDAQ->driverLogging = enabled && !mNIDAQ->isSimulated();
+}
+
+bool NIDAQThread::getDriverLogging()
+{
+	return mNIDAQ->driverLogging;
+}
+
+void NIDAQThread::setAcquisitionMode(ACQUISITION_MODE mode)
+{
+	mNIDAQ->acquisitionMode = (ACQUISITION_MODE)jlimit(0, NUM_ACQUISITION_MODES - 1, (int)mode);
+}
+
+ACQUISITION_MODE NIDAQThread::getAcquisitionMode()
+{
+	return mNIDAQ->acquisitionMode;
+}
+
+void NIDAQThread::setSamplesPerRead(int samples)
+{
+	for (auto device : nidaqDevices)
+		device->samplesPerRead = jmax(0, samples);
+}
+
+int NIDAQThread::getSamplesPerRead()
+{
+	return mNIDAQ->samplesPerRead;
+}
+
+void NIDAQThread::setTargetLatency(float latencyMs)
+{
+	for (auto device : nidaqDevices)
+		device->targetLatencyMs = jmax(0.0f, latencyMs);
+}
+
+float NIDAQThread::getTargetLatency()
+{
+	return mNIDAQ->targetLatencyMs;
+}
+
+void NIDAQThread::setInputBufferLength(float ms)
+{
+	for (auto device : nidaqDevices)
+		device->inputBufferMs = jmax(0.0f, ms);
+}
+
+float NIDAQThread::getInputBufferLength()
+{
+	return mNIDAQ->inputBufferMs;
+}
+
+void NIDAQThread::setDataBufferLength(float ms)
+{
+	for (auto device : nidaqDevices)
+		device->dataBufferMs = ms > 0 ? ms : DEFAULT_DATA_BUFFER_MS;
+}
+
+float NIDAQThread::getDataBufferLength()
+{
+	return mNIDAQ->dataBufferMs;
+}
+
+int64 NIDAQThread::getDroppedSamples()
+{
+	return (int64)mNIDAQ->getStats().droppedSamples.load();
+}
+
+void NIDAQThread::setDataTransferMechanism(AI_XFER_MECH mech)
+{
+	for (auto device : nidaqDevices)
+		device->xferMech = mech;
+}
+
+AI_XFER_MECH NIDAQThread::getDataTransferMechanism()
+{
+	return mNIDAQ->xferMech;
+}
+
+void NIDAQThread::setDataTransferRequestCondition(AI_XFER_REQ_COND cond)
+{
+	for (auto device : nidaqDevices)
+		device->xferReqCond = cond;
+}
+
+AI_XFER_REQ_COND NIDAQThread::getDataTransferRequestCondition()
+{
+	return mNIDAQ->xferReqCond;
+}
+
+void NIDAQThread::setDigitalTimingMode(DI_TIMING_MODE mode)
+{
+	for (auto device : nidaqDevices)
+		device->diTimingMode = mode;
+}
+
+DI_TIMING_MODE NIDAQThread::getDigitalTimingMode()
+{
+	return mNIDAQ->diTimingMode;
+}
+
+void NIDAQThread::setOverrunRecovery(bool recover)
+{
+	for (auto device : nidaqDevices)
+		device->overrunRecovery = recover;
+}
+
+bool NIDAQThread::getOverrunRecovery()
+{
+	return mNIDAQ->overrunRecovery;
+}
+
+void NIDAQThread::setThreadSettings(const AcquisitionThreadSettings& settings)
+{
+	for (auto device : nidaqDevices)
+		device->threadSettings = settings;
+}
+
+AcquisitionThreadSettings NIDAQThread::getThreadSettings()
+{
+	return mNIDAQ->threadSettings;
+}
+
+void NIDAQThread::setNumSimulatedChannels(int numChannels)
+{
+	if (numChannels == dm->getNumSimulatedChannels())
+		return;
+
+	dm->setNumSimulatedChannels(numChannels);
+
+	if (!probing)
+		rescanDevices();
+}
+
+int NIDAQThread::getNumSimulatedChannels()
+{
+	return dm->getNumSimulatedChannels();
+}
+
+void NIDAQThread::setSimulation(const SimulationSettings& settings)
+{
+	for (auto device : nidaqDevices)
+		device->simulation = settings;
+}
+
+SimulationSettings NIDAQThread::getSimulation()
+{
+	return mNIDAQ->simulation;
+}
+
+const FifoCounters& NIDAQThread::getFifoCounters() const
+{
+	return mNIDAQ->getFifoCounters();
+}
+
+float NIDAQThread::getFillPercentage() const
+{
+	return mNIDAQ->getFifoCounters().getBufferFill();
+}
+
 int NIDAQThread::getVoltageRangeIndex()
 {
 	return voltageRangeIndex;
@@ -334,8 +1088,78 @@ XmlElement NIDAQThread::getInfoXml()
 /** Initializes data transfer.*/
 bool NIDAQThread::startAcquisition()
 {
-	
-	mNIDAQ->startThread();
+
+	/* With clock sharing, the first enabled PCIe/PXI board drives the AI sample clock and
+	   start trigger of the others at the same rate; DAQmx routes them over RTSI or the PXI backplane */
+	NIDAQmx* clockOwner = nullptr;
+	Array<NIDAQmx*> followers;
+
+	for (auto device : nidaqDevices)
+	{
+		device->clockSource = String();
+		device->startTrigger = String();
+
+		if (!device->deviceEnabled || !syncDevices || device->isUSBDevice)
+			continue;
+
+		if (clockOwner == nullptr)
+		{
+			clockOwner = device;
+		}
+		else if (device->samplerate == clockOwner->samplerate)
+		{
+			device->clockSource = "/" + clockOwner->deviceName + "/ai/SampleClock";
+			device->startTrigger = "/" + clockOwner->deviceName + "/ai/StartTrigger";
+			followers.add(device);
+		}
+		else
+		{
+			LOGC(getStreamName(device), " runs at a different rate than ", getStreamName(clockOwner), ", not sharing its clock");
+		}
+	}
+
+	/* Driver-side logs go next to the GUI recordings */
+	for (auto device : nidaqDevices)
+		device->loggingDirectory = CoreServices::getRecordingParentDirectory().getFullPathName();
+
+	/* Followers must be armed before the clock owner starts */
+	for (auto device : followers)
+	{
+		device->tasksStarted.reset();
+		device->startThread(device->getThreadPriority());
+	}
+
+	/* The owner's clock would drive followers that never armed, so nothing starts unless they all did */
+	for (auto device : followers)
+	{
+		String problem;
+		if (!device->tasksStarted.wait(TASK_START_TIMEOUT_MS))
+			problem = "didn't start its tasks in time";
+		else if (DAQmxFailed(device->startError))
+			problem = "failed to start its tasks (DAQmx error " + String(device->startError) + ")";
+
+		if (problem.isNotEmpty())
+		{
+			LOGE(getStreamName(device), " ", problem, ", not acquiring");
+			CoreServices::sendStatusMessage("NIDAQ: " + getStreamName(device) + " " + problem);
+
+			for (auto follower : followers)
+			{
+				follower->signalThreadShouldExit();
+				follower->notify();
+			}
+			for (auto follower : followers)
+				follower->waitForThreadToExit(TASK_START_TIMEOUT_MS);
+
+			return false;
+		}
+	}
+
+	for (auto device : nidaqDevices)
+	{
+		if (device->deviceEnabled && !followers.contains(device))
+			device->startThread(device->getThreadPriority());
+	}
 
     return true;
 }
@@ -344,9 +1168,13 @@ bool NIDAQThread::startAcquisition()
 bool NIDAQThread::stopAcquisition()
 {
 
-	if (mNIDAQ->isThreadRunning())
+	for (auto device : nidaqDevices)
 	{
-		mNIDAQ->signalThreadShouldExit();
+		if (device->isThreadRunning())
+		{
+			device->signalThreadShouldExit();
+			device->notify(); //wake the thread if it is waiting on driver callbacks
+		}
 	}
     return true;
 }
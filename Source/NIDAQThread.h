@@ -33,6 +33,8 @@
 #include "nidaq-api/NIDAQmx.h"
 #include "NIDAQComponents.h"
 
+#define TASK_START_TIMEOUT_MS 5000
+
 class SourceNode;
 class NIDAQThread;
 class NIDAQEditor;
@@ -80,6 +82,17 @@ public:
 	// Helper method for loading...
 	int swapConnection(String productName);
 
+	/** Shows the device with this serial number in the editor; returns 1 if there is none */
+	int selectDeviceBySerialNumber(String serialNumber);
+
+	/** Per-device channel settings (inputs, source types, range and rate) as DEVICE children of xml */
+	void saveDeviceSettings(XmlElement* xml);
+	void loadDeviceSettings(const XmlElement* xml);
+
+	/** Capability snapshot saved with the settings, so loading them doesn't have to probe the hardware again */
+	void saveCapabilities(XmlElement* xml);
+	void loadCapabilities(const XmlElement* xml);
+
 	/** Initializes data transfer.*/
 	bool startAcquisition() override;
 
@@ -99,6 +112,11 @@ public:
 	/** Input channel info */
 	int getNumAnalogInputs() const;
 	int getNumDigitalInputs() const;
+	int getNumCounterInputs() const;
+
+	/** Counter inputs in use are published as continuous channels after the analog inputs */
+	void setCounterMode(int index, COUNTER_MODE mode);
+	COUNTER_MODE getCounterMode(int index);
 
 	Array<String> getVoltageRanges();
 	int getVoltageRangeIndex();
@@ -113,7 +131,34 @@ public:
 	void toggleSourceType(int id);
 
 	int getNumAvailableDevices();
-	void selectFromAvailableDevices();
+
+	/** Enumerates and probes the connected devices; slow, called from the BackgroundLoader */
+	void probeDevices();
+
+	/** Replaces the placeholder device with the probed ones; must run on the message thread */
+	void finishProbing();
+
+	/** True until finishProbing has run */
+	bool isProbing() const;
+
+	/** Rescans the connected devices, probing only new ones; returns true if any changed */
+	bool rescanDevices();
+
+	/** Shows the device menu; returns true if the set of acquired devices changed */
+	bool selectFromAvailableDevices();
+
+	/** Devices acquired together, one stream each */
+	void setDeviceEnabled(int index, bool enabled);
+	bool isDeviceEnabled(int index) const;
+	int getNumEnabledDevices() const;
+	String getDeviceSerialNumber(int index) const;
+
+	/** Index of the device shown in the editor */
+	int getSelectedDeviceIndex() const;
+
+	/** Shares the AI sample clock and start trigger of the first PCIe/PXI device with the others */
+	void setDeviceSync(bool sync);
+	bool getDeviceSync() const;
 
 	/** Sets the voltage range of the data source. */
 	void setVoltageRange(int rangeIndex);
@@ -124,10 +169,82 @@ public:
 	/** Returns the sample rate of the data source.*/
 	float getSampleRate();
 
+	/** Advanced device options: low-pass and decimate to about this rate before the data reaches the GUI (0 : off) */
+	void setOutputRate(float rate);
+	float getOutputRate();
+
+	/** Advanced device options: have DAQmx log the raw AI data to a TDMS file in the recording directory while streaming */
+	void setDriverLogging(bool enabled);
+	bool getDriverLogging();
+
+	/** Selects between scaled F64 reads and raw I16 reads */
+	void setReadMode(AI_READ_MODE mode);
+	AI_READ_MODE getReadMode();
+
+	/** Selects between the blocking read loop and the every N samples callback */
+	void setAcquisitionMode(ACQUISITION_MODE mode);
+	ACQUISITION_MODE getAcquisitionMode();
+
+	/** Scans per channel in each read, 0 for the device default; applies to all devices */
+	void setSamplesPerRead(int samples);
+	int getSamplesPerRead();
+
+	/** Target latency in ms used to size each read when samplesPerRead is 0 (0 : adapt to the backlog); applies to all devices */
+	void setTargetLatency(float latencyMs);
+	float getTargetLatency();
+
+	/** Advanced device options: DAQmx input buffer length in ms (0 : scale with rate and channel count); applies to all devices */
+	void setInputBufferLength(float ms);
+	float getInputBufferLength();
+
+	/** Headroom of the DataBuffer, applied when the settings are next updated; applies to all devices */
+	void setDataBufferLength(float ms);
+	float getDataBufferLength();
+
+	/** Samples per channel the DataBuffer of the device shown had no room for since the last stats reset */
+	int64 getDroppedSamples();
+
+	/** Advanced device options: AI data transfer mechanism and request condition; apply to all devices */
+	void setDataTransferMechanism(AI_XFER_MECH mech);
+	AI_XFER_MECH getDataTransferMechanism();
+	void setDataTransferRequestCondition(AI_XFER_REQ_COND cond);
+	AI_XFER_REQ_COND getDataTransferRequestCondition();
+
+	/** Selects between sampling DI on every AI scan and hardware change detection; applies to all devices */
+	void setDigitalTimingMode(DI_TIMING_MODE mode);
+	DI_TIMING_MODE getDigitalTimingMode();
+
+	/** Acquisition counters of the device shown in the editor; read without locking */
+	const FifoCounters& getFifoCounters() const;
+
+	/** DataBuffer fill of the device shown in the editor, 0 to 1 */
+	float getFillPercentage() const;
+
+	/** Telemetry of every device as text, one stream per line group; see handleConfigMessage */
+	String getStatsReport() const;
+	void resetStats();
+
+	/** Restarts the tasks in place after a driver buffer overflow instead of stopping; applies to all devices */
+	void setOverrunRecovery(bool recover);
+	bool getOverrunRecovery();
+
+	/** Advanced device options: priority, core and MMCSS task of the acquisition threads; applies to all devices */
+	void setThreadSettings(const AcquisitionThreadSettings& settings);
+	AcquisitionThreadSettings getThreadSettings();
+
+	/** SimulatedDevice, used when no hardware is found: AI channel count (1 to MAX_SIMULATED_CHANNELS) and signals */
+	void setNumSimulatedChannels(int numChannels);
+	int getNumSimulatedChannels();
+	void setSimulation(const SimulationSettings& settings);
+	SimulationSettings getSimulation();
+
 	/** Responds to broadcast messages sent during acquisition */
 	void handleBroadcastMessage(String msg) override;
 
-	/** Responds to config messages sent while acquisition is stopped */
+	/** Responds to config messages sent while acquisition is stopped
+		NIDAQ STATS : returns the latency histograms and drop counts
+		NIDAQ STATS RESET : clears them
+		NIDAQ SIMULATE <setting> <value> : configures the SimulatedDevice */
 	String handleConfigMessage(String msg) override;
 
 	CriticalSection* getMutex()
@@ -156,12 +273,25 @@ private:
 	/* Flag any available devices */
 	bool inputAvailable;
 
-	/* Handle to current NIDAQ device */
-	ScopedPointer<NIDAQmx> mNIDAQ;
+	/* All connected NIDAQ devices, each with its own acquisition thread */
+	OwnedArray<NIDAQmx> nidaqDevices;
+
+	/* Device shown and edited in the editor */
+	NIDAQmx* mNIDAQ;
 
 	/* Array of source streams -- one per connected NIDAQ device */
 	OwnedArray<DataStream> sourceStreams;
 
+	/* Share the sample clock and start trigger between PCIe/PXI devices */
+	bool syncDevices;
+
+	/* Devices have not been probed yet */
+	bool probing;
+
+	void selectDevice(int index);
+
+	String getStreamName(NIDAQmx* device) const;
+
 	/* Handle to input channels */
 	Array<AnalogIn> ai;
 	Array<DigitalIn> di;
@@ -176,8 +306,6 @@ private:
 
 	void closeConnection();
 
-	Array<float> fillPercentage;
-
 };
 
 #endif  // __NIDAQTHREAD_H__